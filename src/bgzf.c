@@ -0,0 +1,93 @@
+#define __GT4_BGZF_C__
+
+#include <string.h>
+#include <zlib.h>
+
+#include "bgzf.h"
+
+#define BGZF_HEADER_SIZE 18
+#define BGZF_FOOTER_SIZE 8
+#define BGZF_MAX_BLOCK 65536
+
+static const unsigned char bgzf_header[BGZF_HEADER_SIZE] = {
+  0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0, 0, 0
+};
+
+static const unsigned char bgzf_eof[28] = {
+  0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0, 0x1b, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+static void
+put_u32 (unsigned char *d, unsigned int v)
+{
+  d[0] = v & 0xff;
+  d[1] = (v >> 8) & 0xff;
+  d[2] = (v >> 16) & 0xff;
+  d[3] = (v >> 24) & 0xff;
+}
+
+unsigned long long
+gt4_bgzf_bound (unsigned long long len)
+{
+  unsigned long long nblocks = (len + GT4_BGZF_BLOCK_SIZE - 1) / GT4_BGZF_BLOCK_SIZE;
+  return nblocks * BGZF_MAX_BLOCK;
+}
+
+/* Compress single block, stored if it does not fit */
+static unsigned int
+compress_block (z_stream *zs, unsigned char *dst, const unsigned char *src, unsigned int len)
+{
+  unsigned int size;
+  if (deflateReset (zs) != Z_OK) return 0;
+  zs->next_in = (unsigned char *) src;
+  zs->avail_in = len;
+  zs->next_out = dst + BGZF_HEADER_SIZE;
+  zs->avail_out = BGZF_MAX_BLOCK - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+  if (deflate (zs, Z_FINISH) == Z_STREAM_END) {
+    size = BGZF_HEADER_SIZE + zs->total_out + BGZF_FOOTER_SIZE;
+  } else {
+    /* Single final stored deflate block */
+    unsigned char *d = dst + BGZF_HEADER_SIZE;
+    d[0] = 1;
+    d[1] = len & 0xff;
+    d[2] = len >> 8;
+    d[3] = ~len & 0xff;
+    d[4] = (~len >> 8) & 0xff;
+    memcpy (d + 5, src, len);
+    size = BGZF_HEADER_SIZE + 5 + len + BGZF_FOOTER_SIZE;
+  }
+  memcpy (dst, bgzf_header, BGZF_HEADER_SIZE);
+  dst[16] = (size - 1) & 0xff;
+  dst[17] = (size - 1) >> 8;
+  put_u32 (dst + size - 8, crc32 (crc32 (0, NULL, 0), src, len));
+  put_u32 (dst + size - 4, len);
+  return size;
+}
+
+unsigned long long
+gt4_bgzf_compress (unsigned char *dst, const void *src, unsigned long long len, int level)
+{
+  const unsigned char *s = (const unsigned char *) src;
+  unsigned long long pos, dpos;
+  z_stream zs;
+  memset (&zs, 0, sizeof (zs));
+  if (deflateInit2 (&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return 0;
+  dpos = 0;
+  for (pos = 0; pos < len; pos += GT4_BGZF_BLOCK_SIZE) {
+    unsigned int blen = (len - pos < GT4_BGZF_BLOCK_SIZE) ? len - pos : GT4_BGZF_BLOCK_SIZE;
+    unsigned int size = compress_block (&zs, dst + dpos, s + pos, blen);
+    if (!size) {
+      deflateEnd (&zs);
+      return 0;
+    }
+    dpos += size;
+  }
+  deflateEnd (&zs);
+  return dpos;
+}
+
+unsigned int
+gt4_bgzf_write_eof (FILE *ofs)
+{
+  return fwrite (bgzf_eof, 1, sizeof (bgzf_eof), ofs) != sizeof (bgzf_eof);
+}
@@ -0,0 +1,25 @@
+#ifndef __GT4_BGZF_H__
+#define __GT4_BGZF_H__
+
+#include <stdio.h>
+
+/*
+ * BGZF (blocked gzip) output
+ *
+ * Data is split into independent gzip members of at most GT4_BGZF_BLOCK_SIZE
+ * uncompressed bytes, so separate buffers can be compressed in parallel and
+ * concatenated. The file has to be terminated with the empty EOF block.
+ */
+
+#define GT4_BGZF_BLOCK_SIZE 65280
+/* zlib default compression level */
+#define GT4_BGZF_DEFAULT_LEVEL -1
+
+/* Upper bound of compressed size */
+unsigned long long gt4_bgzf_bound (unsigned long long len);
+/* Compress len bytes to dst (at least gt4_bgzf_bound bytes), return compressed size or 0 on error */
+unsigned long long gt4_bgzf_compress (unsigned char *dst, const void *src, unsigned long long len, int level);
+/* Write end-of-file block, return 0 on success */
+unsigned int gt4_bgzf_write_eof (FILE *ofs);
+
+#endif
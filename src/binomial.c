@@ -287,6 +287,435 @@ dnbinom_mu_precalc_f (unsigned int x, float size, float mu, float log_n_combinat
   return dnbinom_precalc_f (x, size, p, log_n_combinations);
 }
 
+double
+digamma (double x)
+{
+  double val, x2;
+  assert (x > 0);
+  /* Shift to x >= 6 for asymptotic series */
+  val = 0;
+  while (x < 6) {
+    val -= 1 / x;
+    x += 1;
+  }
+  x2 = 1 / (x * x);
+  val += log (x) - 0.5 / x - x2 * (1.0 / 12 - x2 * (1.0 / 120 - x2 * (1.0 / 252 - x2 * (1.0 / 240 - x2 / 132))));
+  return val;
+}
+
+double
+dnbinom_mu_d (unsigned int x, double size, double mu, double *dl_size, double *dl_mu)
+{
+  if ((size <= 0) || (mu <= 0)) {
+    *dl_size = 0;
+    *dl_mu = 0;
+    return 0;
+  }
+  /* log f = lgamma (x + size) - lgamma (size) - log x! + x log mu + size log size - (x + size) log (size + mu) */
+  *dl_size = (x ? digamma (x + size) - digamma (size) : 0) + log (size / (size + mu)) + (mu - x) / (size + mu);
+  *dl_mu = x / mu - (x + size) / (size + mu);
+  return dnbinom_mu (x, size, mu);
+}
+
+/* Float32 batch kernels */
+
+#if defined (__AVX2__)
+#include <immintrin.h>
+#define BINOMIAL_VW 8
+typedef __m256 vfloat;
+typedef __m256i vint;
+#define vf_set(v) _mm256_set1_ps (v)
+#define vf_load(p) _mm256_loadu_ps (p)
+#define vf_store(p, v) _mm256_storeu_ps (p, v)
+#define vf_load_u32(p) _mm256_cvtepi32_ps (_mm256_loadu_si256 ((const __m256i *) (p)))
+#define vf_add(a, b) _mm256_add_ps (a, b)
+#define vf_sub(a, b) _mm256_sub_ps (a, b)
+#define vf_mul(a, b) _mm256_mul_ps (a, b)
+#define vf_div(a, b) _mm256_div_ps (a, b)
+#define vf_min(a, b) _mm256_min_ps (a, b)
+#define vf_max(a, b) _mm256_max_ps (a, b)
+#define vf_lt(a, b) _mm256_cmp_ps (a, b, _CMP_LT_OQ)
+#define vf_eq(a, b) _mm256_cmp_ps (a, b, _CMP_EQ_OQ)
+#define vf_select(m, a, b) _mm256_blendv_ps (b, a, m)
+#define vf_as_int(a) _mm256_castps_si256 (a)
+#define vf_to_int(a) _mm256_cvttps_epi32 (a)
+#define vi_set(v) _mm256_set1_epi32 (v)
+#define vi_and(a, b) _mm256_and_si256 (a, b)
+#define vi_or(a, b) _mm256_or_si256 (a, b)
+#define vi_add(a, b) _mm256_add_epi32 (a, b)
+#define vi_sub(a, b) _mm256_sub_epi32 (a, b)
+#define vi_srl(a, n) _mm256_srli_epi32 (a, n)
+#define vi_sll(a, n) _mm256_slli_epi32 (a, n)
+#define vi_as_float(a) _mm256_castsi256_ps (a)
+#define vi_to_float(a) _mm256_cvtepi32_ps (a)
+#elif defined (__SSE2__)
+#include <emmintrin.h>
+#define BINOMIAL_VW 4
+typedef __m128 vfloat;
+typedef __m128i vint;
+#define vf_set(v) _mm_set1_ps (v)
+#define vf_load(p) _mm_loadu_ps (p)
+#define vf_store(p, v) _mm_storeu_ps (p, v)
+#define vf_load_u32(p) _mm_cvtepi32_ps (_mm_loadu_si128 ((const __m128i *) (p)))
+#define vf_add(a, b) _mm_add_ps (a, b)
+#define vf_sub(a, b) _mm_sub_ps (a, b)
+#define vf_mul(a, b) _mm_mul_ps (a, b)
+#define vf_div(a, b) _mm_div_ps (a, b)
+#define vf_min(a, b) _mm_min_ps (a, b)
+#define vf_max(a, b) _mm_max_ps (a, b)
+#define vf_lt(a, b) _mm_cmplt_ps (a, b)
+#define vf_eq(a, b) _mm_cmpeq_ps (a, b)
+#define vf_select(m, a, b) _mm_or_ps (_mm_and_ps (m, a), _mm_andnot_ps (m, b))
+#define vf_as_int(a) _mm_castps_si128 (a)
+#define vf_to_int(a) _mm_cvttps_epi32 (a)
+#define vi_set(v) _mm_set1_epi32 (v)
+#define vi_and(a, b) _mm_and_si128 (a, b)
+#define vi_or(a, b) _mm_or_si128 (a, b)
+#define vi_add(a, b) _mm_add_epi32 (a, b)
+#define vi_sub(a, b) _mm_sub_epi32 (a, b)
+#define vi_srl(a, n) _mm_srli_epi32 (a, n)
+#define vi_sll(a, n) _mm_slli_epi32 (a, n)
+#define vi_as_float(a) _mm_castsi128_ps (a)
+#define vi_to_float(a) _mm_cvtepi32_ps (a)
+#else
+/* Scalar fallback, masks are only used by vf_select */
+#define BINOMIAL_VW 1
+typedef float vfloat;
+typedef unsigned int vint;
+#define vf_set(v) ((float) (v))
+#define vf_load(p) (*(p))
+#define vf_store(p, v) (*(p) = (v))
+#define vf_load_u32(p) ((float) (int) *(p))
+#define vf_add(a, b) ((a) + (b))
+#define vf_sub(a, b) ((a) - (b))
+#define vf_mul(a, b) ((a) * (b))
+#define vf_div(a, b) ((a) / (b))
+#define vf_min(a, b) (((a) < (b)) ? (a) : (b))
+#define vf_max(a, b) (((a) > (b)) ? (a) : (b))
+#define vf_lt(a, b) ((a) < (b))
+#define vf_eq(a, b) ((a) == (b))
+#define vf_select(m, a, b) ((m) ? (a) : (b))
+#define vf_to_int(a) ((vint) (int) (a))
+#define vi_set(v) ((vint) (v))
+#define vi_and(a, b) ((a) & (b))
+#define vi_or(a, b) ((a) | (b))
+#define vi_add(a, b) ((a) + (b))
+#define vi_sub(a, b) ((a) - (b))
+#define vi_srl(a, n) ((a) >> (n))
+#define vi_sll(a, n) ((a) << (n))
+#define vi_to_float(a) ((float) (int) (a))
+
+static inline vint
+vf_as_int (float a)
+{
+  union { float f; unsigned int i; } v;
+  v.f = a;
+  return v.i;
+}
+
+static inline float
+vi_as_float (vint a)
+{
+  union { float f; unsigned int i; } v;
+  v.i = a;
+  return v.f;
+}
+#endif
+
+/* Natural logarithm of positive normal numbers (Cephes logf) */
+static inline vfloat
+v_log (vfloat x)
+{
+  vint bits = vf_as_int (x);
+  vfloat e, m, small, z, y;
+  /* x = m * 2^e, 0.5 <= m < 1 */
+  e = vi_to_float (vi_sub (vi_srl (bits, 23), vi_set (126)));
+  m = vi_as_float (vi_or (vi_and (bits, vi_set (0x007fffff)), vi_set (0x3f000000)));
+  small = vf_lt (m, vf_set (0.707106781186547524f));
+  e = vf_select (small, vf_sub (e, vf_set (1)), e);
+  m = vf_sub (vf_select (small, vf_add (m, m), m), vf_set (1));
+  z = vf_mul (m, m);
+  y = vf_set (7.0376836292e-2f);
+  y = vf_add (vf_mul (y, m), vf_set (-1.1514610310e-1f));
+  y = vf_add (vf_mul (y, m), vf_set (1.1676998740e-1f));
+  y = vf_add (vf_mul (y, m), vf_set (-1.2420140846e-1f));
+  y = vf_add (vf_mul (y, m), vf_set (1.4249322787e-1f));
+  y = vf_add (vf_mul (y, m), vf_set (-1.6668057665e-1f));
+  y = vf_add (vf_mul (y, m), vf_set (2.0000714765e-1f));
+  y = vf_add (vf_mul (y, m), vf_set (-2.4999993993e-1f));
+  y = vf_add (vf_mul (y, m), vf_set (3.3333331174e-1f));
+  y = vf_mul (vf_mul (y, m), z);
+  y = vf_add (y, vf_mul (e, vf_set (-2.12194440e-4f)));
+  y = vf_sub (y, vf_mul (z, vf_set (0.5f)));
+  return vf_add (vf_add (m, y), vf_mul (e, vf_set (0.693359375f)));
+}
+
+/* Exponent (Cephes expf), 0 below -87.3 (including -inf) */
+static inline vfloat
+v_exp (vfloat x)
+{
+  vfloat under = vf_lt (x, vf_set (-87.3f));
+  vfloat fx, t, z, y;
+  x = vf_max (vf_min (x, vf_set (88.3f)), vf_set (-87.3f));
+  /* fx = floor (x / ln 2 + 0.5) */
+  fx = vf_add (vf_mul (x, vf_set (1.44269504088896341f)), vf_set (0.5f));
+  t = vi_to_float (vf_to_int (fx));
+  fx = vf_select (vf_lt (fx, t), vf_sub (t, vf_set (1)), t);
+  x = vf_sub (x, vf_mul (fx, vf_set (0.693359375f)));
+  x = vf_sub (x, vf_mul (fx, vf_set (-2.12194440e-4f)));
+  z = vf_mul (x, x);
+  y = vf_set (1.9875691500e-4f);
+  y = vf_add (vf_mul (y, x), vf_set (1.3981999507e-3f));
+  y = vf_add (vf_mul (y, x), vf_set (8.3334519073e-3f));
+  y = vf_add (vf_mul (y, x), vf_set (4.1665795894e-2f));
+  y = vf_add (vf_mul (y, x), vf_set (1.6666665459e-1f));
+  y = vf_add (vf_mul (y, x), vf_set (5.0000001201e-1f));
+  y = vf_add (vf_add (vf_mul (y, z), x), vf_set (1));
+  /* Multiply by 2^fx */
+  y = vf_mul (y, vi_as_float (vi_sll (vi_add (vf_to_int (fx), vi_set (127)), 23)));
+  return vf_select (under, vf_set (0), y);
+}
+
+/* Stirling series of log gamma without the leading terms, z >= 8 */
+static inline vfloat
+v_stirling (vfloat z)
+{
+  vfloat w = vf_div (vf_set (1), z);
+  vfloat w2 = vf_mul (w, w);
+  vfloat s = vf_sub (vf_set (1.0f / 360), vf_mul (w2, vf_set (1.0f / 1260)));
+  return vf_mul (w, vf_sub (vf_set (1.0f / 12), vf_mul (w2, s)));
+}
+
+/* Log gamma of positive numbers, shifted to x >= 8 */
+static inline vfloat
+v_lgamma (vfloat x)
+{
+  vfloat prod = vf_set (1);
+  vfloat s;
+  unsigned int i;
+  for (i = 0; i < 8; i++) {
+    vfloat small = vf_lt (x, vf_set (8));
+    prod = vf_select (small, vf_mul (prod, x), prod);
+    x = vf_select (small, vf_add (x, vf_set (1)), x);
+  }
+  s = vf_sub (vf_mul (vf_sub (x, vf_set (0.5f)), v_log (x)), x);
+  s = vf_add (vf_add (s, v_stirling (x)), vf_set (0.918938533204672742f));
+  return vf_sub (s, v_log (prod));
+}
+
+/* log (1 + u), u > -1 */
+static inline vfloat
+v_log1p (vfloat u)
+{
+  vfloat w = vf_add (vf_set (1), u);
+  vfloat d = vf_sub (w, vf_set (1));
+  /* Rounding of w is compensated by u / (w - 1) */
+  vfloat r = vf_div (vf_mul (v_log (w), u), vf_select (vf_eq (d, vf_set (0)), vf_set (1), d));
+  return vf_select (vf_eq (d, vf_set (0)), u, r);
+}
+
+/* Exactly 0 for 0 and 1 */
+static inline vfloat
+v_log_factorial (vfloat x)
+{
+  return vf_select (vf_lt (x, vf_set (1.5f)), vf_set (0), v_lgamma (vf_add (x, vf_set (1))));
+}
+
+/*
+ * lgamma (b + r - 1) - lgamma (b) - lgamma (r) for integer b >= 1 and r > 0
+ * Large terms are combined before rounding to avoid cancellation
+ */
+static inline vfloat
+v_log_comb (vfloat b, vfloat r)
+{
+  vfloat one = vf_set (1), half = vf_set (0.5f);
+  vfloat a, la_b, la_r, lg_r, big, small_r, p0, p1, direct;
+  unsigned int i;
+  /* b < 9: product of (r + i - 1) / i for i < b */
+  p0 = one;
+  p1 = one;
+  for (i = 1; i < 9; i++) {
+    vfloat t = vf_select (vf_lt (vf_set (i), b), vf_div (vf_add (r, vf_set (i - 1)), vf_set (i)), one);
+    if (i <= 4) {
+      p0 = vf_mul (p0, t);
+    } else {
+      p1 = vf_mul (p1, t);
+    }
+  }
+  direct = vf_add (v_log (p0), v_log (p1));
+  /* b >= 9: Stirling series, a = b + r - 1 >= 8 */
+  a = vf_add (b, vf_sub (r, one));
+  la_b = v_log1p (vf_div (vf_sub (r, one), b));
+  la_r = v_log1p (vf_div (vf_sub (b, one), r));
+  /* r >= 8: (b - 0.5) log (a / b) + (r - 0.5) log (a / r) - 0.5 log (a) + 1 - log (2pi) / 2 */
+  big = vf_add (vf_mul (vf_sub (b, half), la_b), vf_mul (vf_sub (r, half), la_r));
+  big = vf_sub (big, vf_mul (half, v_log (a)));
+  big = vf_add (big, vf_set (1 - 0.918938533204672742f));
+  big = vf_sub (big, v_stirling (vf_max (r, vf_set (8))));
+  /* r < 8: (a - 0.5) log (a / b) + (r - 1) (log (b) - 1) - lgamma (r) */
+  lg_r = v_lgamma (r);
+  small_r = vf_add (vf_mul (vf_sub (a, half), la_b), vf_mul (vf_sub (r, one), vf_sub (v_log (b), one)));
+  small_r = vf_sub (small_r, lg_r);
+  big = vf_select (vf_lt (r, vf_set (8)), small_r, big);
+  big = vf_add (big, vf_sub (v_stirling (vf_max (a, vf_set (8))), v_stirling (vf_max (b, vf_set (8)))));
+  return vf_select (vf_lt (b, vf_set (9)), direct, big);
+}
+
+/* Tails shorter than vector are zero-padded */
+#define pad_u32(dst, src, n) { memset (dst, 0, sizeof (dst)); memcpy (dst, src, (n) * sizeof (unsigned int)); }
+#define pad_f(dst, src, n) { memset (dst, 0, sizeof (dst)); memcpy (dst, src, (n) * sizeof (float)); }
+
+void
+log_factorial_v (float dst[], const unsigned int x[], unsigned int n)
+{
+  unsigned int i;
+  for (i = 0; i + BINOMIAL_VW <= n; i += BINOMIAL_VW) {
+    vf_store (dst + i, v_log_factorial (vf_load_u32 (x + i)));
+  }
+  if (i < n) {
+    unsigned int xt[BINOMIAL_VW];
+    float dt[BINOMIAL_VW];
+    pad_u32 (xt, x + i, n - i);
+    log_factorial_v (dt, xt, BINOMIAL_VW);
+    memcpy (dst + i, dt, (n - i) * sizeof (float));
+  }
+}
+
+void
+log_combination_k_r_v (float dst[], const unsigned int k[], unsigned int n, float r)
+{
+  unsigned int i;
+  for (i = 0; i + BINOMIAL_VW <= n; i += BINOMIAL_VW) {
+    vfloat vk = vf_load_u32 (k + i);
+    vf_store (dst + i, v_log_comb (vf_add (vk, vf_set (1)), vf_set (r)));
+  }
+  if (i < n) {
+    unsigned int kt[BINOMIAL_VW];
+    float dt[BINOMIAL_VW];
+    pad_u32 (kt, k + i, n - i);
+    log_combination_k_r_v (dt, kt, BINOMIAL_VW, r);
+    memcpy (dst + i, dt, (n - i) * sizeof (float));
+  }
+}
+
+void
+log_dnbinom_mu_v (float dst[], const unsigned int x[], unsigned int n, float size, float mu)
+{
+  vfloat lp, c;
+  unsigned int i;
+  if ((size <= 0) || (mu <= 0)) {
+    for (i = 0; i < n; i++) dst[i] = -INFINITY;
+    return;
+  }
+  /* log (p), size * log (1 - p) */
+  lp = vf_set ((float) log (mu / ((double) size + mu)));
+  c = vf_set ((float) (size * log (size / ((double) size + mu))));
+  for (i = 0; i + BINOMIAL_VW <= n; i += BINOMIAL_VW) {
+    vfloat vx = vf_load_u32 (x + i);
+    vfloat comb = v_log_comb (vf_add (vx, vf_set (1)), vf_set (size));
+    vf_store (dst + i, vf_add (vf_add (comb, vf_mul (vx, lp)), c));
+  }
+  if (i < n) {
+    unsigned int xt[BINOMIAL_VW];
+    float dt[BINOMIAL_VW];
+    pad_u32 (xt, x + i, n - i);
+    log_dnbinom_mu_v (dt, xt, BINOMIAL_VW, size, mu);
+    memcpy (dst + i, dt, (n - i) * sizeof (float));
+  }
+}
+
+void
+dnbinom_mu_precalc_v (float dst[], const unsigned int x[], const float log_n_combinations[], unsigned int n, float size, float mu)
+{
+  vfloat lp, c;
+  unsigned int i;
+  if ((size <= 0) || (mu <= 0)) {
+    memset (dst, 0, n * sizeof (float));
+    return;
+  }
+  lp = vf_set ((float) log (mu / ((double) size + mu)));
+  c = vf_set ((float) (size * log (size / ((double) size + mu))));
+  for (i = 0; i + BINOMIAL_VW <= n; i += BINOMIAL_VW) {
+    vfloat vx = vf_load_u32 (x + i);
+    vf_store (dst + i, v_exp (vf_add (vf_add (vf_load (log_n_combinations + i), vf_mul (vx, lp)), c)));
+  }
+  if (i < n) {
+    unsigned int xt[BINOMIAL_VW];
+    float ct[BINOMIAL_VW], dt[BINOMIAL_VW];
+    pad_u32 (xt, x + i, n - i);
+    pad_f (ct, log_n_combinations + i, n - i);
+    dnbinom_mu_precalc_v (dt, xt, ct, BINOMIAL_VW, size, mu);
+    memcpy (dst + i, dt, (n - i) * sizeof (float));
+  }
+}
+
+void
+log_dbinom_v (float dst[], const unsigned int x[], const unsigned int size[], unsigned int n, float p)
+{
+  vfloat lp, lq;
+  unsigned int i;
+  if ((p <= 0) || (p >= 1)) {
+    /* Only x == 0 (p == 0) or x == size (p == 1) are possible */
+    for (i = 0; i < n; i++) dst[i] = (x[i] == ((p <= 0) ? 0 : size[i])) ? 0 : -INFINITY;
+    return;
+  }
+  lp = vf_set ((float) log (p));
+  lq = vf_set ((float) log (1 - (double) p));
+  for (i = 0; i + BINOMIAL_VW <= n; i += BINOMIAL_VW) {
+    vfloat vx = vf_load_u32 (x + i);
+    vfloat vy = vf_sub (vf_load_u32 (size + i), vx);
+    /* lgamma (size + 1) - lgamma (x + 1) - lgamma (size - x + 1) */
+    vfloat comb = v_log_comb (vf_add (vx, vf_set (1)), vf_add (vy, vf_set (1)));
+    vf_store (dst + i, vf_add (vf_add (comb, vf_mul (vx, lp)), vf_mul (vy, lq)));
+  }
+  if (i < n) {
+    unsigned int xt[BINOMIAL_VW], nt[BINOMIAL_VW];
+    float dt[BINOMIAL_VW];
+    pad_u32 (xt, x + i, n - i);
+    pad_u32 (nt, size + i, n - i);
+    log_dbinom_v (dt, xt, nt, BINOMIAL_VW, p);
+    memcpy (dst + i, dt, (n - i) * sizeof (float));
+  }
+}
+
+void
+log_poisson_v (float dst[], const unsigned int k[], unsigned int n, float lambda)
+{
+  vfloat ll;
+  unsigned int i;
+  if (lambda <= 0) {
+    for (i = 0; i < n; i++) dst[i] = (k[i]) ? -INFINITY : 0;
+    return;
+  }
+  ll = vf_set ((float) log (lambda));
+  for (i = 0; i + BINOMIAL_VW <= n; i += BINOMIAL_VW) {
+    vfloat vk = vf_load_u32 (k + i);
+    vf_store (dst + i, vf_sub (vf_sub (vf_mul (vk, ll), vf_set (lambda)), v_log_factorial (vk)));
+  }
+  if (i < n) {
+    unsigned int kt[BINOMIAL_VW];
+    float dt[BINOMIAL_VW];
+    pad_u32 (kt, k + i, n - i);
+    log_poisson_v (dt, kt, BINOMIAL_VW, lambda);
+    memcpy (dst + i, dt, (n - i) * sizeof (float));
+  }
+}
+
+void
+exp_v (float dst[], const float src[], unsigned int n)
+{
+  unsigned int i;
+  for (i = 0; i + BINOMIAL_VW <= n; i += BINOMIAL_VW) {
+    vf_store (dst + i, v_exp (vf_load (src + i)));
+  }
+  if (i < n) {
+    float st[BINOMIAL_VW], dt[BINOMIAL_VW];
+    pad_f (st, src + i, n - i);
+    exp_v (dt, st, BINOMIAL_VW);
+    memcpy (dst + i, dt, (n - i) * sizeof (float));
+  }
+}
+
 #define pi 3.14159265359
 
 double
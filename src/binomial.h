@@ -25,6 +25,26 @@ double dnbinom_mu (unsigned int x, double size, double mu);
 double dnbinom_mu_precalc (unsigned int x, double size, double mu, double log_n_combinations);
 float dnbinom_mu_precalc_f (unsigned int x, float size, float mu, float log_n_combinations);
 
+double digamma (double x);
+/* Negative binomial density with partial derivatives of its logarithm by size and mu (zero if density is 0) */
+double dnbinom_mu_d (unsigned int x, double size, double mu, double *dl_size, double *dl_mu);
+
+/*
+ * Float32 batch kernels over arrays of counts with shared parameters
+ * Use AVX2 or SSE2 if enabled at compile time, same approximations in scalar code otherwise
+ * Log densities have error below BINOMIAL_V_TOLERANCE relative to the magnitude of their terms (checked by kerneltest)
+ */
+
+#define BINOMIAL_V_TOLERANCE 2e-6
+
+void log_factorial_v (float dst[], const unsigned int x[], unsigned int n);
+void log_combination_k_r_v (float dst[], const unsigned int k[], unsigned int n, float r);
+void log_dnbinom_mu_v (float dst[], const unsigned int x[], unsigned int n, float size, float mu);
+void dnbinom_mu_precalc_v (float dst[], const unsigned int x[], const float log_n_combinations[], unsigned int n, float size, float mu);
+void log_dbinom_v (float dst[], const unsigned int x[], const unsigned int size[], unsigned int n, float p);
+void log_poisson_v (float dst[], const unsigned int k[], unsigned int n, float lambda);
+void exp_v (float dst[], const float src[], unsigned int n);
+
 double PDF (double x, double mu, double sigma);
 double CDF (double x, double mu, double sigma);
 
@@ -0,0 +1,94 @@
+#define __COUNTMIN_C__
+
+
+/*
+ * GenomeTester4
+ *
+ * A toolkit for creating and manipulating k-mer lists from biological sequences
+ * 
+ * Copyright (C) 2014-2016 University of Tartu
+ *
+ * Authors: Maarja Lepamets and Lauris Kaplinski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+#include "countmin.h"
+
+/* Odd multipliers for multiply-shift hashing, one per row */
+static const unsigned long long multipliers[COUNTMIN_MAX_ROWS] = {
+	0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL,
+	0xff51afd7ed558ccdULL, 0xc4ceb9fe1a85ec53ULL, 0x94d049bb133111ebULL, 0xbf58476d1ce4e5b9ULL
+};
+
+static unsigned long long
+countmin_hash (CountMin *cm, unsigned int row, unsigned long long word)
+{
+	word ^= word >> 31;
+	return ((word * multipliers[row]) >> (64 - cm->nbits)) + ((unsigned long long) row << cm->nbits);
+}
+
+int
+countmin_init (CountMin *cm, unsigned long long size, unsigned int nrows, unsigned int cap)
+{
+	if (nrows < 1) nrows = 1;
+	if (nrows > COUNTMIN_MAX_ROWS) nrows = COUNTMIN_MAX_ROWS;
+	memset (cm, 0, sizeof (CountMin));
+	cm->nrows = nrows;
+	cm->nbits = 10;
+	while ((cm->nbits < 40) && (((2ULL << cm->nbits) * nrows) <= size)) cm->nbits += 1;
+	cm->cap = (cap > 255) ? 255 : cap;
+	if (cm->cap < 1) cm->cap = 1;
+	cm->counters = (unsigned char *) calloc (((unsigned long long) nrows) << cm->nbits, 1);
+	if (!cm->counters) return GT_OUT_OF_MEMORY_ERROR;
+	return 0;
+}
+
+void
+countmin_release (CountMin *cm)
+{
+	free (cm->counters);
+	cm->counters = NULL;
+}
+
+void
+countmin_add (CountMin *cm, unsigned long long word)
+{
+	unsigned int row;
+	for (row = 0; row < cm->nrows; row++) {
+		unsigned char *c = cm->counters + countmin_hash (cm, row, word);
+		unsigned char v = *c;
+		/* Saturating increment, retry if another thread got there first */
+		while (v < cm->cap) {
+			if (__sync_bool_compare_and_swap (c, v, v + 1)) break;
+			v = *c;
+		}
+	}
+}
+
+unsigned int
+countmin_estimate (CountMin *cm, unsigned long long word)
+{
+	unsigned int row, est = cm->cap;
+	for (row = 0; row < cm->nrows; row++) {
+		unsigned int v = cm->counters[countmin_hash (cm, row, word)];
+		if (v < est) est = v;
+	}
+	return est;
+}
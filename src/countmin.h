@@ -0,0 +1,54 @@
+#ifndef __COUNTMIN_H__
+#define __COUNTMIN_H__
+
+/*
+ * GenomeTester4
+ *
+ * A toolkit for creating and manipulating k-mer lists from biological sequences
+ * 
+ * Copyright (C) 2014-2016 University of Tartu
+ *
+ * Authors: Maarja Lepamets and Lauris Kaplinski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Count-min sketch of word frequencies
+ *
+ * Counters never underestimate, so a word with estimate below cutoff is known
+ * to occur less than cutoff times. Counters saturate at cap (at most 255).
+ * Adding is thread-safe.
+ */
+
+typedef struct _CountMin CountMin;
+
+struct _CountMin {
+	unsigned int nrows;
+	unsigned int nbits;
+	unsigned int cap;
+	unsigned char *counters;
+};
+
+#define COUNTMIN_MAX_ROWS 8
+
+/* Size is the total number of bytes for counters (rounded down to power of 2 per row) */
+int countmin_init (CountMin *cm, unsigned long long size, unsigned int nrows, unsigned int cap);
+void countmin_release (CountMin *cm);
+
+void countmin_add (CountMin *cm, unsigned long long word);
+/* Returns the upper bound of word frequency (saturated at cap) */
+unsigned int countmin_estimate (CountMin *cm, unsigned long long word);
+
+#endif /* __COUNTMIN_H__ */
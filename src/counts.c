@@ -0,0 +1,241 @@
+#define __GT4_COUNTS_C__
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "counts.h"
+
+static unsigned int
+get_value (const void *values, unsigned int count_bits, unsigned long long idx)
+{
+  if (count_bits == 16) return ((const unsigned short *) values)[idx];
+  return ((const unsigned int *) values)[idx];
+}
+
+static unsigned int
+varint_size (unsigned int value)
+{
+  unsigned int size = 1;
+  while (value >= 0x80) {
+    value = value >> 7;
+    size += 1;
+  }
+  return size;
+}
+
+static unsigned int
+varint_encode (unsigned char *buf, unsigned int value)
+{
+  unsigned int size = 0;
+  while (value >= 0x80) {
+    buf[size++] = (value & 0x7f) | 0x80;
+    value = value >> 7;
+  }
+  buf[size++] = value;
+  return size;
+}
+
+static unsigned int
+varint_decode (const unsigned char *cdata, unsigned long long csize, unsigned long long *pos)
+{
+  unsigned int value = 0, shift = 0;
+  while ((*pos < csize) && (cdata[*pos] & 0x80)) {
+    value |= (cdata[*pos] & 0x7f) << shift;
+    *pos += 1;
+    shift += 7;
+  }
+  if (*pos < csize) {
+    value |= cdata[*pos] << shift;
+    *pos += 1;
+  }
+  return value;
+}
+
+static unsigned int
+get_offset (const GT4Counts *counts, unsigned long long node)
+{
+  unsigned int offset;
+  memcpy (&offset, counts->records + node * GT4_COUNTS_RECORD_SIZE + 4, 4);
+  return offset;
+}
+
+unsigned int
+gt4_counts_is_binary (const unsigned char *cdata, unsigned long long csize)
+{
+  return (csize >= 4) && !memcmp (cdata, "GMCT", 4);
+}
+
+unsigned int
+gt4_counts_init_from_data (GT4Counts *counts, const unsigned char *cdata, unsigned long long csize)
+{
+  unsigned short major, minor;
+  unsigned long long records_size, limit, i;
+  unsigned int name, offset, last;
+  memset (counts, 0, sizeof (GT4Counts));
+  if (csize < GT4_COUNTS_HEADER_SIZE) return 1;
+  if (!gt4_counts_is_binary (cdata, csize)) return 1;
+  memcpy (&major, cdata + 4, 2);
+  memcpy (&minor, cdata + 6, 2);
+  if ((major != 0) || (minor != 1)) return 1;
+  memcpy (&counts->flags, cdata + 8, 4);
+  memcpy (&counts->count_bits, cdata + 12, 4);
+  memcpy (&counts->n_nodes, cdata + 16, 8);
+  memcpy (&counts->n_counts, cdata + 24, 8);
+  memcpy (&counts->names_size, cdata + 32, 8);
+  memcpy (&counts->counts_size, cdata + 40, 8);
+  if ((counts->flags & ~GT4_COUNTS_VARINT) || ((counts->count_bits != 16) && (counts->count_bits != 32))) return 1;
+  /* Sizes are checked one by one so that sums do not overflow */
+  if (counts->n_nodes >= (csize - GT4_COUNTS_HEADER_SIZE) / GT4_COUNTS_RECORD_SIZE) return 1;
+  if ((counts->names_size > csize) || (counts->counts_size > csize)) return 1;
+  records_size = (counts->n_nodes + 1) * GT4_COUNTS_RECORD_SIZE;
+  if (csize < GT4_COUNTS_HEADER_SIZE + records_size + counts->names_size + counts->counts_size) return 1;
+  counts->records = cdata + GT4_COUNTS_HEADER_SIZE;
+  counts->names = (const char *) counts->records + records_size;
+  counts->counts = (const unsigned char *) counts->names + counts->names_size;
+  /* Names have to end inside names section */
+  if (counts->n_nodes && (!counts->names_size || counts->names[counts->names_size - 1])) return 1;
+  /* Count offsets are nondecreasing and inside counts section */
+  if (counts->flags & GT4_COUNTS_VARINT) {
+    limit = counts->counts_size;
+  } else {
+    if (counts->n_counts > counts->counts_size / (counts->count_bits / 8)) return 1;
+    limit = counts->n_counts;
+  }
+  last = 0;
+  for (i = 0; i <= counts->n_nodes; i++) {
+    memcpy (&name, counts->records + i * GT4_COUNTS_RECORD_SIZE, 4);
+    memcpy (&offset, counts->records + i * GT4_COUNTS_RECORD_SIZE + 4, 4);
+    if ((i < counts->n_nodes) && (name >= counts->names_size)) return 1;
+    if ((offset < last) || (offset > limit)) return 1;
+    last = offset;
+  }
+  return 0;
+}
+
+const char *
+gt4_counts_get_name (const GT4Counts *counts, unsigned long long node)
+{
+  unsigned int name;
+  memcpy (&name, counts->records + node * GT4_COUNTS_RECORD_SIZE, 4);
+  return counts->names + name;
+}
+
+unsigned int
+gt4_counts_get_nkmers (const GT4Counts *counts, unsigned long long node)
+{
+  if (counts->flags & GT4_COUNTS_VARINT) {
+    unsigned long long pos = get_offset (counts, node);
+    return varint_decode (counts->counts, get_offset (counts, node + 1), &pos);
+  }
+  return get_offset (counts, node + 1) - get_offset (counts, node);
+}
+
+unsigned int
+gt4_counts_get (const GT4Counts *counts, unsigned long long node, unsigned int values[], unsigned int max_counts)
+{
+  unsigned long long pos = get_offset (counts, node);
+  unsigned int nkmers, i;
+  if (counts->flags & GT4_COUNTS_VARINT) {
+    /* Decoding stops at the next node */
+    unsigned long long end = get_offset (counts, node + 1);
+    nkmers = varint_decode (counts->counts, end, &pos);
+    if (nkmers > max_counts) nkmers = max_counts;
+    for (i = 0; i < nkmers; i++) values[i] = varint_decode (counts->counts, end, &pos);
+  } else {
+    nkmers = get_offset (counts, node + 1) - pos;
+    if (nkmers > max_counts) nkmers = max_counts;
+    if (counts->count_bits == 16) {
+      const unsigned short *c = (const unsigned short *) counts->counts + pos;
+      for (i = 0; i < nkmers; i++) values[i] = c[i];
+    } else {
+      memcpy (values, (const unsigned int *) counts->counts + pos, 4 * nkmers);
+    }
+  }
+  return nkmers;
+}
+
+unsigned long long
+gt4_counts_write (FILE *ofs, unsigned long long n_nodes, const char *const names[], const unsigned long long first[], const unsigned int nkmers[],
+  const void *values, unsigned int count_bits, unsigned int flags)
+{
+  static const char zeroes[8] = { 0 };
+  unsigned short major = 0, minor = 1;
+  unsigned long long n_counts, names_size, counts_size, written, i;
+  unsigned int name_pos, counts_pos, j;
+  unsigned char buf[4096 + 8];
+  unsigned int bpos;
+
+  /* Sizes of sections */
+  n_counts = 0;
+  names_size = 0;
+  counts_size = 0;
+  for (i = 0; i < n_nodes; i++) {
+    n_counts += nkmers[i];
+    names_size += strlen (names[i]) + 1;
+    if (flags & GT4_COUNTS_VARINT) {
+      counts_size += varint_size (nkmers[i]);
+      for (j = 0; j < nkmers[i]; j++) counts_size += varint_size (get_value (values, count_bits, first[i] + j));
+    }
+  }
+  if (!(flags & GT4_COUNTS_VARINT)) counts_size = n_counts;
+  /* Offsets are 32-bit */
+  if ((names_size > 0xffffffffULL) || (counts_size > 0xffffffffULL)) return 0;
+  names_size = (names_size + 7) & ~7ULL;
+  if (!(flags & GT4_COUNTS_VARINT)) counts_size = n_counts * count_bits / 8;
+
+  /* Header */
+  fwrite ("GMCT", 4, 1, ofs);
+  fwrite (&major, 2, 1, ofs);
+  fwrite (&minor, 2, 1, ofs);
+  fwrite (&flags, 4, 1, ofs);
+  fwrite (&count_bits, 4, 1, ofs);
+  fwrite (&n_nodes, 8, 1, ofs);
+  fwrite (&n_counts, 8, 1, ofs);
+  fwrite (&names_size, 8, 1, ofs);
+  fwrite (&counts_size, 8, 1, ofs);
+  written = GT4_COUNTS_HEADER_SIZE;
+
+  /* Node records */
+  name_pos = 0;
+  counts_pos = 0;
+  for (i = 0; i <= n_nodes; i++) {
+    fwrite (&name_pos, 4, 1, ofs);
+    fwrite (&counts_pos, 4, 1, ofs);
+    if (i == n_nodes) break;
+    name_pos += strlen (names[i]) + 1;
+    if (flags & GT4_COUNTS_VARINT) {
+      counts_pos += varint_size (nkmers[i]);
+      for (j = 0; j < nkmers[i]; j++) counts_pos += varint_size (get_value (values, count_bits, first[i] + j));
+    } else {
+      counts_pos += nkmers[i];
+    }
+  }
+  written += (n_nodes + 1) * GT4_COUNTS_RECORD_SIZE;
+
+  /* Names */
+  for (i = 0; i < n_nodes; i++) fwrite (names[i], 1, strlen (names[i]) + 1, ofs);
+  fwrite (zeroes, 1, names_size - name_pos, ofs);
+  written += names_size;
+
+  /* Counts */
+  for (i = 0; i < n_nodes; i++) {
+    if (flags & GT4_COUNTS_VARINT) {
+      bpos = varint_encode (buf, nkmers[i]);
+      for (j = 0; j < nkmers[i]; j++) {
+        bpos += varint_encode (buf + bpos, get_value (values, count_bits, first[i] + j));
+        if (bpos >= 4096) {
+          fwrite (buf, 1, bpos, ofs);
+          bpos = 0;
+        }
+      }
+      fwrite (buf, 1, bpos, ofs);
+    } else if (count_bits == 16) {
+      fwrite ((const unsigned short *) values + first[i], 2, nkmers[i], ofs);
+    } else {
+      fwrite ((const unsigned int *) values + first[i], 4, nkmers[i], ofs);
+    }
+  }
+  written += counts_size;
+  if (ferror (ofs)) return 0;
+  return written;
+}
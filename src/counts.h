@@ -0,0 +1,64 @@
+#ifndef __GT4_COUNTS_H__
+#define __GT4_COUNTS_H__
+
+#include <stdio.h>
+
+/*
+ * Binary kmer counts (gmer_counter output, gmer_caller input)
+ *
+ * Version 0.1
+ *
+ * 0  : "GMCT" (4)
+ * 4  : major (2), minor (2)
+ * 8  : flags (4)
+ * 12 : count_bits (4) - width of fixed counts (16 or 32)
+ * 16 : n_nodes (8)
+ * 24 : n_counts (8)
+ * 32 : names_size (8) - padded to 8
+ * 40 : counts_size (8)
+ * 48 : Node records (8 * (n_nodes + 1)), the last one marks the end of counts
+ *        name offset (4), counts offset (4)
+ *    : Names (0-terminated)
+ *    : Counts
+ *        fixed - array of count_bits integers, offset is index, nkmers is the distance to the next offset
+ *        varint - LEB128 nkmers followed by counts, offset is in bytes
+ */
+
+#define GT4_COUNTS_HEADER_SIZE 48
+#define GT4_COUNTS_RECORD_SIZE 8
+
+/* Counts are stored as varints */
+#define GT4_COUNTS_VARINT 1
+
+typedef struct _GT4Counts GT4Counts;
+
+struct _GT4Counts {
+  unsigned int flags;
+  unsigned int count_bits;
+  unsigned long long n_nodes;
+  unsigned long long n_counts;
+  unsigned long long names_size;
+  unsigned long long counts_size;
+  /* Pointers to mapped data */
+  const unsigned char *records;
+  const char *names;
+  const unsigned char *counts;
+};
+
+/* Return 1 if data starts with binary counts signature */
+unsigned int gt4_counts_is_binary (const unsigned char *cdata, unsigned long long csize);
+/* Set up from mapped data (no copy), return 0 on success */
+/* Fails if any node record points outside of names or counts sections */
+unsigned int gt4_counts_init_from_data (GT4Counts *counts, const unsigned char *cdata, unsigned long long csize);
+
+const char *gt4_counts_get_name (const GT4Counts *counts, unsigned long long node);
+unsigned int gt4_counts_get_nkmers (const GT4Counts *counts, unsigned long long node);
+/* Decode up to max_counts counts of node, return the number of counts stored */
+unsigned int gt4_counts_get (const GT4Counts *counts, unsigned long long node, unsigned int values[], unsigned int max_counts);
+
+/* Write counts of nodes, node i has nkmers[i] counts starting from index first[i] in values (16 or 32 bit) */
+/* Returns number of bytes written or 0 on error */
+unsigned long long gt4_counts_write (FILE *ofs, unsigned long long n_nodes, const char *const names[], const unsigned long long first[], const unsigned int nkmers[],
+  const void *values, unsigned int count_bits, unsigned int flags);
+
+#endif
@@ -1,5 +1,11 @@
 #define __DATABASE_C__
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "sequence.h"
@@ -16,6 +22,96 @@ gt4_db_clear_index (KMerDB *db)
   memset (&db->index, 0, sizeof (db->index));
 }
 
+struct _HashKeys {
+  unsigned long long *keys;
+  unsigned int *values;
+  unsigned long long n_keys;
+  unsigned long long size;
+};
+
+static unsigned int
+collect_kmer (unsigned long long word, unsigned int code, void *data)
+{
+  struct _HashKeys *hk = (struct _HashKeys *) data;
+  if (hk->n_keys >= hk->size) return 1;
+  hk->keys[hk->n_keys] = word;
+  hk->values[hk->n_keys] = code;
+  hk->n_keys += 1;
+  return 0;
+}
+
+unsigned int
+gt4_db_build_hash (KMerDB *db)
+{
+  struct _HashKeys hk;
+  unsigned int result;
+  double t_s = get_time ();
+  hk.size = db->n_kmers;
+  hk.n_keys = 0;
+  hk.keys = (unsigned long long *) malloc (hk.size * 8 + 8);
+  hk.values = (unsigned int *) malloc (hk.size * 4 + 4);
+  if (!hk.keys || !hk.values) return 1;
+  if (trie_foreach (&db->trie, collect_kmer, &hk)) {
+    fprintf (stderr, "gt4_db_build_hash: more kmers in trie than in database (%llu)\n", db->n_kmers);
+    free (hk.keys);
+    free (hk.values);
+    return 1;
+  }
+  result = kmer_hash_build (&db->hash, hk.keys, hk.values, hk.n_keys);
+  free (hk.keys);
+  free (hk.values);
+  if (debug) {
+    fprintf (stderr, "Hash index: %llu kmers, %u levels, %llu fallback, %.2f bits per kmer (+ 96 for keys and codes), time %.2f\n",
+      db->hash.n_keys, db->hash.n_levels, db->hash.n_fallback, (double) db->hash.n_blocks * 512 / (hk.n_keys ? hk.n_keys : 1), get_time () - t_s);
+  }
+  return result;
+}
+
+unsigned int
+gt4_db_lookup (KMerDB *db, unsigned long long word)
+{
+  if (db->hash.n_keys) return kmer_hash_lookup (&db->hash, word);
+  return trie_lookup (&db->trie, word);
+}
+
+void
+gt4_db_lookup_batch (KMerDB *db, const unsigned long long words[], unsigned int codes[], unsigned long long nwords)
+{
+  unsigned long long i;
+  if (db->hash.n_keys) {
+    for (i = 0; i < nwords; i++) codes[i] = kmer_hash_lookup (&db->hash, words[i]);
+  } else {
+    trie_lookup_batch (&db->trie, words, codes, nwords);
+  }
+}
+
+unsigned int
+gt4_db_decode_code (KMerDB *db, unsigned int code, unsigned int *node, unsigned int *kmer, unsigned long long *slot)
+{
+  if (db->slot_codes) {
+    unsigned long long lo = 0, hi = db->n_nodes;
+    if (!code || (code > db->n_kmers)) return 0;
+    *slot = code - 1;
+    /* Last node starting at or before slot (empty nodes share start with the next one) */
+    while (lo + 1 < hi) {
+      unsigned long long mid = (lo + hi) / 2;
+      if (db->nodes[mid].kmers <= *slot) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    *node = lo;
+    *kmer = *slot - db->nodes[lo].kmers;
+  } else {
+    *node = (code >> db->kmer_bits) - 1;
+    *kmer = code & ((1 << db->kmer_bits) - 1);
+    if (*node >= db->n_nodes) return 0;
+    *slot = db->nodes[*node].kmers + *kmer;
+  }
+  return (*kmer < db->nodes[*node].nkmers);
+}
+
 static unsigned int
 count_lines_from_text (const unsigned char *cdata, size_t csize, unsigned int *wordsize, unsigned int *n_kmers, unsigned int *max_kmers, unsigned int *names_size)
 {
@@ -112,8 +208,9 @@ read_db_from_text (KMerDB *db, const unsigned char *cdata, unsigned long long cs
   }
   node_bits = get_bits (nlines + 1);
   kmer_bits = get_bits (max_kmers);
-  if ((node_bits + kmer_bits) > 31) {
-    fprintf (stderr, "Too many nodes and kmers (%u (%u bits), %u (%u bits)\n", nlines + 1, max_kmers, node_bits, kmer_bits);
+  /* Slot codes are slot + 1 below direction bit */
+  if (n_kmers >= 0x7fffffff) {
+    fprintf (stderr, "Too many kmers (%u), slot codes allow up to %u\n", n_kmers, 0x7fffffff - 1);
     return 0;
   }
   /* Set up DB */
@@ -121,6 +218,7 @@ read_db_from_text (KMerDB *db, const unsigned char *cdata, unsigned long long cs
   db->node_bits = node_bits;
   db->kmer_bits = kmer_bits;
   db->count_bits = count_bits;
+  db->slot_codes = 1;
   db->n_nodes = 0;
   db->nodes = (Node *) malloc (nlines * sizeof (Node));
   memset (db->nodes, 0, nlines * sizeof (Node));
@@ -140,7 +238,8 @@ read_db_from_text (KMerDB *db, const unsigned char *cdata, unsigned long long cs
     fprintf (stderr, "Node bits %u kmer bits %u\n", db->node_bits, db->kmer_bits);
   }
 
-  trie_setup (&db->trie, db->wordsize * 2, 28);
+  trie_setup (&db->trie, db->wordsize * 2, trie_select_root_bits (db->wordsize * 2, n_kmers));
+  if (debug) fprintf (stderr, "Trie root bits %u\n", db->trie.nbits_root);
 
   /* Fill table */
   t_s = get_time ();
@@ -197,14 +296,14 @@ read_db_from_text (KMerDB *db, const unsigned char *cdata, unsigned long long cs
       }
 
       /* Calculate code */
-      code = dir | ((idx + 1) << db->kmer_bits) | i;
+      code = dir | (db->nodes[idx].kmers + i + 1);
 
       if (debug) {
         code2 = trie_lookup (&db->trie, word);
         if (code2 != 0) {
           unsigned int idx2, kmer2;
-          idx2 = ((code2 & 0x7fffffff) >> db->kmer_bits) - 1;
-          kmer2 = code2 & ((1 << db->kmer_bits) - 1);
+          unsigned long long slot2;
+          gt4_db_decode_code (db, code2 & 0x7fffffff, &idx2, &kmer2, &slot2);
           fprintf (stderr, "KMer already present (current node %u (%s) kmer %u/%u (%s) code %u) previous %u (%s) kmer %u/%u code %u\n",
             idx, db->names + db->nodes[idx].name, i, (dir != 0), word_to_string (word, db->wordsize), code,
             idx2, db->names + db->nodes[idx2].name, kmer2, ((code2 & 0x7fffffff) != 0), code2);
@@ -263,13 +362,428 @@ read_db_from_text (KMerDB *db, const unsigned char *cdata, unsigned long long cs
   return idx;
 }
 
+/* Parallel text database reading */
+
+#define DB_MAX_THREADS 256
+/* Do not split smaller files */
+#define DB_MIN_CHUNK_SIZE (1 << 20)
+/* Kmers are distributed to threads by top 8 bits */
+#define DB_NUM_BUCKETS 256
+
+typedef struct _TextChunk TextChunk;
+
+struct _TextChunk {
+  KMerDB *db;
+  const unsigned char *cdata;
+  unsigned long long csize;
+  unsigned long long start, end;
+  unsigned int max_kmers_per_node;
+  /* Count pass */
+  unsigned int n_lines, n_kmers, n_clipped, max_kmers, names_size;
+  /* Fill pass (first node, name and kmer of this chunk) */
+  unsigned int idx, names_pos, kmers_pos;
+  unsigned long long *words;
+  unsigned int *codes;
+  unsigned int failed;
+};
+
+typedef struct _TrieBuild TrieBuild;
+
+struct _TrieBuild {
+  KMerDB *db;
+  unsigned long long *words;
+  unsigned int *codes;
+  unsigned long long *bstart;
+  unsigned int *next_bucket;
+  unsigned int aidx;
+};
+
+static void
+run_threads (void *args, size_t argsize, unsigned int nthreads, void *(*func) (void *))
+{
+  pthread_t threads[DB_MAX_THREADS];
+  unsigned int t;
+  for (t = 1; t < nthreads; t++) {
+    if (pthread_create (&threads[t], NULL, func, (char *) args + t * argsize)) threads[t] = 0;
+  }
+  func (args);
+  for (t = 1; t < nthreads; t++) {
+    /* Fall back to running in this thread */
+    if (threads[t]) {
+      pthread_join (threads[t], NULL);
+    } else {
+      func ((char *) args + t * argsize);
+    }
+  }
+}
+
+/* Same as count_lines_from_text but for single chunk */
+static void *
+count_chunk (void *arg)
+{
+  TextChunk *c = (TextChunk *) arg;
+  unsigned long long cpos = c->start;
+  while (cpos < c->end) {
+    const unsigned char *tokenz[4];
+    unsigned int lengths[4];
+    unsigned int ntokenz, n_kmers;
+    ntokenz = split_line (c->cdata + cpos, c->csize - cpos, tokenz, lengths, 3);
+    if (ntokenz < 2) {
+      c->failed = 1;
+      break;
+    }
+    n_kmers = strtol ((const char *) tokenz[1], NULL, 10);
+    c->n_kmers += n_kmers;
+    if (n_kmers > c->max_kmers) c->max_kmers = n_kmers;
+    c->n_clipped += (n_kmers > c->max_kmers_per_node) ? c->max_kmers_per_node : n_kmers;
+    c->names_size += (lengths[0] + 1);
+    while ((cpos < c->end) && (c->cdata[cpos] != '\n')) cpos++;
+    if (cpos < c->end) cpos += 1;
+    c->n_lines += 1;
+  }
+  return NULL;
+}
+
+/*
+ * Fill nodes and names and collect (kmer, code) pairs of chunk
+ * Anything the sequential reader would treat differently (kmers crossing line ends, truncated kmers)
+ * marks chunk as failed
+ */
+static void *
+fill_chunk (void *arg)
+{
+  TextChunk *c = (TextChunk *) arg;
+  KMerDB *db = c->db;
+  const unsigned char *cdata = c->cdata;
+  unsigned long long cpos = c->start;
+  unsigned int idx = c->idx, names_pos = c->names_pos, kmers_pos = c->kmers_pos;
+  while ((cpos < c->end) && !c->failed) {
+    const unsigned char *tokenz[4];
+    unsigned int lengths[4];
+    unsigned int ntokenz, n_kmers, i;
+    ntokenz = split_line (cdata + cpos, c->csize - cpos, tokenz, lengths, 3);
+    db->nodes[idx].name = names_pos;
+    memcpy (db->names + names_pos, tokenz[0], lengths[0]);
+    names_pos += (lengths[0] + 1);
+    db->nodes[idx].kmers = kmers_pos;
+    n_kmers = strtol ((const char *) tokenz[1], NULL, 10);
+    if (n_kmers > c->max_kmers_per_node) n_kmers = c->max_kmers_per_node;
+    db->nodes[idx].nkmers = n_kmers;
+    if (n_kmers && (ntokenz < 3)) {
+      c->failed = 1;
+      break;
+    }
+    if (ntokenz > 2) cpos = tokenz[2] - cdata;
+    for (i = 0; i < n_kmers; i++) {
+      unsigned long long word, rword, e;
+      unsigned int dir = 0;
+      while ((cpos < c->end) && (cdata[cpos] < ' ') && (cdata[cpos] != '\n')) cpos += 1;
+      e = cpos;
+      while ((e < c->end) && (cdata[e] >= ' ')) e += 1;
+      if ((e - cpos) < db->wordsize) {
+        c->failed = 1;
+        break;
+      }
+      word = string_to_word ((const char *) cdata + cpos, db->wordsize);
+      rword = get_reverse_complement (word, db->wordsize);
+      if (rword < word) {
+        word = rword;
+        dir = 0x80000000;
+      }
+      c->words[kmers_pos + i] = word;
+      c->codes[kmers_pos + i] = dir | (kmers_pos + i + 1);
+      cpos = e;
+    }
+    kmers_pos += n_kmers;
+    idx += 1;
+    while ((cpos < c->end) && (cdata[cpos] != '\n')) cpos += 1;
+    if (cpos < c->end) cpos += 1;
+  }
+  return NULL;
+}
+
+/* In-place partition of kmers by top 8 bits */
+static void
+partition_kmers (unsigned long long *words, unsigned int *codes, unsigned long long n_kmers, unsigned int shift, unsigned long long bstart[])
+{
+  unsigned long long fill[DB_NUM_BUCKETS];
+  unsigned long long i;
+  unsigned int b;
+  memset (bstart, 0, (DB_NUM_BUCKETS + 1) * 8);
+  for (i = 0; i < n_kmers; i++) bstart[(words[i] >> shift) + 1] += 1;
+  for (b = 0; b < DB_NUM_BUCKETS; b++) {
+    bstart[b + 1] += bstart[b];
+    fill[b] = bstart[b];
+  }
+  for (b = 0; b < DB_NUM_BUCKETS; b++) {
+    while (fill[b] < bstart[b + 1]) {
+      unsigned long long word = words[fill[b]];
+      unsigned int code = codes[fill[b]];
+      unsigned int d = word >> shift;
+      /* Follow cycle until an element belonging here is found */
+      while (d != b) {
+        unsigned long long tw = words[fill[d]];
+        unsigned int tc = codes[fill[d]];
+        words[fill[d]] = word;
+        codes[fill[d]] = code;
+        fill[d] += 1;
+        word = tw;
+        code = tc;
+        d = word >> shift;
+      }
+      words[fill[b]] = word;
+      codes[fill[b]] = code;
+      fill[b] += 1;
+    }
+  }
+}
+
+/* Sort buckets and build their trie nodes bottom-up, buckets cover disjoint sets of trie roots */
+static void *
+build_buckets (void *arg)
+{
+  TrieBuild *tb = (TrieBuild *) arg;
+  unsigned int firstshift = 0;
+  while (firstshift + 8 < tb->db->wordsize * 2) firstshift += 8;
+  for (;;) {
+    unsigned long long s, e;
+    unsigned int b = __sync_fetch_and_add (tb->next_bucket, 1);
+    if (b >= DB_NUM_BUCKETS) break;
+    s = tb->bstart[b];
+    e = tb->bstart[b + 1];
+    if (e - s > 1) hybridInPlaceRadixSort256 (tb->words + s, tb->words + e, tb->codes + s, firstshift);
+    trie_add_sorted_words_with_allocator (&tb->db->trie, tb->words + s, tb->codes + s, e - s, tb->aidx);
+  }
+  return NULL;
+}
+
+static void
+free_db_tables (KMerDB *db)
+{
+  free (db->nodes);
+  free (db->kmers_16);
+  free (db->names);
+  db->nodes = NULL;
+  db->kmers_16 = NULL;
+  db->names = NULL;
+}
+
+unsigned int
+read_db_from_text_parallel (KMerDB *db, const unsigned char *cdata, unsigned long long csize, unsigned int max_kmers_per_node, unsigned int count_bits, unsigned int nthreads)
+{
+  TextChunk chunks[DB_MAX_THREADS];
+  TrieBuild builds[DB_MAX_THREADS];
+  unsigned long long bstart[DB_NUM_BUCKETS + 1];
+  unsigned long long *words;
+  unsigned int *codes;
+  const unsigned char *tokenz[4];
+  unsigned int lengths[4];
+  unsigned int nchunks, wordsize, nlines, n_kmers, n_clipped, max_kmers, names_size, next_bucket;
+  unsigned int node_bits, kmer_bits, t;
+  unsigned long long cpos;
+  double t_s, t_e;
+
+  if (nthreads > DB_MAX_THREADS) nthreads = DB_MAX_THREADS;
+  nchunks = (csize / DB_MIN_CHUNK_SIZE < nthreads) ? csize / DB_MIN_CHUNK_SIZE : nthreads;
+  if (nchunks < 2) {
+    return read_db_from_text (db, cdata, csize, max_kmers_per_node, count_bits);
+  }
+  if (!cdata[5] || !cdata[7]) return 0;
+  /* Wordsize from the first line */
+  if (split_line (cdata, csize, tokenz, lengths, 3) < 3) {
+    return read_db_from_text (db, cdata, csize, max_kmers_per_node, count_bits);
+  }
+  wordsize = lengths[2];
+  if ((wordsize < 4) || (wordsize > 32)) {
+    return read_db_from_text (db, cdata, csize, max_kmers_per_node, count_bits);
+  }
+
+  /* Split into line-aligned chunks and count */
+  t_s = get_time ();
+  if (debug) fprintf (stderr, "Counting lines (%u chunks)\n", nchunks);
+  memset (chunks, 0, sizeof (chunks));
+  cpos = 0;
+  for (t = 0; t < nchunks; t++) {
+    chunks[t].db = db;
+    chunks[t].cdata = cdata;
+    chunks[t].csize = csize;
+    chunks[t].max_kmers_per_node = max_kmers_per_node;
+    chunks[t].start = cpos;
+    cpos = (t == nchunks - 1) ? csize : (csize / nchunks) * (t + 1);
+    if (cpos < chunks[t].start) cpos = chunks[t].start;
+    while ((cpos < csize) && (cdata[cpos - 1] != '\n')) cpos += 1;
+    chunks[t].end = cpos;
+  }
+  run_threads (chunks, sizeof (TextChunk), nchunks, count_chunk);
+  nlines = n_kmers = n_clipped = max_kmers = names_size = 0;
+  for (t = 0; t < nchunks; t++) {
+    if (chunks[t].failed) {
+      if (debug) fprintf (stderr, "Chunk %u failed, reading sequentially\n", t);
+      return read_db_from_text (db, cdata, csize, max_kmers_per_node, count_bits);
+    }
+    chunks[t].idx = nlines;
+    chunks[t].names_pos = names_size;
+    chunks[t].kmers_pos = n_clipped;
+    nlines += chunks[t].n_lines;
+    n_kmers += chunks[t].n_kmers;
+    n_clipped += chunks[t].n_clipped;
+    names_size += chunks[t].names_size;
+    if (chunks[t].max_kmers > max_kmers) max_kmers = chunks[t].max_kmers;
+  }
+  t_e = get_time ();
+  if (debug) {
+    fprintf (stderr, "Time %.1f (%.0f lines/s)\n", t_e - t_s, nlines / (t_e - t_s));
+    fprintf (stderr, "Lines %u wordisze %u kmers %u (max per node %u) name size %u\n", nlines, wordsize, n_kmers, max_kmers, names_size);
+  }
+  if (max_kmers > max_kmers_per_node) {
+    max_kmers = max_kmers_per_node;
+  }
+  node_bits = get_bits (nlines + 1);
+  kmer_bits = get_bits (max_kmers);
+  /* Slot codes are slot + 1 below direction bit */
+  if (n_clipped >= 0x7fffffff) {
+    fprintf (stderr, "Too many kmers (%u), slot codes allow up to %u\n", n_clipped, 0x7fffffff - 1);
+    return 0;
+  }
+  /* Set up DB */
+  db->wordsize = wordsize;
+  db->node_bits = node_bits;
+  db->kmer_bits = kmer_bits;
+  db->count_bits = count_bits;
+  db->slot_codes = 1;
+  db->nodes = (Node *) malloc (nlines * sizeof (Node));
+  memset (db->nodes, 0, nlines * sizeof (Node));
+  if (count_bits == 16) {
+    db->kmers_16 = (unsigned short *) malloc (n_kmers * 2);
+    memset (db->kmers_16, 0, n_kmers * 2);
+  } else {
+    db->kmers_32 = (unsigned int *) malloc (n_kmers * 4);
+    memset (db->kmers_32, 0, n_kmers * 4);
+  }
+  db->names = (char *) malloc (names_size);
+  memset (db->names, 0, names_size);
+  words = (unsigned long long *) malloc ((unsigned long long) n_clipped * 8 + 8);
+  codes = (unsigned int *) malloc ((unsigned long long) n_clipped * 4 + 4);
+  if (!words || !codes) {
+    fprintf (stderr, "Cannot allocate memory for database\n");
+    free_db_tables (db);
+    free (words);
+    free (codes);
+    return 0;
+  }
+
+  /* Fill tables and collect kmers */
+  t_s = get_time ();
+  for (t = 0; t < nchunks; t++) {
+    chunks[t].words = words;
+    chunks[t].codes = codes;
+  }
+  run_threads (chunks, sizeof (TextChunk), nchunks, fill_chunk);
+  for (t = 0; t < nchunks; t++) {
+    if (chunks[t].failed) break;
+  }
+  if (t < nchunks) {
+    if (debug) fprintf (stderr, "Chunk %u has inconsistent kmers, reading sequentially\n", t);
+    free_db_tables (db);
+    free (words);
+    free (codes);
+    return read_db_from_text (db, cdata, csize, max_kmers_per_node, count_bits);
+  }
+  t_e = get_time ();
+  if (debug) fprintf (stderr, "Parsed kmers in %.1f s\n", t_e - t_s);
+
+  /* Sort and build trie */
+  t_s = get_time ();
+  trie_setup_full (&db->trie, wordsize * 2, trie_select_root_bits (wordsize * 2, n_clipped), nthreads);
+  partition_kmers (words, codes, n_clipped, wordsize * 2 - 8, bstart);
+  next_bucket = 0;
+  for (t = 0; t < nthreads; t++) {
+    builds[t].db = db;
+    builds[t].words = words;
+    builds[t].codes = codes;
+    builds[t].bstart = bstart;
+    builds[t].next_bucket = &next_bucket;
+    builds[t].aidx = t;
+  }
+  /* Buckets share roots if root table is narrower than 8 bits */
+  run_threads (builds, sizeof (TrieBuild), (db->trie.nbits_root >= 8) ? nthreads : 1, build_buckets);
+  if (debug) {
+    /* Sequential reader stops at duplicate kmers in debug mode */
+    unsigned long long i;
+    for (i = 1; i < n_clipped; i++) {
+      if (words[i] == words[i - 1]) break;
+    }
+    if (i < n_clipped) {
+      fprintf (stderr, "Duplicate kmers, reading sequentially\n");
+      trie_release (&db->trie);
+      free_db_tables (db);
+      free (words);
+      free (codes);
+      return read_db_from_text (db, cdata, csize, max_kmers_per_node, count_bits);
+    }
+  }
+  free (words);
+  free (codes);
+  t_e = get_time ();
+  if (debug) fprintf (stderr, "Built trie in %.1f s\n", t_e - t_s);
+
+  db->n_nodes = nlines;
+  db->n_kmers = n_clipped;
+  db->names_size = names_size;
+
+  if (debug) {
+    fprintf (stderr, "Database layout\n");
+    fprintf (stderr, "  Wordsize: %u\n", db->wordsize);
+    fprintf (stderr, "  Node bits: %u\n", db->node_bits);
+    fprintf (stderr, "  KMer bits: %u\n", db->kmer_bits);
+    fprintf (stderr, "  Count bits: %u\n", db->count_bits);
+    fprintf (stderr, "  Nodes: %llu\n", db->n_nodes);
+    fprintf (stderr, "  Kmers: %llu\n", db->n_kmers);
+    fprintf (stderr, "  Names size: %llu\n", db->names_size);
+  }
+
+  return nlines;
+}
+
 static const char *DBKEY = "GMDB";
 
+/*
+ * Version 0.5 layout
+ *
+ * 0   : Header (48 bytes)
+ * 48  : Section starts (nodes, kmers, names, trie, index, hash) (6 * 8)
+ * 96  : Section sizes (6 * 8)
+ *     : Sections, each starting at multiple of GMDB_ALIGNMENT
+ *
+ * All sections are used in place from mmapped file, counts are remapped copy-on-write
+ */
+
+#define GMDB_NUM_SECTIONS 6
+/* Largest common page size */
+#define GMDB_ALIGNMENT 65536
+
+static unsigned long long
+write_padding (FILE *ofs, unsigned long long written)
+{
+  static const char zeroes[4096] = { 0 };
+  unsigned long long padding = (GMDB_ALIGNMENT - (written % GMDB_ALIGNMENT)) % GMDB_ALIGNMENT;
+  while (padding > 0) {
+    unsigned long long size = (padding > 4096) ? 4096 : padding;
+    fwrite (zeroes, 1, size, ofs);
+    padding -= size;
+    written += size;
+  }
+  return written;
+}
+
 unsigned int
 write_db_to_file (KMerDB *db, FILE *ofs, unsigned int kmers)
 {
-  unsigned long long written = 0, blocksize, nodes_start, kmers_start, names_start, trie_start, index_start;
-  static const unsigned short major = 0, minor = 3;
+  unsigned long long written = 0, starts[GMDB_NUM_SECTIONS], sizes[GMDB_NUM_SECTIONS];
+  static const unsigned short major = 0;
+  unsigned short minor = (db->slot_codes) ? 6 : 5;
+  memset (starts, 0, sizeof (starts));
+  memset (sizes, 0, sizeof (sizes));
   fwrite (DBKEY, 4, 1, ofs);
   fwrite (&major, 2, 1, ofs);
   fwrite (&minor, 2, 1, ofs);
@@ -283,75 +797,50 @@ write_db_to_file (KMerDB *db, FILE *ofs, unsigned int kmers)
   fprintf (stderr, "Names size %llu\n", db->names_size);
   fwrite (&db->names_size, 8, 1, ofs);
   written = 48;
-  /* Starts (5 * 8 bytes) */
-  fseek (ofs, written + 40, SEEK_SET);
-  written += 40;
+  /* Starts and sizes are rewritten at the end */
+  fwrite (starts, 8, GMDB_NUM_SECTIONS, ofs);
+  fwrite (sizes, 8, GMDB_NUM_SECTIONS, ofs);
+  written += 2 * 8 * GMDB_NUM_SECTIONS;
+  written = write_padding (ofs, written);
   /* Nodes */
-  nodes_start = written;
-  blocksize = (db->n_nodes * sizeof (Node) + 15) & 0xfffffffffffffff0;
-  fwrite (&blocksize, 8, 1, ofs);
-  written += 8;
+  starts[0] = written;
+  sizes[0] = db->n_nodes * sizeof (Node);
   fwrite (db->nodes, sizeof (Node), db->n_nodes, ofs);
-  written += blocksize;
-  fseek (ofs, written, SEEK_SET);
+  written = write_padding (ofs, written + sizes[0]);
   /* KMers */
-  kmers_start = written;
+  starts[1] = written;
   if (kmers) {
     if (db->count_bits == 16) {
-      blocksize = (db->n_kmers * 2 + 15) & 0xfffffffffffffff0;
-      fwrite (&blocksize, 8, 1, ofs);
-      written += 8;
+      sizes[1] = db->n_kmers * 2;
       fwrite (db->kmers_16, 2, db->n_kmers, ofs);
-      written += blocksize;
     } else if (db->count_bits == 32) {
-      blocksize = (db->n_kmers * 4 + 15) & 0xfffffffffffffff0;
-      fwrite (&blocksize, 8, 1, ofs);
-      written += 8;
+      sizes[1] = db->n_kmers * 4;
       fwrite (db->kmers_32, 4, db->n_kmers, ofs);
-      written += blocksize;
     }
-    fseek (ofs, written, SEEK_SET);
-  } else {
-    blocksize = 0;
-    fwrite (&blocksize, 8, 1, ofs);
-    written += 8;
-    fseek (ofs, written, SEEK_SET);
   }
+  written = write_padding (ofs, written + sizes[1]);
   /* Names */
-  names_start = written;
-  blocksize = (db->names_size + 15) & 0xfffffffffffffff0;
-  fwrite (&blocksize, 8, 1, ofs);
-  written += 8;
+  starts[2] = written;
+  sizes[2] = db->names_size;
   fwrite (db->names, 1, db->names_size, ofs);
-  written += blocksize;
-  fseek (ofs, written, SEEK_SET);
+  written = write_padding (ofs, written + sizes[2]);
   /* Trie */
-  trie_start = written;
-  fwrite (&blocksize, 8, 1, ofs);
-  written += 8;
-  blocksize = trie_write_to_file (&db->trie, ofs);
-  blocksize = (blocksize + 15) & 0xfffffffffffffff0;
-  written += blocksize;
-  fseek (ofs, trie_start, SEEK_SET);
-  fwrite (&blocksize, 8, 1, ofs);
-  fseek (ofs, written, SEEK_SET);
+  starts[3] = written;
+  sizes[3] = trie_write_to_file (&db->trie, ofs);
+  written = write_padding (ofs, written + sizes[3]);
   /* Index */
-  index_start = written;
-  fwrite (&blocksize, 8, 1, ofs);
-  written += 8;
-  blocksize = gt4_index_write (&db->index, ofs, db->n_kmers);
-  blocksize = (blocksize + 15) & 0xfffffffffffffff0;
-  written += blocksize;
-  fseek (ofs, index_start, SEEK_SET);
-  fwrite (&blocksize, 8, 1, ofs);
-  fseek (ofs, written, SEEK_SET);
+  starts[4] = written;
+  sizes[4] = gt4_index_write (&db->index, ofs, db->n_kmers);
+  written = write_padding (ofs, written + sizes[4]);
+  /* Hash */
+  starts[5] = written;
+  sizes[5] = (db->hash.n_keys) ? kmer_hash_write (&db->hash, ofs) : 0;
+  written = write_padding (ofs, written + sizes[5]);
   /* Rewrite start locations */
   fseek (ofs, 48, SEEK_SET);
-  fwrite (&nodes_start, 8, 1, ofs);
-  fwrite (&kmers_start, 8, 1, ofs);
-  fwrite (&names_start, 8, 1, ofs);
-  fwrite (&trie_start, 8, 1, ofs);
-  fwrite (&index_start, 8, 1, ofs);
+  fwrite (starts, 8, GMDB_NUM_SECTIONS, ofs);
+  fwrite (sizes, 8, GMDB_NUM_SECTIONS, ofs);
+  fseek (ofs, written, SEEK_SET);
 
   if (debug) {
     fprintf (stderr, "Database layout\n");
@@ -362,23 +851,100 @@ write_db_to_file (KMerDB *db, FILE *ofs, unsigned int kmers)
     fprintf (stderr, "  Nodes: %llu\n", db->n_nodes);
     fprintf (stderr, "  Kmers: %llu\n", db->n_kmers);
     fprintf (stderr, "  Names size: %llu\n", db->names_size);
-    fprintf (stderr, "  Nodes start: %llu\n", nodes_start);
-    fprintf (stderr, "  KMers start: %llu\n", kmers_start);
-    fprintf (stderr, "  Names start: %llu\n", names_start);
-    fprintf (stderr, "  Trie start: %llu\n", trie_start);
-    fprintf (stderr, "  Index start: %llu\n", index_start);
+    fprintf (stderr, "  Nodes start: %llu\n", starts[0]);
+    fprintf (stderr, "  KMers start: %llu\n", starts[1]);
+    fprintf (stderr, "  Names start: %llu\n", starts[2]);
+    fprintf (stderr, "  Trie start: %llu\n", starts[3]);
+    fprintf (stderr, "  Index start: %llu\n", starts[4]);
+    fprintf (stderr, "  Hash start: %llu\n", starts[5]);
   }
   
   return written;
 }
 
+/* Counts are modified by counter, use file pages copy-on-write or fresh zero pages */
+static void *
+map_counts (const unsigned char *cdata, unsigned long long start, unsigned long long size, unsigned long long n_bytes)
+{
+  void *counts;
+  if (size >= n_bytes) {
+    unsigned long long len = (n_bytes + GMDB_ALIGNMENT - 1) & ~((unsigned long long) GMDB_ALIGNMENT - 1);
+    if (!mprotect ((void *) (cdata + start), len, PROT_READ | PROT_WRITE)) {
+      return (void *) (cdata + start);
+    }
+    /* Not mmapped from file */
+    counts = malloc (n_bytes);
+    memcpy (counts, cdata + start, n_bytes);
+    return counts;
+  }
+  counts = mmap (NULL, n_bytes + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (counts == MAP_FAILED) {
+    counts = malloc (n_bytes);
+    memset (counts, 0, n_bytes);
+  }
+  return counts;
+}
+
+static unsigned int
+read_database_sections (KMerDB *db, const unsigned char *cdata, unsigned long long csize)
+{
+  unsigned long long starts[GMDB_NUM_SECTIONS], sizes[GMDB_NUM_SECTIONS];
+  unsigned int i;
+  if (csize < 48 + 2 * 8 * GMDB_NUM_SECTIONS) return 0;
+  memcpy (starts, cdata + 48, 8 * GMDB_NUM_SECTIONS);
+  memcpy (sizes, cdata + 48 + 8 * GMDB_NUM_SECTIONS, 8 * GMDB_NUM_SECTIONS);
+  for (i = 0; i < GMDB_NUM_SECTIONS; i++) {
+    /* Start table is written last, zero means incomplete file */
+    if ((starts[i] < GMDB_ALIGNMENT) || (starts[i] % GMDB_ALIGNMENT) || ((starts[i] + sizes[i]) > csize)) {
+      fprintf (stderr, "read_database_from_binary: Invalid section %u (start %llu size %llu)\n", i, starts[i], sizes[i]);
+      return 0;
+    }
+  }
+
+  if (debug) {
+    fprintf (stderr, "Database layout\n");
+    fprintf (stderr, "  Wordsize: %u\n", db->wordsize);
+    fprintf (stderr, "  Node bits: %u\n", db->node_bits);
+    fprintf (stderr, "  KMer bits: %u\n", db->kmer_bits);
+    fprintf (stderr, "  Count bits: %u\n", db->count_bits);
+    fprintf (stderr, "  Nodes: %llu\n", db->n_nodes);
+    fprintf (stderr, "  Kmers: %llu\n", db->n_kmers);
+    fprintf (stderr, "  Names size: %llu\n", db->names_size);
+    fprintf (stderr, "  Nodes start: %llu\n", starts[0]);
+    fprintf (stderr, "  KMers start: %llu\n", starts[1]);
+    fprintf (stderr, "  Names start: %llu\n", starts[2]);
+    fprintf (stderr, "  Trie start: %llu\n", starts[3]);
+    fprintf (stderr, "  Index start: %llu\n", starts[4]);
+    fprintf (stderr, "  Hash start: %llu\n", starts[5]);
+  }
+
+  db->nodes = (Node *) (cdata + starts[0]);
+  if (db->count_bits == 16) {
+    db->kmers_16 = (unsigned short *) map_counts (cdata, starts[1], sizes[1], db->n_kmers * 2);
+  } else {
+    db->kmers_32 = (unsigned int *) map_counts (cdata, starts[1], sizes[1], db->n_kmers * 4);
+  }
+  db->names = (char *) (cdata + starts[2]);
+  trie_setup_from_data (&db->trie, cdata + starts[3]);
+  gt4_index_init_from_data (&db->index, cdata + starts[4], sizes[4], db->n_kmers);
+  memset (&db->hash, 0, sizeof (KMerHash));
+  if (sizes[5]) {
+    unsigned int result = kmer_hash_init_from_data (&db->hash, cdata + starts[5], sizes[5]);
+    if (result) {
+      fprintf (stderr, "read_database_from_binary: %s hash index, using trie\n", (result == 2) ? "Unaligned (old)" : "Invalid");
+      memset (&db->hash, 0, sizeof (KMerHash));
+    }
+  }
+  return 1;
+}
+
 unsigned int
 read_database_from_binary (KMerDB *db, const unsigned char *cdata, unsigned long long csize)
 {
-  unsigned long long cpos = 0, blocksize, nodes_start, kmers_start, names_start, trie_start, index_start;
+  unsigned long long cpos = 0, blocksize, nodes_start, kmers_start, names_start, trie_start, index_start, hash_start;
   unsigned short major, minor;
   unsigned int version;
-  unsigned int has_index = 0;
+  unsigned int has_index = 0, has_hash = 0;
 
   if (memcmp (cdata + cpos, DBKEY, 4)) {
     fprintf (stderr, "read_database_from_binary: Invalid DB key\n");
@@ -392,6 +958,8 @@ read_database_from_binary (KMerDB *db, const unsigned char *cdata, unsigned long
   version = (major << 16) | minor;
   /* if (version < 1) return 0; */
   if (version >= 3) has_index = 1;
+  if (version >= 4) has_hash = 1;
+  db->slot_codes = (version >= 6);
 
   memcpy (&db->wordsize, cdata + cpos, 4);
   cpos += 4;
@@ -411,6 +979,10 @@ read_database_from_binary (KMerDB *db, const unsigned char *cdata, unsigned long
   cpos += 8;
   memcpy (&db->names_size, cdata + cpos, 8);
   cpos += 8;
+  if (version >= 5) {
+    /* Page-aligned sections */
+    return read_database_sections (db, cdata, csize);
+  }
   if (version > 1) {
     /* Start positions */
     memcpy (&nodes_start, cdata + cpos, 8);
@@ -423,8 +995,14 @@ read_database_from_binary (KMerDB *db, const unsigned char *cdata, unsigned long
     cpos += 8;
     memcpy (&index_start, cdata + cpos, 8);
     cpos += 8;
+    if (has_hash) {
+      memcpy (&hash_start, cdata + cpos, 8);
+      cpos += 8;
+    } else {
+      hash_start = 0;
+    }
   } else {
-    nodes_start = kmers_start = names_start = trie_start = index_start = 0;
+    nodes_start = kmers_start = names_start = trie_start = index_start = hash_start = 0;
   }
 
   if (debug) {
@@ -441,6 +1019,7 @@ read_database_from_binary (KMerDB *db, const unsigned char *cdata, unsigned long
     fprintf (stderr, "  Names start: %llu\n", names_start);
     fprintf (stderr, "  Trie start: %llu\n", trie_start);
     fprintf (stderr, "  Index start: %llu\n", index_start);
+    fprintf (stderr, "  Hash start: %llu\n", hash_start);
   }
 
   /* Nodes */
@@ -492,9 +1071,88 @@ read_database_from_binary (KMerDB *db, const unsigned char *cdata, unsigned long
     cpos += 8;
     gt4_index_init_from_data (&db->index, cdata + cpos, blocksize, db->n_kmers);
   }
+  /* Hash */
+  memset (&db->hash, 0, sizeof (KMerHash));
+  if (has_hash) {
+    cpos = hash_start;
+    memcpy (&blocksize, cdata + cpos, 8);
+    cpos += 8;
+    if (blocksize) {
+      unsigned int result = kmer_hash_init_from_data (&db->hash, cdata + cpos, blocksize);
+      if (result) {
+        fprintf (stderr, "read_database_from_binary: %s hash index, using trie\n", (result == 2) ? "Unaligned (old)" : "Invalid");
+        memset (&db->hash, 0, sizeof (KMerHash));
+      }
+    }
+  }
+  return 1;
+}
+
+/* Shared memory database */
+
+unsigned int
+gt4_db_publish_shm (KMerDB *db, const char *name)
+{
+  FILE *ofs;
+  int fd;
+  /* Processes attached to previous segment keep using it */
+  shm_unlink (name);
+  fd = shm_open (name, O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0) {
+    fprintf (stderr, "gt4_db_publish_shm: Cannot create shared memory segment %s\n", name);
+    return 1;
+  }
+  ofs = fdopen (fd, "w");
+  if (!ofs) {
+    close (fd);
+    shm_unlink (name);
+    return 1;
+  }
+  write_db_to_file (db, ofs, 0);
+  if (fclose (ofs)) {
+    fprintf (stderr, "gt4_db_publish_shm: Cannot write shared memory segment %s\n", name);
+    shm_unlink (name);
+    return 1;
+  }
+  return 0;
+}
+
+unsigned int
+gt4_db_attach_shm (KMerDB *db, const char *name)
+{
+  const unsigned char *cdata;
+  struct stat st;
+  int fd;
+  fd = shm_open (name, O_RDONLY, 0);
+  if (fd < 0) {
+    fprintf (stderr, "gt4_db_attach_shm: No shared memory segment %s\n", name);
+    return 0;
+  }
+  if (fstat (fd, &st) || (st.st_size < 48 + 2 * 8 * GMDB_NUM_SECTIONS)) {
+    fprintf (stderr, "gt4_db_attach_shm: Segment %s is not ready\n", name);
+    close (fd);
+    return 0;
+  }
+  /* Private mapping shares pages but makes counts copy-on-write */
+  cdata = (const unsigned char *) mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (cdata == (const unsigned char *) MAP_FAILED) {
+    fprintf (stderr, "gt4_db_attach_shm: Cannot map segment %s\n", name);
+    return 0;
+  }
+  if (!read_database_from_binary (db, cdata, st.st_size)) {
+    munmap ((void *) cdata, st.st_size);
+    return 0;
+  }
   return 1;
 }
 
+unsigned int
+gt4_db_unlink_shm (const char *name)
+{
+  return shm_unlink (name) != 0;
+}
+
 ReadList
 *gm4_read_list_new (void)
 {
@@ -4,6 +4,7 @@
 #include <stdio.h>
 
 #include "index.h"
+#include "kmerhash.h"
 #include "trie.h"
 
 #ifndef __DATABASE_C__
@@ -30,6 +31,8 @@ struct _KMerDB {
   unsigned long long n_nodes;
   unsigned long long n_kmers;
   unsigned long long names_size;
+  /* Kmer codes are dir | (count slot + 1) instead of dir | (node + 1) << kmer_bits | kmer (version 0.6) */
+  unsigned int slot_codes;
   /* Table of nodes */
   Node *nodes;
   /* Table of kmer counts */
@@ -41,6 +44,8 @@ struct _KMerDB {
   char *names;
   /* Trie mapping kmers to nodes/counts */
   Trie trie;
+  /* Optional minimal perfect hash with the same mapping (n_keys = 0 if not present) */
+  KMerHash hash;
   /* Read index */
   GT4Index index;
 };
@@ -73,6 +78,8 @@ ReadList *gm4_read_list_new (void);
 
 /* Return number of nodes successfully read */
 unsigned int read_db_from_text (KMerDB *db, const unsigned char *cdata, unsigned long long csize, unsigned int max_kmers_per_node, unsigned int count_bits);
+/* Same result as read_db_from_text, parsing chunks and building trie in parallel */
+unsigned int read_db_from_text_parallel (KMerDB *db, const unsigned char *cdata, unsigned long long csize, unsigned int max_kmers_per_node, unsigned int count_bits, unsigned int nthreads);
 
 /*
  * Binary representation
@@ -92,6 +99,10 @@ unsigned int read_db_from_text (KMerDB *db, const unsigned char *cdata, unsigned
  * 64 : names_start (8)
  * 72 : trie_start (8)
  * 80 : index start (8)
+ * 88 : hash start (8) (version 0.4)
+ *
+ * Version 0.4 and earlier
+ *
  *    : nodes_blocksize (8)
  *    : Nodes
  *    : kmers_blocksize (8)
@@ -102,6 +113,13 @@ unsigned int read_db_from_text (KMerDB *db, const unsigned char *cdata, unsigned
  *    : Trie
  *    : index_blocksize (8)
  *    : Index
+ *    : hash_blocksize (8) (0 - no hash)
+ *    : Hash
+ *
+ * Version 0.5 (0.6 - kmer codes are count slots)
+ *
+ * 96 : nodes, kmers, names, trie, index, hash sizes (6 * 8)
+ *    : Sections at starts (multiples of 64 KiB) without blocksize words, can be used in place
 */
 
 /* Return number of bytes written */
@@ -109,6 +127,28 @@ unsigned int write_db_to_file (KMerDB *db, FILE *ofs, unsigned int kmers);
 
 unsigned int read_database_from_binary (KMerDB *db, const unsigned char *cdata, unsigned long long csize);
 
+/*
+ * Resident database in named POSIX shared memory segment (binary format, mapped in place)
+ * Publishing replaces existing segment, processes still attached to old one are not affected
+ */
+
+/* Return 0 on success */
+unsigned int gt4_db_publish_shm (KMerDB *db, const char *name);
+/* Return 1 on success (same as read_database_from_binary) */
+unsigned int gt4_db_attach_shm (KMerDB *db, const char *name);
+/* Return 0 on success */
+unsigned int gt4_db_unlink_shm (const char *name);
+
 void gt4_db_clear_index (KMerDB *db);
 
+/* Decode kmer code (without direction bit), return 0 if code is invalid */
+unsigned int gt4_db_decode_code (KMerDB *db, unsigned int code, unsigned int *node, unsigned int *kmer, unsigned long long *slot);
+
+/* Build hash index from trie */
+unsigned int gt4_db_build_hash (KMerDB *db);
+/* Get kmer code (0 if not present), uses hash index if present */
+unsigned int gt4_db_lookup (KMerDB *db, unsigned long long word);
+/* Get codes of many kmers at once */
+void gt4_db_lookup_batch (KMerDB *db, const unsigned long long words[], unsigned int codes[], unsigned long long nwords);
+
 #endif
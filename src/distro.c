@@ -8,6 +8,7 @@
 #include <stdio.h>
 
 #include "binomial.h"
+#include "pool.h"
 #include "queue.h"
 #include "sequence.h"
 #include "simplex.h"
@@ -36,8 +37,7 @@ static unsigned int find_median_coverage (GT4WordMap *map);
 static void generate_expected_distribution (float e[], const Params *params, unsigned int normalize);
 static void generate_observed_distribution (float o[], const KMer *kmer, unsigned int haploid_coverage);
 static void print_params (FILE *ofs, const Params *params, unsigned int header);
-static void process_task (Queue *queue, unsigned int idx, Task *task);
-static void process (Queue *queue, unsigned int idx, void *data);
+static void process_task (void *data);
 
 static float default_coeffs[] = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 };
 
@@ -86,6 +86,9 @@ enum {
 #define DISTRO_SIZE (MAX_AMPLITUDE * HAPLOID_COVERAGE_NORM)
 #define ERROR_COVERAGE 0.1f
 
+/* Counts 0, 1, 2... for batch densities */
+static unsigned int count_range[N_AMPLITUDES * MAX_COVERAGE];
+
 struct _Model {
   const char *id;
   /* Number of actual parameters */
@@ -145,16 +148,18 @@ struct _Task {
   float e_logc[N_AMPLITUDES * MAX_COVERAGE];
   /* Precalculated per-coverage remainders */
   float sums[MAX_COVERAGE + 1];
+  /* Batch densities */
+  float nb[N_AMPLITUDES * MAX_COVERAGE];
 };
 
+/* Queue is only used for locking, tasks are forked to pool */
 struct _DistroQueue {
   Queue queue;
+  GT4Pool *pool;
+  GT4PoolGroup group;
   Task *free_tasks;
-  Task *allocated_tasks;
   Task *completed_tasks;
   Population *population;
-  unsigned int processing;
-  unsigned int finished;
 };
 
 static float
@@ -341,9 +346,14 @@ main (int argc, const char *argv[])
   if (debug) fprintf (stderr, " done\n");
 #endif
 
+  for (i = 0; i < N_AMPLITUDES * MAX_COVERAGE; i++) count_range[i] = i;
+
   /* Queue */
   memset (&dq, 0, sizeof (DistroQueue));
   queue_init (&dq.queue, nthreads);
+  /* Main thread runs tasks while joining */
+  dq.pool = gt4_pool_new (nthreads - 1);
+  gt4_pool_group_init (&dq.group);
   dq.population = &pop;
   tasks = (Task *) malloc (256 * sizeof (Task));
   memset (tasks, 0, 256 * sizeof (Task));
@@ -352,7 +362,6 @@ main (int argc, const char *argv[])
     tasks[i].next = dq.free_tasks;
     dq.free_tasks = &tasks[i];
   }
-  queue_create_threads (&dq.queue, process, &dq);
 
   unsigned int job_idx = 0;
   kmer_idx = 0;
@@ -367,14 +376,11 @@ main (int argc, const char *argv[])
       if (!current_task) {
         /* Pick new task */
         queue_lock (&dq.queue);
-        if (!dq.free_tasks && !dq.completed_tasks && dq.allocated_tasks) {
-          Task *task = dq.allocated_tasks;
-          dq.allocated_tasks = task->next;
+        if (!dq.free_tasks && !dq.completed_tasks) {
+          /* Help processing submitted tasks */
           queue_unlock (&dq.queue);
-          process_task (&dq.queue, 0, task);
+          gt4_pool_join (dq.pool, &dq.group);
           queue_lock (&dq.queue);
-          task->next = dq.completed_tasks;
-          dq.completed_tasks = task;
         }
         if (dq.free_tasks) {
           current_task = dq.free_tasks;
@@ -429,18 +435,8 @@ main (int argc, const char *argv[])
       if ((current_task->nkmers >= KMER_BLOCK_SIZE) || reading_finished) {
         /* Submit */
         if (debug) fprintf (stderr, "Submitting task %u\n", current_task->idx);
-        queue_lock (&dq.queue);
-        if (!dq.allocated_tasks) {
-          current_task->next = dq.allocated_tasks;
-          dq.allocated_tasks = current_task;
-        } else {
-          Task *t = dq.allocated_tasks;
-          while (t->next) t = t->next;
-          t->next = current_task;
-        }
+        gt4_pool_fork (dq.pool, &dq.group, process_task, current_task);
         current_task = NULL;
-        queue_broadcast (&dq.queue);
-        queue_unlock (&dq.queue);
       }
     }
     }
@@ -526,19 +522,17 @@ main (int argc, const char *argv[])
       next_to_print = print_task->idx + 1;
       print_task->next = dq.free_tasks;
       dq.free_tasks = print_task;
-      queue_broadcast (&dq.queue);
+      queue_unlock (&dq.queue);
+    } else if (reading_finished) {
+      /* Wait for remaining tasks */
+      gt4_pool_join (dq.pool, &dq.group);
+      queue_lock (&dq.queue);
+      if (!dq.completed_tasks) finished = 1;
       queue_unlock (&dq.queue);
     }
-
-    queue_lock (&dq.queue);
-    if (reading_finished && !dq.allocated_tasks && !dq.completed_tasks && !dq.processing) {
-      dq.finished = 1;
-      if (dq.queue.nthreads_running < 2) finished = 1;
-      queue_broadcast (&dq.queue);
-    }
-    queue_unlock (&dq.queue);
   }
 
+  gt4_pool_delete (dq.pool);
   queue_finalize (&dq.queue);
   
   return 1;
@@ -689,15 +683,11 @@ distance (const float a[], float h_cov, float size, float e_size, void *data)
 
   /* Precalculate coefficients */
   if (size != task->last_size) {
-    for (i = 0; i < (MAX_AMPLITUDE / 2) * pop->max_coverage; i++) {
-      task->combinations[i] = log_combination_k_r_f (i, size);
-    }
+    log_combination_k_r_v (task->combinations, count_range, (MAX_AMPLITUDE / 2) * pop->max_coverage, size);
     task->last_size = size;
   }
   if (e_size != task->last_esize) {
-    for (i = 0; i < (MAX_AMPLITUDE / 2) * pop->max_coverage; i++) {
-      task->e_logc[i] = log_combination_k_r_f (i, e_size);
-    }
+    log_combination_k_r_v (task->e_logc, count_range, (MAX_AMPLITUDE / 2) * pop->max_coverage, e_size);
     task->last_esize = e_size;
   }
   memset (task->sums, 0, sizeof (task->sums));
@@ -729,18 +719,17 @@ distance (const float a[], float h_cov, float size, float e_size, void *data)
       }
     } else {
       if (!task->sums[pop->lists[i].coverage]) {
+        unsigned int no = (MAX_AMPLITUDE / 2) * pop->lists[i].coverage;
         unsigned int o;
         s = 1;
-        for (o = 0; o < ((MAX_AMPLITUDE / 2) * pop->lists[i].coverage); o++) {
-          s -= a[0] * dnbinom_mu_precalc_f (o, e_size, ERROR_COVERAGE, task->e_logc[o]);
-          assert (!isnan (s));
-        }
+        dnbinom_mu_precalc_v (task->nb, count_range, task->e_logc, no, e_size, ERROR_COVERAGE);
+        for (o = 0; o < no; o++) s -= a[0] * task->nb[o];
+        assert (!isnan (s));
         for (j = 1; j < N_AMPLITUDES; j++) {
           float lambda = j * h_cov * pop->lists[i].coverage / 2;
-          for (o = 0; o < ((MAX_AMPLITUDE / 2) * pop->lists[i].coverage); o++) {
-            s -= a[j] * dnbinom_mu_precalc_f (o, size, lambda, task->combinations[o]);
-            assert (!isnan (s));
-          }
+          dnbinom_mu_precalc_v (task->nb, count_range, task->combinations, no, size, lambda);
+          for (o = 0; o < no; o++) s -= a[j] * task->nb[o];
+          assert (!isnan (s));
         }
         if (s < 1e-8f) s = 1e-8f;
         task->sums[pop->lists[i].coverage] = s;
@@ -817,55 +806,20 @@ distance_weighted (int nvalues, const float values[], void *data)
 }
 
 static void
-process_task (Queue *queue, unsigned int idx, Task *task)
+process_task (void *data)
 {
+  Task *task = (Task *) data;
+  DistroQueue *dq = task->distro;
   unsigned int i;
-  if (debug) fprintf (stderr, "Thread %u analyzing task %u\n", idx, task->idx);
+  if (debug) fprintf (stderr, "Analyzing task %u\n", task->idx);
   for (i = 0; i < task->nkmers; i++) {
-    if (debug > 1) fprintf (stderr, "Thread %d: Analyzing kmer %u\n", idx, i);
+    if (debug > 1) fprintf (stderr, "Task %u: Analyzing kmer %u\n", task->idx, i);
     task->kmers[i].result = find_coeffs (&task->kmers[i]);
   }
-}
-
-static void
-process (Queue *queue, unsigned int idx, void *data)
-{
-  DistroQueue *dq = (DistroQueue *) data;
-  unsigned int finished = 0;
-
-  if (debug > 1) {
-    queue_lock (&dq->queue);
-    fprintf (stderr, "Thread %d started (total %d)\n", idx, dq->queue.nthreads_running);
-    queue_unlock (&dq->queue);
-  }
-
-  while (!finished) {
-    queue_lock (&dq->queue);
-    if (dq->allocated_tasks) {
-      dq->processing += 1;
-      /* Pick task */
-      Task *task = dq->allocated_tasks;
-      dq->allocated_tasks = task->next;
-      queue_unlock (&dq->queue);
-      process_task (queue, idx, task);
-      queue_lock (&dq->queue);
-      task->next = dq->completed_tasks;
-      dq->completed_tasks = task;
-      dq->processing -= 1;
-      queue_broadcast (&dq->queue);
-      queue_unlock (&dq->queue);
-    } else if (!dq->finished) {
-      /* Wait for main thread */
-      if (debug > 1) fprintf (stderr, "Thread %d: Waiting\n", idx);
-      queue_wait (&dq->queue);
-      if (debug > 1) fprintf (stderr, "Thread %d: Woke up\n", idx);
-      queue_unlock (&dq->queue);
-    } else {
-      /* Finished */
-      queue_unlock (&dq->queue);
-      finished = 1;
-    }
-  }
+  queue_lock (&dq->queue);
+  task->next = dq->completed_tasks;
+  dq->completed_tasks = task;
+  queue_unlock (&dq->queue);
 }
 
 static void
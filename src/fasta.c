@@ -112,6 +112,21 @@ fasta_reader_init_from_file (FastaReader *reader, unsigned int wordlength, unsig
 	return result;
 }
 
+int
+fasta_reader_set_wordlengths (FastaReader *reader, const unsigned int wordlengths[], unsigned int nwordlengths)
+{
+	unsigned int i;
+	if (nwordlengths > FASTA_MAX_WORDLENGTHS) return GT_INCOMPATIBLE_WORDLENGTH_ERROR;
+	reader->nwordlengths = nwordlengths;
+	reader->wordlength = 0;
+	for (i = 0; i < nwordlengths; i++) {
+		reader->wordlengths[i] = wordlengths[i];
+		reader->masks[i] = create_mask (wordlengths[i]);
+		if (wordlengths[i] > reader->wordlength) reader->wordlength = wordlengths[i];
+	}
+	reader->mask = create_mask (reader->wordlength);
+	return 0;
+}
 
 int
 fasta_reader_read_nwords (FastaReader *reader, unsigned long long maxwords,
@@ -231,7 +246,28 @@ fasta_reader_read_nwords (FastaReader *reader, unsigned long long maxwords,
 	    reader->wordfw &= reader->mask;
 	    reader->currentlength = reader->wordlength;
 	  }
-	  if (reader->currentlength == reader->wordlength) {
+	  if (reader->nwordlengths) {
+	    /* All words ending here, position is counted once */
+	    unsigned int i, found = 0;
+	    for (i = 0; i < reader->nwordlengths; i++) {
+	      unsigned int len = reader->wordlengths[i];
+	      unsigned long long fw, rv, word;
+	      if (reader->currentlength < len) continue;
+	      fw = reader->wordfw & reader->masks[i];
+	      rv = reader->wordrv >> ((reader->wordlength - len) * 2);
+	      word = (!reader->canonize || fw < rv) ? fw : rv;
+	      reader->wordidx = i;
+	      if (read_word) {
+	        int result = read_word (reader, word, data);
+	        if (result) return result;
+	      }
+	      found = 1;
+	    }
+	    if (found) {
+	      reader->wpos += 1;
+	      nwords += 1;
+	    }
+	  } else if (reader->currentlength == reader->wordlength) {
 	    /* Update current word */
 	    unsigned long long word = (!reader->canonize || reader->wordfw < reader->wordrv) ? reader->wordfw : reader->wordrv;
 	    if (read_word) {
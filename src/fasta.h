@@ -30,6 +30,7 @@
 #include "buffer.h"
 
 #define MAX_NAME_SIZE 1000
+#define FASTA_MAX_WORDLENGTHS 8
 
 #define GT4FR_FASTA 1
 #define GT4FR_FASTQ 2
@@ -69,6 +70,12 @@ typedef struct _FastaReader {
 	unsigned long long wordfw;
 	unsigned long long wordrv;
 	unsigned int currentlength;
+	/* Several word lengths (0 - only wordlength) */
+	unsigned int nwordlengths;
+	unsigned int wordlengths[FASTA_MAX_WORDLENGTHS];
+	unsigned long long masks[FASTA_MAX_WORDLENGTHS];
+	/* Index of the length of current word in wordlengths */
+	unsigned int wordidx;
 } FastaReader;
 
 /* Set up FastA reader structure */
@@ -77,6 +84,9 @@ int fasta_reader_release (FastaReader *reader);
 
 int fasta_reader_init_from_data (FastaReader *reader, unsigned int wordlength, unsigned int canonize, const unsigned char *cdata, unsigned long long csize);
 int fasta_reader_init_from_file (FastaReader *reader, unsigned int wordlength, unsigned int canonize, FILE *ifs);
+/* Report words of all given lengths from a single pass, wordidx tells the length of current word */
+/* Has to be called before reading, wordlength becomes the maximum of lengths */
+int fasta_reader_set_wordlengths (FastaReader *reader, const unsigned int wordlengths[], unsigned int nwordlengths);
 
 /* Read maximum of nwords words from FastA or fastQ file starting from position cpos */
 int fasta_reader_read_nwords (FastaReader *reader, unsigned long long maxwords,
@@ -1742,6 +1742,7 @@ get_unique_reads (ReadInfo reads[], unsigned int max_reads, KMerDB *db, SeqFile
     unsigned int n_reads, n_new_reads, j, kmer_dir;
     unsigned long long word, rword;
     unsigned int code, node_idx, node_kmer, kmer_idx;
+    unsigned long long slot;
   
     word = string_to_word (kmers[i], strlen (kmers[i]));
     rword = get_reverse_complement (word, strlen (kmers[i]));
@@ -1754,9 +1755,8 @@ get_unique_reads (ReadInfo reads[], unsigned int max_reads, KMerDB *db, SeqFile
     kmer_dir = ((code & 0x80000000) != 0);
     if (debug > 1) fprintf (stderr, "Kmer %s word %llu code %u\n", kmers[i], word, code);
     code &= 0x7fffffff;
-    node_idx = (code >> db->kmer_bits) - 1;
-    node_kmer = code & ((1 << db->kmer_bits) - 1);
-    kmer_idx = db->nodes[node_idx].kmers + node_kmer;
+    gt4_db_decode_code (db, code, &node_idx, &node_kmer, &slot);
+    kmer_idx = slot;
     if (debug > 1) fprintf (stderr, "Node %u kmer %u idx %u dir %u\n", node_idx, node_kmer, kmer_idx, kmer_dir);
     if (debug > 2) print_db_reads (&db->index, files, kmer_idx, kmer_dir, stderr);
     first_read = gt4_index_get_kmer_info (&db->index, kmer_idx, &n_reads);
@@ -1892,10 +1892,9 @@ get_kmer_location (KMerDB *gdb, unsigned long long word, unsigned int *num_seqs,
   if (code) {
     *dir = ((code & 0x8000000) != 0);
     code &= 0x7fffffff;
-    unsigned int node = (code >> gdb->kmer_bits) - 1;
-    unsigned int kmer = code & ((1 << gdb->kmer_bits) - 1);
-    unsigned int kmer_idx = gdb->nodes[node].kmers + kmer;
-    unsigned long long first_read;
+    unsigned int node, kmer;
+    unsigned long long kmer_idx, first_read;
+    gt4_db_decode_code (gdb, code, &node, &kmer, &kmer_idx);
     first_read = gt4_index_get_kmer_info (&gdb->index, kmer_idx, num_seqs);
     if (*num_seqs == 1) {
       unsigned long long name_pos;
@@ -6,11 +6,11 @@
 
 #include "genotypes.h"
 
-void
-genotype_probabilities (double a[], float pB, unsigned int var1, unsigned int var2, double l_viga, double p_0, double p_1, double p_2, double lambda, double size, double size2)
+/* Prior probabilities of genotypes */
+
+static void
+genotype_priors (double p[], float pB, double p_0, double p_1, double p_2)
 {
-  double q0, q1;
-  double p[NUM_GENOTYPES];
   double p_A_alleel, p_B_alleel;
   double p_lisa, p_lisa1, p_lisa2;
 
@@ -46,6 +46,15 @@ genotype_probabilities (double a[], float pB, unsigned int var1, unsigned int va
   p[AAAB] = dbinom (3, 4, p_A_alleel) * p_lisa2;
   p[AABB] = dbinom (2, 4, p_A_alleel) * p_lisa2;
   p[BBBA] = dbinom (1, 4, p_A_alleel) * p_lisa2;
+}
+
+void
+genotype_probabilities (double a[], float pB, unsigned int var1, unsigned int var2, double l_viga, double p_0, double p_1, double p_2, double lambda, double size, double size2)
+{
+  double q0, q1;
+  double p[NUM_GENOTYPES];
+
+  genotype_priors (p, pB, p_0, p_1, p_2);
 
   /* a_0=dnbinom(var2, mu=l_viga, size=size+size2*l_viga)*dnbinom(var1, mu=l_viga, size=size+size2*l_viga)*p_0 */
   q0 = dnbinom_mu (var1, size + size2 * l_viga, l_viga);
@@ -123,3 +132,148 @@ genotype_probabilities (double a[], float pB, unsigned int var1, unsigned int va
   a[BBBB] = q0 * q1 * p[BBBB];
 }
 
+
+/* Pairs per block of batch evaluation */
+#define GT_BLOCK 256
+#define GT_NUM_MU 5
+
+/* Mean of var1 and var2 distributions (l_viga, lambda / 2, lambda, lambda * 1.5, lambda * 2) */
+static const unsigned char gt_mu1[NUM_GENOTYPES] = { 0, 1, 0, 2, 1, 0, 3, 2, 1, 0, 4, 3, 1, 2, 0 };
+static const unsigned char gt_mu2[NUM_GENOTYPES] = { 0, 0, 1, 0, 1, 2, 0, 1, 2, 3, 0, 1, 3, 2, 4 };
+
+void
+genotype_probabilities_v (float a[], float log_scale[], unsigned int n, float pB, const unsigned int var1[], const unsigned int var2[], float l_viga, float p_0, float p_1, float p_2, float lambda, float size, float size2)
+{
+  double p[NUM_GENOTYPES];
+  float lp[NUM_GENOTYPES], mu[GT_NUM_MU];
+  float l1[GT_NUM_MU][GT_BLOCK], l2[GT_NUM_MU][GT_BLOCK];
+  float la[NUM_GENOTYPES][GT_BLOCK], max[GT_BLOCK];
+  unsigned int first, i, j;
+
+  genotype_priors (p, pB, p_0, p_1, p_2);
+  for (j = 0; j < NUM_GENOTYPES; j++) lp[j] = (p[j] > 0) ? (float) log (p[j]) : -INFINITY;
+  mu[0] = l_viga;
+  mu[1] = lambda / 2;
+  mu[2] = lambda;
+  mu[3] = lambda * 1.5f;
+  mu[4] = lambda * 2;
+
+  for (first = 0; first < n; first += GT_BLOCK) {
+    unsigned int nb = (n - first < GT_BLOCK) ? n - first : GT_BLOCK;
+    /* Only 5 distinct distributions per count */
+    for (j = 0; j < GT_NUM_MU; j++) {
+      log_dnbinom_mu_v (l1[j], var1 + first, nb, size + size2 * mu[j], mu[j]);
+      log_dnbinom_mu_v (l2[j], var2 + first, nb, size + size2 * mu[j], mu[j]);
+    }
+    for (i = 0; i < nb; i++) max[i] = -INFINITY;
+    for (j = 0; j < NUM_GENOTYPES; j++) {
+      const float *q0 = l1[gt_mu1[j]], *q1 = l2[gt_mu2[j]];
+      for (i = 0; i < nb; i++) {
+        la[j][i] = q0[i] + q1[i] + lp[j];
+        max[i] = (la[j][i] > max[i]) ? la[j][i] : max[i];
+      }
+    }
+    /* Scale by largest probability, all zero stay zero */
+    for (i = 0; i < nb; i++) if (max[i] == -INFINITY) max[i] = 0;
+    for (j = 0; j < NUM_GENOTYPES; j++) {
+      for (i = 0; i < nb; i++) la[j][i] -= max[i];
+      exp_v (la[j], la[j], nb);
+    }
+    for (i = 0; i < nb; i++) {
+      log_scale[first + i] = max[i];
+      for (j = 0; j < NUM_GENOTYPES; j++) a[(first + i) * NUM_GENOTYPES + j] = la[j][i];
+    }
+  }
+}
+
+/* Derivatives of prior probabilities by p_0, p_1, p_2 */
+
+static void
+genotype_priors_d (double dp[][3], float pB, double p_0, double p_1, double p_2)
+{
+  double p_A_alleel, p_B_alleel;
+  double p_lisa, p_lisa1, d_lisa1;
+  unsigned int i, j;
+
+  p_B_alleel = pB;
+  p_A_alleel = 1 - p_B_alleel;
+
+  for (i = 0; i < NUM_GENOTYPES; i++) {
+    for (j = 0; j < 3; j++) dp[i][j] = 0;
+  }
+  dp[X][0] = 1;
+  dp[A][1] = p_A_alleel;
+  dp[B][1] = p_B_alleel;
+  dp[AA][2] = p_A_alleel * p_A_alleel;
+  dp[AB][2] = 2 * p_A_alleel * p_B_alleel;
+  dp[BB][2] = p_B_alleel * p_B_alleel;
+
+  /* p_lisa = 1 - p_0 - p_1 - p_2 has derivative -1 by all of them */
+  p_lisa = 1 - p_0 - p_1 - p_2;
+  if (p_lisa >= 0) {
+    p_lisa1 = (-1 + sqrt (1 + 4 * p_lisa)) / 2;
+    d_lisa1 = -1 / sqrt (1 + 4 * p_lisa);
+  } else {
+    p_lisa1 = 0;
+    d_lisa1 = 0;
+  }
+  for (j = 0; j < 3; j++) {
+    dp[AAA][j] = dbinom (3, 3, p_A_alleel) * d_lisa1;
+    dp[BBB][j] = dbinom (0, 3, p_A_alleel) * d_lisa1;
+    dp[AAB][j] = dbinom (2, 3, p_A_alleel) * d_lisa1;
+    dp[BBA][j] = dbinom (1, 3, p_A_alleel) * d_lisa1;
+    dp[AAAA][j] = dbinom (4, 4, p_A_alleel) * 2 * p_lisa1 * d_lisa1;
+    dp[BBBB][j] = dbinom (0, 4, p_A_alleel) * 2 * p_lisa1 * d_lisa1;
+    dp[AAAB][j] = dbinom (3, 4, p_A_alleel) * 2 * p_lisa1 * d_lisa1;
+    dp[AABB][j] = dbinom (2, 4, p_A_alleel) * 2 * p_lisa1 * d_lisa1;
+    dp[BBBA][j] = dbinom (1, 4, p_A_alleel) * 2 * p_lisa1 * d_lisa1;
+  }
+}
+
+double
+genotype_log_likelihood_d (double grad[], float pB, unsigned int var1, unsigned int var2, double l_viga, double p_0, double p_1, double p_2, double lambda, double size, double size2)
+{
+  /* Derivatives of mu[k] by l_viga and lambda */
+  static const double dmu_l_viga[GT_NUM_MU] = { 1, 0, 0, 0, 0 };
+  static const double dmu_lambda[GT_NUM_MU] = { 0, 0.5, 1, 1.5, 2 };
+  double p[NUM_GENOTYPES], dp[NUM_GENOTYPES][3];
+  double mu[GT_NUM_MU], q1[GT_NUM_MU], q2[GT_NUM_MU];
+  double ds1[GT_NUM_MU], dm1[GT_NUM_MU], ds2[GT_NUM_MU], dm2[GT_NUM_MU];
+  double abi;
+  unsigned int j, k;
+
+  genotype_priors (p, pB, p_0, p_1, p_2);
+  genotype_priors_d (dp, pB, p_0, p_1, p_2);
+  mu[0] = l_viga;
+  for (k = 1; k < GT_NUM_MU; k++) mu[k] = lambda * dmu_lambda[k];
+  for (k = 0; k < GT_NUM_MU; k++) {
+    q1[k] = dnbinom_mu_d (var1, size + size2 * mu[k], mu[k], &ds1[k], &dm1[k]);
+    q2[k] = dnbinom_mu_d (var2, size + size2 * mu[k], mu[k], &ds2[k], &dm2[k]);
+    /* Size depends on mu through size2 */
+    dm1[k] += size2 * ds1[k];
+    dm2[k] += size2 * ds2[k];
+  }
+
+  abi = 0;
+  for (k = 0; k < GENOTYPE_NUM_PARAMS; k++) grad[k] = 0;
+  for (j = 0; j < NUM_GENOTYPES; j++) {
+    unsigned int m1 = gt_mu1[j], m2 = gt_mu2[j];
+    double q = q1[m1] * q2[m2];
+    double a = p[j] * q;
+    abi += a;
+    for (k = 0; k < 3; k++) grad[1 + k] += dp[j][k] * q;
+    if (a == 0) continue;
+    grad[0] += a * (dm1[m1] * dmu_l_viga[m1] + dm2[m2] * dmu_l_viga[m2]);
+    grad[4] += a * (dm1[m1] * dmu_lambda[m1] + dm2[m2] * dmu_lambda[m2]);
+    grad[5] += a * (ds1[m1] + ds2[m2]);
+    grad[6] += a * (ds1[m1] * mu[m1] + ds2[m2] * mu[m2]);
+  }
+
+  /* Same floor as training likelihood, constant there */
+  if (abi < 1e-30) {
+    for (k = 0; k < GENOTYPE_NUM_PARAMS; k++) grad[k] = 0;
+    return log (1e-30);
+  }
+  for (k = 0; k < GENOTYPE_NUM_PARAMS; k++) grad[k] /= abi;
+  return log (abi);
+}
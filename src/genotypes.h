@@ -7,4 +7,17 @@ enum {
 
 void genotype_probabilities (double a[], float avg_maf, unsigned int count_a, unsigned int count_b, double l_error, double p_0, double p_1, double p_2, double lambda, double size, double size2);
 
+/*
+ * Batch version for n count pairs with float32 kernels
+ * Probabilities of pair i are a[i * NUM_GENOTYPES...] * exp (log_scale[i]), the largest one is scaled to 1
+ */
+void genotype_probabilities_v (float a[], float log_scale[], unsigned int n, float pB, const unsigned int var1[], const unsigned int var2[], float l_viga, float p_0, float p_1, float p_2, float lambda, float size, float size2);
+
+/*
+ * Log of summed genotype probabilities of one count pair (floored at 1e-30)
+ * grad receives its derivatives by l_viga, p_0, p_1, p_2, lambda, size, size2
+ */
+#define GENOTYPE_NUM_PARAMS 7
+double genotype_log_likelihood_d (double grad[], float pB, unsigned int var1, unsigned int var2, double l_viga, double p_0, double p_1, double p_2, double lambda, double size, double size2);
+
 #endif
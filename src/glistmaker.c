@@ -32,8 +32,10 @@
 #include "utils.h"
 #include "fasta.h"
 #include "wordtable.h"
+#include "wordmap.h"
 #include "sequence.h"
 #include "queue.h"
+#include "countmin.h"
 #include "common.h"
 
 #define MAX_FILES 200
@@ -46,26 +48,42 @@
 
 #define MAX_MERGED_TABLES 256
 
+#define DEFAULT_PREFILTER_SIZE 1024
+#define PREFILTER_ROWS 4
+
 #define TIME_READ 0
 #define TIME_SORT 1
 #define TIME_MERGE 2
 #define TIME_FF 3
+#define FAULTS_READ 4
+#define FAULTS_SORT 5
+#define FAULTS_MERGE 6
+#define FAULTS_FF 7
 
 /* Main thread loop */
 static void process (Queue *queue, unsigned int idx, void *arg);
 
-/* Merge tables directly to disk */
-static unsigned int merge_write_multi (wordtable **t, unsigned int ntables, const char *filename, unsigned int cutoff);
+/* Merge tables (and existing list if not NULL) directly to disk */
+static unsigned int merge_write_multi (wordtable **t, unsigned int ntables, GT4WordMap *base, const char *filename, unsigned int cutoff);
+/* Write final table, merging it with the list being updated */
+static unsigned int write_table (wordtable *table, unsigned int cutoff);
 
 /* */
 int process_word (FastaReader *reader, unsigned long long word, void *data);
 
+/* Count all words into prefilter sketch (first pass) */
+static int build_prefilter (CountMin *cm, const char *files[], unsigned int nfiles, const unsigned int wordlengths[], unsigned int nwordlengths, unsigned int nthreads);
+
 /* Print usage and help menu */
 void print_help (int exitvalue);
 
 int debug = 0;
 int ntables = 0;
 const char *outputname = "out";
+/* Words with estimated frequency below cutoff are not added to tables */
+static CountMin *prefilter = NULL;
+/* Existing list new words are added to */
+static GT4WordMap *updatemap = NULL;
 
 int 
 main (int argc, const char *argv[])
@@ -75,9 +93,17 @@ main (int argc, const char *argv[])
 
 	/* default values */
 	unsigned int wordlength = 16;
+	unsigned int wordlengths[FASTA_MAX_WORDLENGTHS] = { 16 };
+	unsigned int nwordlengths = 1, i;
+	unsigned int wordlength_specified = 0;
+	const char *updatename = NULL;
 	unsigned int cutoff = 1;
 	unsigned int nthreads = 0;
 	unsigned long long tablesize = 0;
+	unsigned int allocation = WORDTABLE_ALLOC_MALLOC;
+	unsigned int use_prefilter = 0;
+	unsigned long long prefiltersize = DEFAULT_PREFILTER_SIZE;
+	CountMin cm;
 
 	/* parsing commandline arguments */
 	for (argidx = 1; argidx < argc; argidx++) {
@@ -114,11 +140,21 @@ main (int argc, const char *argv[])
 				argidx += 1;
 				continue;
 			}
-			wordlength = strtol (argv[argidx + 1], &end, 10);
+			/* Comma-separated list */
+			end = (char *) argv[argidx + 1];
+			nwordlengths = 0;
+			do {
+				if (nwordlengths >= FASTA_MAX_WORDLENGTHS) {
+					fprintf (stderr, "Error: Too many word-lengths: %s! At most %d are allowed.\n", argv[argidx + 1], FASTA_MAX_WORDLENGTHS);
+					print_help (1);
+				}
+				wordlengths[nwordlengths++] = strtol ((*end == ',') ? end + 1 : end, &end, 10);
+			} while (*end == ',');
 			if (*end != 0) {
 				fprintf (stderr, "Error: Invalid word-length: %s! Must be an integer.\n", argv[argidx + 1]);
 				print_help (1);
 			}
+			wordlength_specified = 1;
 			argidx += 1;
 		} else if (!strcmp (argv[argidx], "-c") || !strcmp (argv[argidx], "--cutoff")) {
 			if (!argv[argidx + 1] || argv[argidx + 1][0] == '-') {
@@ -168,6 +204,45 @@ main (int argc, const char *argv[])
 				print_help (1);
 			}
 			argidx += 1;
+		} else if (!strcmp (argv[argidx], "--table_alloc")) {
+			if (!argv[argidx + 1]  || argv[argidx + 1][0] == '-') {
+				fprintf (stderr, "Warning: No table allocation specified! Using malloc.\n");
+				argidx += 1;
+				continue;
+			}
+			if (!strcmp (argv[argidx + 1], "malloc")) {
+				allocation = WORDTABLE_ALLOC_MALLOC;
+			} else if (!strcmp (argv[argidx + 1], "mmap")) {
+				allocation = WORDTABLE_ALLOC_MMAP;
+			} else if (!strcmp (argv[argidx + 1], "huge")) {
+				allocation = WORDTABLE_ALLOC_HUGE;
+			} else {
+				fprintf (stderr, "Error: Invalid table allocation: %s! Must be malloc, mmap or huge.\n", argv[argidx + 1]);
+				print_help (1);
+			}
+			argidx += 1;
+		} else if (!strcmp (argv[argidx], "--update")) {
+			if (!argv[argidx + 1]  || argv[argidx + 1][0] == '-') {
+				fprintf (stderr, "Error: No list file specified for update!\n");
+				print_help (1);
+			}
+			updatename = argv[argidx + 1];
+			argidx += 1;
+		} else if (!strcmp (argv[argidx], "--prefilter")) {
+			use_prefilter = 1;
+		} else if (!strcmp (argv[argidx], "--prefilter_size")) {
+			if (!argv[argidx + 1]  || argv[argidx + 1][0] == '-') {
+				fprintf (stderr, "Warning: No prefilter size specified! Using the default value: %d.\n", DEFAULT_PREFILTER_SIZE);
+				argidx += 1;
+				continue;
+			}
+			prefiltersize = strtoll (argv[argidx + 1], &end, 10);
+			if ((*end != 0) || !prefiltersize) {
+				fprintf (stderr, "Error: Invalid prefilter size: %s! Must be a positive integer.\n", argv[argidx + 1]);
+				print_help (1);
+			}
+			use_prefilter = 1;
+			argidx += 1;
 		} else if (!strcmp (argv[argidx], "-D")) {
 			debug += 1;
 		} else {
@@ -177,6 +252,7 @@ main (int argc, const char *argv[])
 	}
 
 	debug_tables = debug;
+	wordtable_set_allocation (allocation, 0);
 	
 	if (!nthreads) {
 		nthreads = DEFAULT_NUM_THREADS;
@@ -196,10 +272,45 @@ main (int argc, const char *argv[])
 		fprintf (stderr, "Error: No FastA/FastQ file specified!\n");
 		print_help (1);
 	}
-	if (wordlength < 1 || wordlength > 32) {
-		fprintf (stderr, "Error: Invalid word-length: %d!\n", wordlength);
-		print_help (1);
+	if (updatename) {
+		struct stat s_in, s_out;
+		char c[256];
+		updatemap = gt4_wordmap_new (updatename, 1);
+		if (!updatemap) {
+			fprintf (stderr, "Error: Cannot read list %s!\n", updatename);
+			return 1;
+		}
+		if (!wordlength_specified) {
+			wordlengths[0] = updatemap->header->wordlength;
+		} else if ((nwordlengths > 1) || (wordlengths[0] != updatemap->header->wordlength)) {
+			fprintf (stderr, "Error: Word-length has to match the list being updated (%u)!\n", updatemap->header->wordlength);
+			return 1;
+		}
+		/* Old list stays mapped while the new one is written */
+		sprintf (c, "%s_%u.list", outputname, wordlengths[0]);
+		if (!stat (updatename, &s_in) && !stat (c, &s_out) && (s_in.st_dev == s_out.st_dev) && (s_in.st_ino == s_out.st_ino)) {
+			fprintf (stderr, "Error: Output %s would overwrite the list being updated!\n", c);
+			return 1;
+		}
+	}
+	wordlength = 0;
+	for (argidx = 0; argidx < nwordlengths; argidx++) {
+		if (wordlengths[argidx] < 1 || wordlengths[argidx] > 32) {
+			fprintf (stderr, "Error: Invalid word-length: %d!\n", wordlengths[argidx]);
+			print_help (1);
+		}
+		for (i = 0; i < argidx; i++) {
+			if (wordlengths[i] == wordlengths[argidx]) {
+				fprintf (stderr, "Error: Duplicate word-length: %d!\n", wordlengths[argidx]);
+				print_help (1);
+			}
+		}
+		if (wordlengths[argidx] > wordlength) wordlength = wordlengths[argidx];
 	}
+	/* Each read task needs a table per word length, merging needs at least two of each */
+	ntables *= nwordlengths;
+	if (ntables < 2 * nwordlengths) ntables = 2 * nwordlengths;
+	if (ntables > MAX_TABLES) ntables = MAX_TABLES;
 	if (cutoff < 1) {
 		fprintf (stderr, "Error: Invalid frequency cut-off: %d! Must be positive.\n", cutoff);
 		print_help (1);
@@ -217,6 +328,32 @@ main (int argc, const char *argv[])
 			exit (1);
 		}
 	}
+
+	if (use_prefilter && (cutoff < 2)) {
+		if (debug) fprintf (stderr, "Cutoff is 1, prefilter not used\n");
+		use_prefilter = 0;
+	}
+	if (use_prefilter && updatemap) {
+		/* Words rare in new data may reach cutoff together with old counts */
+		fprintf (stderr, "Warning: Prefilter cannot be used with --update, not using it\n");
+		use_prefilter = 0;
+	}
+	for (argidx = firstfasta; use_prefilter && (argidx < firstfasta + nfasta); argidx += 1) {
+		if (!strcmp (argv[argidx], "-")) {
+			fprintf (stderr, "Warning: Prefilter cannot read standard input twice, not using it\n");
+			use_prefilter = 0;
+		}
+	}
+	if (use_prefilter) {
+		double s_t = get_time ();
+		if (countmin_init (&cm, prefiltersize * 1048576, PREFILTER_ROWS, cutoff)) {
+			fprintf (stderr, "Error: Cannot allocate %lluM for prefilter\n", prefiltersize);
+			return 1;
+		}
+		if (build_prefilter (&cm, argv + firstfasta, nfasta, wordlengths, nwordlengths, nthreads)) return 1;
+		prefilter = &cm;
+		if (debug) fprintf (stderr, "Prefilter %u x %llu counters built in %.2f\n", cm.nrows, 1ULL << cm.nbits, get_time () - s_t);
+	}
 	
 	if (nthreads > 1) {
 		/* CASE: SEVERAL THREADS */
@@ -225,6 +362,10 @@ main (int argc, const char *argv[])
 	        unsigned int finished = 0;
 
 		maker_queue_setup (&mq, nthreads);
+		if (nwordlengths > 1) {
+			mq.nwordlengths = nwordlengths;
+			memcpy (mq.wordlengths, wordlengths, sizeof (wordlengths));
+		}
 
 		for (argidx = firstfasta + nfasta - 1; argidx >= firstfasta; argidx--) {
 			maker_queue_add_file (&mq, argv[argidx]);
@@ -257,17 +398,20 @@ main (int argc, const char *argv[])
                         sleep (1);
 
                 }
-                if (mq.nsorted > 0) {
-                	/* write the final list into a file */
-                	if (debug > 0) fprintf (stderr, "Writing list %s\n", outputname);
-                	wordtable_write_to_file (mq.sorted[0], outputname, cutoff);
+                for (i = 0; i < mq.nsorted; i++) {
+                	/* write the final lists into files */
+                	if (debug > 0) fprintf (stderr, "Writing list %s (%u)\n", outputname, mq.sorted[i]->wordlength);
+                	write_table (mq.sorted[i], cutoff);
 		}
 
                 if (debug) {
-                	fprintf (stderr, "Read %.2f\n", mq.queue.tokens[TIME_READ].dval);
-                	fprintf (stderr, "Sort %.2f\n", mq.queue.tokens[TIME_SORT].dval);
-                	fprintf (stderr, "Collate %.2f\n", mq.queue.tokens[TIME_FF].dval);
-                	fprintf (stderr, "Merge %.2f\n", mq.queue.tokens[TIME_MERGE].dval);
+                	unsigned long long rss, max_rss;
+                	get_rss (&rss, &max_rss);
+                	fprintf (stderr, "Read %.2f (%llu page faults)\n", mq.queue.tokens[TIME_READ].dval, mq.queue.tokens[FAULTS_READ].lval);
+                	fprintf (stderr, "Sort %.2f (%llu page faults)\n", mq.queue.tokens[TIME_SORT].dval, mq.queue.tokens[FAULTS_SORT].lval);
+                	fprintf (stderr, "Collate %.2f (%llu page faults)\n", mq.queue.tokens[TIME_FF].dval, mq.queue.tokens[FAULTS_FF].lval);
+                	fprintf (stderr, "Merge %.2f (%llu page faults)\n", mq.queue.tokens[TIME_MERGE].dval, mq.queue.tokens[FAULTS_MERGE].lval);
+                	fprintf (stderr, "RSS %.2fG (max %.2fG)\n", (double) rss / 1073741824.0, (double) max_rss / 1073741824.0);
                 }
 
                 maker_queue_release (&mq);
@@ -275,17 +419,19 @@ main (int argc, const char *argv[])
 		/* CASE: ONE THREAD */
 		const unsigned char *cdata;
 		unsigned long long csize;
-		wordtable *table, *temptable;
+		wordtable *tables[FASTA_MAX_WORDLENGTHS], *temptables[FASTA_MAX_WORDLENGTHS];
 		int v;
 		
 		/* creating initial tables */
-		table = wordtable_new (wordlength, 20000);
-		temptable = wordtable_new (wordlength, 20000);
+		for (i = 0; i < nwordlengths; i++) {
+			tables[i] = wordtable_new (wordlengths[i], 20000);
+			temptables[i] = wordtable_new (wordlengths[i], 20000);
+		}
 		
 		for (argidx = firstfasta; argidx <= firstfasta + nfasta - 1; argidx++) {
 			FastaReader reader;
 
-			temptable->wordlength = wordlength;
+			for (i = 0; i < nwordlengths; i++) temptables[i]->wordlength = wordlengths[i];
 
 			if (!strcmp (argv[argidx], "-")) {
 				/* stdin */
@@ -298,42 +444,52 @@ main (int argc, const char *argv[])
 				}
 				fasta_reader_init_from_data (&reader, wordlength, 1, cdata, csize);
 			}
+			if (nwordlengths > 1) fasta_reader_set_wordlengths (&reader, wordlengths, nwordlengths);
 
 			/* reading words from FastA/FastQ */
-			v = fasta_reader_read_nwords (&reader, 0xffffffffffffffffULL, NULL, NULL, NULL, NULL, process_word, (void *) temptable);
+			v = fasta_reader_read_nwords (&reader, 0xffffffffffffffffULL, NULL, NULL, NULL, NULL, process_word, (void *) temptables);
 			if (v) return print_error_message (v);
 			fasta_reader_release (&reader);
 
-			/* radix sorting */
-			wordtable_sort (temptable, 0);
-			v = wordtable_find_frequencies (temptable);
-			if (v) return print_error_message (v);
-
-
-			/* merging two tables */
-			if (argidx > firstfasta) {
-				v = wordtable_merge (table, temptable);
+			for (i = 0; i < nwordlengths; i++) {
+				/* radix sorting */
+				wordtable_sort (temptables[i], 0);
+				v = wordtable_find_frequencies (temptables[i]);
 				if (v) return print_error_message (v);
-			} else {
-				wordtable *t = table;
-				table = temptable;
-				temptable = t;
-			}
 
-			/* empty the temporary table */
-			wordtable_empty (temptable);
+				/* merging two tables */
+				if (argidx > firstfasta) {
+					v = wordtable_merge (tables[i], temptables[i]);
+					if (v) return print_error_message (v);
+				} else {
+					wordtable *t = tables[i];
+					tables[i] = temptables[i];
+					temptables[i] = t;
+				}
 
+				/* empty the temporary table */
+				wordtable_empty (temptables[i]);
+			}
 		}
 
-		/* write the final list into a file */
-		if (debug > 0) fprintf (stderr, "Writing list %s\n", outputname);
-		if (wordtable_write_to_file (table, outputname, cutoff)) {
-			fprintf (stderr, "Cannot write list to file\n");
+		/* write the final lists into files */
+		for (i = 0; i < nwordlengths; i++) {
+			if (debug > 0) fprintf (stderr, "Writing list %s (%u)\n", outputname, wordlengths[i]);
+			if (write_table (tables[i], cutoff)) {
+				fprintf (stderr, "Cannot write list to file\n");
+			}
+		}
+		if (debug) {
+			unsigned long long rss, max_rss;
+			get_rss (&rss, &max_rss);
+			fprintf (stderr, "RSS %.2fG (max %.2fG)\n", (double) rss / 1073741824.0, (double) max_rss / 1073741824.0);
 		}
 	}
 
 	/*wordtable_delete (temptable);
 	wordtable_delete (table);*/
+	if (prefilter) countmin_release (prefilter);
+	if (updatemap) gt4_wordmap_delete (updatemap);
 
         pthread_exit (NULL);
 }
@@ -344,8 +500,11 @@ process (Queue *queue, unsigned int idx, void *arg)
         MakerQueue *mq;
         unsigned int finished;
         double s_t, e_t, d_t;
+        unsigned long long s_f, e_f, d_f;
+        unsigned int ntables_needed;
 
         mq = (MakerQueue *) arg;
+        ntables_needed = (mq->nwordlengths) ? mq->nwordlengths : 1;
 
         finished = 0;
         
@@ -370,28 +529,38 @@ process (Queue *queue, unsigned int idx, void *arg)
                 if (!has_files && !has_unsorted && sorted_tables && (sorted_tables <= MAX_MERGED_TABLES)) {
                 	if (!has_unmerged) {
                 		/* Merge to disk */
-                		wordtable *t[MAX_MERGED_TABLES];
-                		unsigned int ntables;
+                		wordtable *all[MAX_MERGED_TABLES], *t[MAX_MERGED_TABLES];
+                		unsigned int nall, ntables, i, j;
                 		char c[1024];
-                		ntables = 0;
+                		nall = 0;
                 		while (mq->nsorted) {
-                			t[ntables++] = queue_get_sorted (mq);
+                			all[nall++] = queue_get_sorted (mq);
 				}
-				wordtable_build_filename (t[0], c, 1024, outputname);
 				mq->ntasks[TASK_MERGE] += 1;
-				if (debug) {
-                			unsigned int i;
-                			fprintf (stderr, "Merging %u tables: %s", ntables, t[0]->id);
-                			for (i = 1; i < ntables; i++) {
-                				fprintf (stderr, ",%s", t[i]->id);
-					}
-					fprintf (stderr, " to %s\n", c);
-				}
 				/* Now we can release mutex */
 				pthread_mutex_unlock (&mq->queue.mutex);
-				/* merge_write (table, other, c, queue->cutoff); */
-				if (merge_write_multi (t, ntables, c, mq->cutoff)) {
-					fprintf (stderr, "Cannot write list to file\n");
+				/* One list per word length */
+				for (i = 0; i < nall; i++) {
+					if (!all[i]) continue;
+					ntables = 0;
+					for (j = i; j < nall; j++) {
+						if (all[j] && (all[j]->wordlength == all[i]->wordlength)) {
+							t[ntables++] = all[j];
+							if (j > i) all[j] = NULL;
+						}
+					}
+					wordtable_build_filename (t[0], c, 1024, outputname);
+					if (debug) {
+						fprintf (stderr, "Merging %u tables: %s", ntables, t[0]->id);
+						for (j = 1; j < ntables; j++) {
+							fprintf (stderr, ",%s", t[j]->id);
+						}
+						fprintf (stderr, " to %s\n", c);
+					}
+					/* merge_write (table, other, c, queue->cutoff); */
+					if (merge_write_multi (t, ntables, updatemap, c, mq->cutoff)) {
+						fprintf (stderr, "Cannot write list to file\n");
+					}
 				}
 				pthread_mutex_lock (&mq->queue.mutex);
 				mq->ntasks[TASK_MERGE] -= 1;
@@ -406,24 +575,30 @@ process (Queue *queue, unsigned int idx, void *arg)
 			}
 			continue;
                 }
-                if (mq->nsorted > 1) {
+                if (queue_get_mergeable_wordlength (mq)) {
                 	/* Task 1 - merge sorted tables */
                         wordtable *table, *other;
+                        unsigned int wordlength, nidle;
                         int result;
 
-                        other = queue_get_smallest_sorted (mq);
-                        table = queue_get_mostavailable_sorted (mq);
+                        wordlength = queue_get_mergeable_wordlength (mq);
+                        other = queue_get_smallest_sorted (mq, wordlength);
+                        table = queue_get_mostavailable_sorted (mq, wordlength);
                         if (table->nwordslots < other->nwordslots) {
                         	wordtable *t = table;
                         	table = other;
                         	other = t;
                         }
                         mq->ntasks[TASK_MERGE] += 1;
+                        /* Merge segments only use workers that are idle now (and this one) */
+                        nidle = mq->queue.nthreads_total - mq->ntasks[TASK_READ] - mq->ntasks[TASK_SORT] - mq->ntasks[TASK_MERGE];
                         /* Now we can release mutex */
                         pthread_mutex_unlock (&mq->queue.mutex);
                         if (debug > 0) fprintf (stderr, "Thread %d: Merging tables %s (%llu/%llu) + %s (%llu/%llu) -> %s\n", idx, table->id, table->nwords, table->nwordslots, other->id, other->nwords, other->nwordslots, table->id);
                         s_t = get_time ();
-			result = wordtable_merge (table, other);
+                        s_f = get_thread_page_faults ();
+			result = wordtable_merge_parallel (table, other, nidle + 1);
+			e_f = get_thread_page_faults ();
 			e_t = get_time ();
 			d_t = e_t - s_t;
                         /* fixme: Error processing */
@@ -438,6 +613,7 @@ process (Queue *queue, unsigned int idx, void *arg)
                         other->wordlength = mq->wordlen;
                         mq->available[mq->navailable++] = other;
                         mq->queue.tokens[TIME_MERGE].dval += d_t;
+                        mq->queue.tokens[FAULTS_MERGE].lval += e_f - s_f;
                         /* Release mutex */
                         mq->ntasks[TASK_MERGE] -= 1;
                         pthread_cond_broadcast (&mq->queue.cond);
@@ -454,11 +630,16 @@ process (Queue *queue, unsigned int idx, void *arg)
                         pthread_mutex_unlock (&mq->queue.mutex);
                         if (debug > 0) fprintf (stderr, "Thread %d: Sorting table %s (%llu/%llu)\n", idx, table->id, table->nwords, table->nwordslots);
                         s_t = get_time ();
+                        s_f = get_thread_page_faults ();
                         wordtable_sort (table, 0);
+                        e_f = get_thread_page_faults ();
                         e_t = get_time ();
                         d_t = e_t - s_t;
+                        d_f = e_f - s_f;
                         s_t = get_time ();
+                        s_f = get_thread_page_faults ();
                         result = wordtable_find_frequencies (table);
+                        e_f = get_thread_page_faults ();
                         e_t = get_time ();
                         /* fixme: Error processing */
                         if (result) {
@@ -469,32 +650,39 @@ process (Queue *queue, unsigned int idx, void *arg)
                         /* Add sorted table to sorted list */
                         mq->sorted[mq->nsorted++] = table;
                         mq->queue.tokens[TIME_SORT].dval += d_t;
+                        mq->queue.tokens[FAULTS_SORT].lval += d_f;
                         d_t = e_t - s_t;
                         mq->queue.tokens[TIME_FF].dval += d_t;
+                        mq->queue.tokens[FAULTS_FF].lval += e_f - s_f;
                         /* Release mutex */
                         mq->ntasks[TASK_SORT] -= 1;
                         pthread_cond_broadcast (&mq->queue.cond);
                         pthread_mutex_unlock (&mq->queue.mutex);
                         if (debug > 0) fprintf (stderr, "Thread %d: Finished sorting %s (%llu/%llu)\n", idx, table->id, table->nwords, table->nwordslots);
-                } else if (mq->files && (mq->ntasks[TASK_READ] < MAX_FILES) && (mq->navailable || (mq->ntablescreated < ntables))) {
+                } else if (mq->files && (mq->ntasks[TASK_READ] < MAX_FILES) && ((mq->navailable + ntables - mq->ntablescreated) >= ntables_needed)) {
                         /* Task 3 - read input file */
                         TaskFile *task;
-                        wordtable *table;
+                        wordtable *tables[FASTA_MAX_WORDLENGTHS], *table;
                         int result;
                         unsigned long long readsize;
+                        unsigned int i;
 
                         task = mq->files;
                         mq->files = task->next;
                         mq->ntasks[TASK_READ] += 1;
-                        if (mq->navailable > 0) {
-                                /* Has to create new word table */
-                                table = queue_get_largest_table (mq);
-                        } else {
-                                table = wordtable_new (mq->wordlen, 10000000);
-                                table->wordlength = mq->wordlen;
-                                mq->ntablescreated += 1;
-                                if (debug > 0) fprintf (stderr, "Thread %d: Created table %s\n", idx, table->id);
+                        /* One table per word length */
+                        for (i = 0; i < ntables_needed; i++) {
+                                if (mq->navailable > 0) {
+                                        /* Has to create new word table */
+                                        tables[i] = queue_get_largest_table (mq);
+                                } else {
+                                        tables[i] = wordtable_new (mq->wordlen, 10000000);
+                                        mq->ntablescreated += 1;
+                                        if (debug > 0) fprintf (stderr, "Thread %d: Created table %s\n", idx, tables[i]->id);
+                                }
+                                tables[i]->wordlength = (mq->nwordlengths) ? mq->wordlengths[i] : mq->wordlen;
                         }
+                        table = tables[0];
                         /* Now we can release mutex */
                         pthread_mutex_unlock (&mq->queue.mutex);
                         
@@ -503,7 +691,9 @@ process (Queue *queue, unsigned int idx, void *arg)
                         readsize = (mq->tablesize < table->nwordslots) ? table->nwordslots : mq->tablesize;
                         if (debug > 0) fprintf (stderr, "Thread %d: Reading %lld bytes from %s, position %llu/%llu\n", idx, readsize, task->seqfile->path, (unsigned long long) task->reader.cpos, (unsigned long long) task->seqfile->csize);
                         s_t = get_time ();
-                        result = task_file_read_nwords (task, readsize, mq->wordlen, NULL, NULL, NULL, NULL, process_word, table);
+                        s_f = get_thread_page_faults ();
+                        result = task_file_read_nwords (task, readsize, mq->wordlen, NULL, NULL, NULL, NULL, process_word, tables);
+                        e_f = get_thread_page_faults ();
                         e_t = get_time ();
 			d_t = e_t - s_t;
                         if (result) {
@@ -512,8 +702,8 @@ process (Queue *queue, unsigned int idx, void *arg)
                         }
                         /* Lock mutex */
                         pthread_mutex_lock (&mq->queue.mutex);
-                        /* Add generated table to unsorted list */
-                        mq->unsorted[mq->nunsorted++] = table;
+                        /* Add generated tables to unsorted list */
+                        for (i = 0; i < ntables_needed; i++) mq->unsorted[mq->nunsorted++] = tables[i];
                         if (task->reader.in_eof) {
                                 /* Finished this task */
                                 if (debug > 0) fprintf (stderr, "Thread %d: FastaReader for %s finished\n", idx, task->seqfile->path);
@@ -525,6 +715,7 @@ process (Queue *queue, unsigned int idx, void *arg)
                         }
                         mq->ntasks[TASK_READ] -= 1;
                         mq->queue.tokens[TIME_READ].dval += d_t;
+                        mq->queue.tokens[FAULTS_READ].lval += e_f - s_f;
                         /* Release mutex */
                         pthread_cond_broadcast (&mq->queue.cond);
                         pthread_mutex_unlock (&mq->queue.mutex);
@@ -557,18 +748,108 @@ process (Queue *queue, unsigned int idx, void *arg)
 int 
 process_word (FastaReader *reader, unsigned long long word, void *data)
 {
-	wordtable *table = (wordtable *) data;
+	/* Tables are indexed by the length of word */
+	wordtable *table = ((wordtable **) data)[reader->wordidx];
+	if (prefilter && (countmin_estimate (prefilter, word) < prefilter->cap)) return 0;
 #if 1
 	wordtable_add_word_nofreq (table, word, reader->wordlength);
 #endif
 	return 0;
 }
 
+typedef struct _PrefilterTask {
+	CountMin *cm;
+	const char **files;
+	unsigned int nfiles;
+	unsigned int next;
+	const unsigned int *wordlengths;
+	unsigned int nwordlengths;
+	int result;
+	pthread_mutex_t mutex;
+} PrefilterTask;
+
+static int
+prefilter_word (FastaReader *reader, unsigned long long word, void *data)
+{
+	countmin_add ((CountMin *) data, word);
+	return 0;
+}
+
+static void *
+prefilter_files (void *arg)
+{
+	PrefilterTask *task = (PrefilterTask *) arg;
+	while (1) {
+		FastaReader reader;
+		const unsigned char *cdata;
+		unsigned long long csize;
+		unsigned int idx;
+		int v;
+		pthread_mutex_lock (&task->mutex);
+		idx = task->next++;
+		pthread_mutex_unlock (&task->mutex);
+		if (idx >= task->nfiles) break;
+		cdata = gt4_mmap (task->files[idx], &csize);
+		if (!cdata) {
+			fprintf (stderr, "Error: Cannot read file %s!\n", task->files[idx]);
+			task->result = 1;
+			break;
+		}
+		fasta_reader_init_from_data (&reader, task->wordlengths[0], 1, cdata, csize);
+		if (task->nwordlengths > 1) fasta_reader_set_wordlengths (&reader, task->wordlengths, task->nwordlengths);
+		v = fasta_reader_read_nwords (&reader, 0xffffffffffffffffULL, NULL, NULL, NULL, NULL, prefilter_word, (void *) task->cm);
+		fasta_reader_release (&reader);
+		gt4_munmap (cdata, csize);
+		if (v) {
+			print_error_message (v);
+			task->result = 1;
+			break;
+		}
+	}
+	return NULL;
+}
+
+static int
+build_prefilter (CountMin *cm, const char *files[], unsigned int nfiles, const unsigned int wordlengths[], unsigned int nwordlengths, unsigned int nthreads)
+{
+	PrefilterTask task;
+	pthread_t threads[256];
+	unsigned int i;
+	task.cm = cm;
+	task.files = files;
+	task.nfiles = nfiles;
+	task.next = 0;
+	task.wordlengths = wordlengths;
+	task.nwordlengths = nwordlengths;
+	task.result = 0;
+	pthread_mutex_init (&task.mutex, NULL);
+	if (nthreads > nfiles) nthreads = nfiles;
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create (&threads[i], NULL, prefilter_files, &task)) threads[i] = 0;
+	}
+	prefilter_files (&task);
+	for (i = 1; i < nthreads; i++) {
+		if (threads[i]) pthread_join (threads[i], NULL);
+	}
+	pthread_mutex_destroy (&task.mutex);
+	return task.result;
+}
+
 static unsigned int
-merge_write_multi (wordtable *t[], unsigned int ntables, const char *filename, unsigned int cutoff)
+write_table (wordtable *table, unsigned int cutoff)
+{
+	char c[1024];
+	if (!updatemap) return wordtable_write_to_file (table, outputname, cutoff);
+	wordtable_build_filename (table, c, 1024, outputname);
+	return merge_write_multi (&table, 1, updatemap, c, cutoff);
+}
+
+static unsigned int
+merge_write_multi (wordtable *t[], unsigned int ntables, GT4WordMap *base, const char *filename, unsigned int cutoff)
 {
 	unsigned long long nwords[MAX_MERGED_TABLES];
 	unsigned long long i[MAX_MERGED_TABLES];
+	unsigned long long ib = 0, nb = 0;
 	unsigned int nfinished;
 
 	GT4ListHeader h;
@@ -584,7 +865,7 @@ merge_write_multi (wordtable *t[], unsigned int ntables, const char *filename, u
 	h.code = GT4_LIST_CODE;
 	h.version_major = VERSION_MAJOR;
 	h.version_minor = VERSION_MINOR;
-	h.wordlength = t[0]->wordlength;
+	h.wordlength = (ntables) ? t[0]->wordlength : base->header->wordlength;
 	h.nwords = 0;
 	h.totalfreq = 0;
 	h.padding = sizeof (GT4ListHeader);
@@ -609,10 +890,16 @@ merge_write_multi (wordtable *t[], unsigned int ntables, const char *filename, u
 	}
 		
 	memset (i, 0, sizeof (i));
+	if (base) nb = base->header->nwords;
 	
-	while (nfinished < ntables) {
+	while ((nfinished < ntables) || (ib < nb)) {
 		word = 0xffffffffffffffff;
 		freq = 0;
+		/* Existing list is read sequentially */
+		if (ib < nb) {
+			word = WORDMAP_WORD (base, ib);
+			freq = WORDMAP_FREQ (base, ib);
+		}
 		/* Find smalles word and total freq */
 		for (j = 0; j < ntables; j++) {
 			if (i[j] < nwords[j]) {
@@ -643,6 +930,7 @@ merge_write_multi (wordtable *t[], unsigned int ntables, const char *filename, u
 			h.totalfreq += freq;
 		}
 		/* Update pointers */
+		if ((ib < nb) && (WORDMAP_WORD (base, ib) == word)) ib += 1;
 		for (j = 0; j < ntables; j++) {
 			if (i[j] < nwords[j]) {
 				/* This table is not finished */
@@ -677,11 +965,16 @@ print_help (int exitvalue)
 	fprintf (stderr, "    -v, --version           - print version information and exit\n");
 	fprintf (stderr, "    -h, --help              - print this usage screen and exit\n");
 	fprintf (stderr, "    -w, --wordlength NUMBER - specify index wordsize (1-32) (default 16)\n");
+	fprintf (stderr, "                              several comma-separated sizes (e.g. 16,25,32) are counted in one pass\n");
 	fprintf (stderr, "    -c, --cutoff NUMBER     - specify frequency cut-off (default 1)\n");
 	fprintf (stderr, "    -o, --outputname STRING - specify output name (default \"out\")\n");
 	fprintf (stderr, "    --num_threads           - number of threads the program is run on (default MIN(8, num_input_files))\n");
-	fprintf (stderr, "    --max_tables            - maximum number of temporary tables (default MAX(num_threads, 2))\n");
+	fprintf (stderr, "    --max_tables            - maximum number of temporary tables per wordsize (default MAX(num_threads, 2))\n");
 	fprintf (stderr, "    --table_size            - maximum size of the temporary table (default 500000000)\n");
+	fprintf (stderr, "    --table_alloc TYPE      - temporary table allocation (malloc, mmap, huge) (default malloc)\n");
+	fprintf (stderr, "    --update LIST           - add counts from input files to existing list (made with cut-off 1)\n");
+	fprintf (stderr, "    --prefilter             - count words approximately first and drop words below cut-off early\n");
+	fprintf (stderr, "    --prefilter_size NUMBER - prefilter memory in megabytes (default %d)\n", DEFAULT_PREFILTER_SIZE);
 	fprintf (stderr, "    -D                      - increase debug level\n");
 	exit (exitvalue);
 }
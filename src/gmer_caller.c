@@ -3,13 +3,21 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
 
+#include "bgzf.h"
 #include "binomial.h"
+#include "counts.h"
 #include "genotypes.h"
+#include "median.h"
 #include "utils.h"
 #include "simplex.h"
-#include "thread-pool.h"
+#include "lbfgs.h"
+#include "pool.h"
 
 static unsigned int debug = 0;
 
@@ -18,7 +26,7 @@ static unsigned int debug = 0;
 #define MIN(a,b) ((a) <= (b) ? (a) : (b))
 #define MAX(a,b) ((a) >= (b) ? (a) : (b))
 
-AosoraThreadPool *pool = NULL;
+GT4Pool *pool = NULL;
 
 static const char *gt[] = { "-", "A", "B", "AA", "AB", "BB", "AAA", "AAB", "BBA", "BBB", "AAAA", "AAAB", "BBBA", "AABB", "BBBB" };
 
@@ -32,8 +40,42 @@ struct _SNPCall {
 };
 
 static float distanceL3 (int ndim, const float params[], void *data);
+static double distanceL3_d (int ndim, const double params[], double grad[], void *data);
+static void lbfgs_from_params (double u[], const float params[]);
+static void lbfgs_to_params (float params[], const double u[]);
+static void lbfgs_report_bounds (const double u[]);
+
+/* Model training method */
+enum { OPTIMIZER_SIMPLEX, OPTIMIZER_LBFGS };
+
+/* Count pairs of all lines, parsed once for median and calls */
+typedef struct _ParsedCounts ParsedCounts;
+struct _ParsedCounts {
+  unsigned int n;
+  /* Counts of line i are values[first[i]...first[i + 1]] (pairs) */
+  unsigned int *first;
+  int *values;
+};
+
+/* Chromosome class of line (by first character) */
+enum { LINE_AUTOSOME, LINE_X, LINE_Y, LINE_OTHER };
 
-static unsigned int get_pair_median (const unsigned char *cdata, unsigned long long csize, const unsigned char *lines[], unsigned int autos[], unsigned int nautos);
+static unsigned int index_text_counts (const unsigned char *cdata, unsigned long long csize, const unsigned char ***lines, unsigned char **classes, ParsedCounts *pc);
+static unsigned int index_binary_counts (const GT4Counts *bin, const unsigned char ***lines, unsigned char **classes, ParsedCounts *pc);
+static void parsed_counts_release (ParsedCounts *pc);
+static unsigned int get_pair_median (const ParsedCounts *pc, const unsigned int indices[], unsigned int n);
+
+/* Unique (var1, var2) count pairs of a call set */
+typedef struct _CountPairs CountPairs;
+struct _CountPairs {
+  unsigned int n_pairs;
+  unsigned int *var1;
+  unsigned int *var2;
+  /* Number of calls with this pair */
+  unsigned int *mult;
+  /* Pair index of every call */
+  unsigned int *map;
+};
 
 typedef struct _L3Data L3Data;
 typedef struct _L3Optim L3Optim;
@@ -43,19 +85,108 @@ struct _L3Optim {
   unsigned int first_call;
   unsigned int n_calls;
   double sum;
+  double grad[7];
 };
 
 struct _L3Data {
   float *params;
+  /* Unique count pairs with multiplicities */
   unsigned int n_calls;
   unsigned int *var1;
   unsigned int *var2;
+  unsigned int *mult;
   float pB;
   unsigned int n_threads;
-  AosoraThreadPool *pool;
+  /* Chunks are evaluated in calling thread if NULL */
+  GT4Pool *pool;
   L3Optim optims[MAX_THREADS];
+  /* Best evaluated point (simplex restarts evaluate it again) */
+  unsigned int has_best;
+  float best_params[7];
+  float best_result;
+  /* Gradient evaluation at actual parameters (l_viga, p_0, p_1, p_2, lambda, size, size2) */
+  unsigned int gradient;
+  double values[7];
+  /* Number of likelihood passes */
+  unsigned int n_evals;
+};
+
+/* Independent simplex starts */
+#define TRAIN_CHUNK_SIZE 2000
+
+/* L-BFGS iterations per run and relative improvement to stop */
+#define LBFGS_ITERATIONS 200
+#define LBFGS_TOLERANCE 1e-7
+/* Upper clamp of size in L-BFGS, negative binomial is close to Poisson there and float distance loses precision above it */
+#define LBFGS_MAX_SIZE 1e5
+
+typedef struct _TrainStarts TrainStarts;
+
+struct _TrainStarts {
+  unsigned int n_starts;
+  unsigned int n_threads;
+  unsigned int seed;
+  unsigned int nruns;
+  unsigned int n_calls;
+  unsigned int *var1;
+  unsigned int *var2;
+  unsigned int *mult;
+  float pB;
+  float params[7];
+  float deltas[7];
+  /* Next start to run */
+  unsigned int next;
+  /* Results */
+  float *start_params;
+  float *distances;
+  unsigned int n_evals;
 };
 
+/* Settings shared by all samples */
+typedef struct _CallerOptions CallerOptions;
+
+struct _CallerOptions {
+  unsigned int nruns;
+  unsigned int nstarts;
+  unsigned int seed;
+  unsigned int optimizer;
+  unsigned int max_training;
+  unsigned int nthreads;
+  unsigned int header;
+  unsigned int non_canonical;
+  float prob_cutoff;
+  unsigned int alternatives;
+  unsigned int info;
+  unsigned int print_gt;
+  unsigned int model;
+  /* Initial model */
+  float params[7];
+};
+
+/* Per-sample random numbers, same sequence as srand (seed) and rand () */
+typedef struct _SampleRandom SampleRandom;
+
+struct _SampleRandom {
+  struct random_data data;
+  char state[128];
+};
+
+static void
+sample_random_init (SampleRandom *rng, unsigned int seed)
+{
+  memset (rng, 0, sizeof (SampleRandom));
+  initstate_r (seed, rng->state, sizeof (rng->state), &rng->data);
+}
+
+static int
+sample_random (void *data)
+{
+  SampleRandom *rng = (SampleRandom *) data;
+  int32_t r;
+  random_r (&rng->data, &r);
+  return r;
+}
+
 #define MIN_P (1.0f / 8192)
 
 static float
@@ -107,54 +238,206 @@ print_params (const float params[], const char *prefix, FILE *ofs)
 }
 
 static unsigned int
-count_lines (const unsigned char *cdata, unsigned long long csize)
+classify_line (const unsigned char *p)
 {
-  unsigned long long cpos;
-  unsigned int nlines;
+  if ((p[0] > '0') && (p[0] <= '9')) return LINE_AUTOSOME;
+  if (p[0] == 'X') return LINE_X;
+  if (p[0] == 'Y') return LINE_Y;
+  return LINE_OTHER;
+}
+
+/* Parse up to 3 count pairs of text line, return the number of pairs */
+
+static unsigned int
+parse_count_pairs (const unsigned char *p, unsigned long long len, int values[])
+{
+  unsigned int ntokenz, j;
+  const unsigned char *tokenz[16];
+  unsigned int lengths[16];
+  ntokenz = split_line (p, len, tokenz, lengths, 8);
+  if (ntokenz < 4) return 0;
+  for (j = 2; j < ntokenz; j++) values[j - 2] = strtol ((const char *) tokenz[j], NULL, 10);
+  return (ntokenz - 2) / 2;
+}
+
+/* Text counts are indexed in newline-aligned chunks */
+#define TEXT_CHUNK_SIZE (1 << 20)
+
+typedef struct _TextChunk TextChunk;
+struct _TextChunk {
+  const unsigned char *start;
+  const unsigned char *end;
+  unsigned int first_line;
+  unsigned int n_lines;
+  /* Counts of chunk before merging */
+  int *values;
+  unsigned int n_values;
+  unsigned int first_value;
+};
+
+typedef struct _TextIndex TextIndex;
+struct _TextIndex {
+  TextChunk *chunks;
+  const unsigned char **lines;
+  unsigned char *classes;
+  ParsedCounts *pc;
+};
+
+static void
+text_count_range (void *data, unsigned long long start, unsigned long long end)
+{
+  TextIndex *ti = (TextIndex *) data;
+  unsigned long long i;
+  for (i = start; i < end; i++) {
+    TextChunk *c = &ti->chunks[i];
+    const unsigned char *p = c->start;
+    c->n_lines = 0;
+    while (p < c->end) {
+      p = (const unsigned char *) memchr (p, '\n', c->end - p);
+      if (!p) break;
+      c->n_lines += 1;
+      p += 1;
+    }
+  }
+}
+
+/* Line pointers, classes and counts, pc->first is relative to chunk */
+static void
+text_parse_range (void *data, unsigned long long start, unsigned long long end)
+{
+  TextIndex *ti = (TextIndex *) data;
+  unsigned long long i;
+  for (i = start; i < end; i++) {
+    TextChunk *c = &ti->chunks[i];
+    const unsigned char *p = c->start;
+    unsigned int l;
+    c->values = (int *) malloc ((c->n_lines * 6 + 1) * sizeof (int));
+    c->n_values = 0;
+    for (l = c->first_line; l < c->first_line + c->n_lines; l++) {
+      const unsigned char *e = (const unsigned char *) memchr (p, '\n', c->end - p) + 1;
+      ti->lines[l] = p;
+      ti->classes[l] = classify_line (p);
+      c->n_values += 2 * parse_count_pairs (p, e - p, c->values + c->n_values);
+      ti->pc->first[l + 1] = c->n_values;
+      p = e;
+    }
+  }
+}
+
+static void
+text_merge_range (void *data, unsigned long long start, unsigned long long end)
+{
+  TextIndex *ti = (TextIndex *) data;
+  unsigned long long i;
+  for (i = start; i < end; i++) {
+    TextChunk *c = &ti->chunks[i];
+    unsigned int l;
+    memcpy (ti->pc->values + c->first_value, c->values, c->n_values * sizeof (int));
+    for (l = c->first_line; l < c->first_line + c->n_lines; l++) ti->pc->first[l + 1] += c->first_value;
+    free (c->values);
+  }
+}
+
+/* Build line table, classes and parsed counts, return number of complete lines */
+static unsigned int
+index_text_counts (const unsigned char *cdata, unsigned long long csize, const unsigned char ***lines, unsigned char **classes, ParsedCounts *pc)
+{
+  TextIndex ti;
+  unsigned int nchunks, nlines, nvalues, i;
+
+  /* Chunk boundaries are moved past the next newline */
+  nchunks = (csize + TEXT_CHUNK_SIZE - 1) / TEXT_CHUNK_SIZE;
+  if (nchunks > 4 * (gt4_pool_get_num_workers (pool) + 1)) nchunks = 4 * (gt4_pool_get_num_workers (pool) + 1);
+  if (nchunks < 1) nchunks = 1;
+  ti.chunks = (TextChunk *) malloc (nchunks * sizeof (TextChunk));
+  memset (ti.chunks, 0, nchunks * sizeof (TextChunk));
+  ti.chunks[0].start = cdata;
+  for (i = 1; i < nchunks; i++) {
+    const unsigned char *p = cdata + csize * i / nchunks;
+    if (p < ti.chunks[i - 1].start) p = ti.chunks[i - 1].start;
+    p = (const unsigned char *) memchr (p, '\n', cdata + csize - p);
+    p = (p) ? p + 1 : cdata + csize;
+    ti.chunks[i - 1].end = p;
+    ti.chunks[i].start = p;
+  }
+  ti.chunks[nchunks - 1].end = cdata + csize;
+  gt4_pool_parallel_for (pool, nchunks, 1, text_count_range, &ti);
+
   nlines = 0;
-  cpos = 0;
-  while (cpos < csize) {
-    while ((cpos < csize) && (cdata[cpos] != '\n')) cpos += 1;
-    if (cdata[cpos] == '\n') nlines += 1;
-    cpos += 1;
+  for (i = 0; i < nchunks; i++) {
+    ti.chunks[i].first_line = nlines;
+    nlines += ti.chunks[i].n_lines;
   }
+  ti.lines = (const unsigned char **) malloc ((nlines + 1) * sizeof (unsigned char *));
+  ti.classes = (unsigned char *) malloc (nlines + 1);
+  pc->n = nlines;
+  pc->first = (unsigned int *) malloc ((nlines + 1) * sizeof (unsigned int));
+  pc->first[0] = 0;
+  ti.pc = pc;
+  gt4_pool_parallel_for (pool, nchunks, 1, text_parse_range, &ti);
+
+  nvalues = 0;
+  for (i = 0; i < nchunks; i++) {
+    ti.chunks[i].first_value = nvalues;
+    nvalues += ti.chunks[i].n_values;
+  }
+  pc->values = (int *) malloc ((nvalues + 1) * sizeof (int));
+  gt4_pool_parallel_for (pool, nchunks, 1, text_merge_range, &ti);
+  free (ti.chunks);
+
+  ti.lines[nlines] = cdata + csize;
+  *lines = ti.lines;
+  *classes = ti.classes;
   return nlines;
 }
 
+/* Binary counts are already tokenized, lines are node names */
 static unsigned int
-parse_lines (const unsigned char *lines[], const unsigned char *cdata, unsigned long long csize)
+index_binary_counts (const GT4Counts *bin, const unsigned char ***lines, unsigned char **classes, ParsedCounts *pc)
 {
-  unsigned long long cpos;
-  unsigned int nlines;
-  nlines = 0;
-  cpos = 0;
-  while (cpos < csize) {
-    lines[nlines] = cdata + cpos;
-    while ((cpos < csize) && (cdata[cpos] != '\n')) cpos += 1;
-    if (cdata[cpos] == '\n') nlines += 1;
-    cpos += 1;
+  unsigned int nlines = bin->n_nodes, i;
+  *lines = (const unsigned char **) malloc ((nlines + 1) * sizeof (unsigned char *));
+  *classes = (unsigned char *) malloc (nlines + 1);
+  pc->n = nlines;
+  pc->first = (unsigned int *) malloc ((nlines + 1) * sizeof (unsigned int));
+  pc->values = (int *) malloc ((nlines * 6 + 1) * sizeof (int));
+  pc->first[0] = 0;
+  for (i = 0; i < nlines; i++) {
+    unsigned int v[6], n, j;
+    (*lines)[i] = (const unsigned char *) gt4_counts_get_name (bin, i);
+    (*classes)[i] = classify_line ((*lines)[i]);
+    n = gt4_counts_get (bin, i, v, 6) & ~1;
+    for (j = 0; j < n; j++) pc->values[pc->first[i] + j] = v[j];
+    pc->first[i + 1] = pc->first[i] + n;
   }
+  pc->values = (int *) realloc (pc->values, (pc->first[nlines] + 1) * sizeof (int));
+  (*lines)[nlines] = NULL;
   return nlines;
 }
 
+static void
+parsed_counts_release (ParsedCounts *pc)
+{
+  free (pc->first);
+  free (pc->values);
+}
+
 SNPCall *
-parse_calls (const unsigned char *lines[], const unsigned int indices[], unsigned int nautos, unsigned int pair_median)
+parse_calls (const ParsedCounts *pc, const unsigned int indices[], unsigned int *ncalls, unsigned int pair_median)
 {
-  unsigned int i;
-  SNPCall *calls = (SNPCall *) malloc (nautos * sizeof (SNPCall));
-  for (i = 0; i < nautos; i++) {
-    unsigned int ntokenz;
-    const unsigned char *tokenz[16];
-    unsigned int lengths[16];
+  unsigned int i, n;
+  SNPCall *calls = (SNPCall *) malloc ((*ncalls + 1) * sizeof (SNPCall));
+  n = 0;
+  for (i = 0; i < *ncalls; i++) {
+    const int *values = pc->values + pc->first[indices[i]];
     unsigned int npairs, j;
     int best_a, best_b, best_delta;
-    ntokenz = split_line (lines[indices[i]], lines[indices[i] + 1] - lines[indices[i]], tokenz, lengths, 8);
-    if (ntokenz < 4) continue;
-    npairs = (ntokenz - 2) / 2;
+    npairs = (pc->first[indices[i] + 1] - pc->first[indices[i]]) / 2;
+    if (!npairs) continue;
     best_delta = 0x7fffffff;
     for (j = 0; j < npairs; j++) {
-      int a = strtol ((const char *) tokenz[2 + 2 * j], NULL, 10);
-      int b = strtol ((const char *) tokenz[2 + 2 * j + 1], NULL, 10);
+      int a = values[2 * j];
+      int b = values[2 * j + 1];
       int delta = (a + b) - (int) pair_median;
       if (delta < 0) delta = - delta;
       if (delta < best_delta) {
@@ -163,17 +446,59 @@ parse_calls (const unsigned char *lines[], const unsigned int indices[], unsigne
         best_delta = delta;
       }
     }
-    calls[i].line = indices[i];
-    calls[i].counts[0] = best_a;
-    calls[i].counts[1] = best_b;
+    calls[n].line = indices[i];
+    calls[n].counts[0] = best_a;
+    calls[n].counts[1] = best_b;
+    n += 1;
   }
+  /* Lines without count pairs are dropped */
+  *ncalls = n;
   return calls;
 }
 
+/* Collapse counts of calls (set[i] or i if set is NULL) into unique pairs */
+
+static void
+count_pairs_build (CountPairs *pairs, const SNPCall *calls, const unsigned int set[], unsigned int n_calls)
+{
+  unsigned long long *keys = (unsigned long long *) malloc ((n_calls + 1) * 8);
+  unsigned int i;
+  for (i = 0; i < n_calls; i++) {
+    const SNPCall *call = (set) ? &calls[set[i]] : &calls[i];
+    keys[i] = ((unsigned long long) call->counts[0] << 48) | ((unsigned long long) call->counts[1] << 32) | i;
+  }
+  if (n_calls > 1) hybridInPlaceRadixSort256 (keys, keys + n_calls, NULL, 56);
+  pairs->n_pairs = 0;
+  pairs->var1 = (unsigned int *) malloc ((n_calls + 1) * sizeof (unsigned int));
+  pairs->var2 = (unsigned int *) malloc ((n_calls + 1) * sizeof (unsigned int));
+  pairs->mult = (unsigned int *) malloc ((n_calls + 1) * sizeof (unsigned int));
+  pairs->map = (unsigned int *) malloc ((n_calls + 1) * sizeof (unsigned int));
+  for (i = 0; i < n_calls; i++) {
+    if (!i || ((keys[i] >> 32) != (keys[i - 1] >> 32))) {
+      pairs->var1[pairs->n_pairs] = (keys[i] >> 48) & 0xffff;
+      pairs->var2[pairs->n_pairs] = (keys[i] >> 32) & 0xffff;
+      pairs->mult[pairs->n_pairs] = 0;
+      pairs->n_pairs += 1;
+    }
+    pairs->mult[pairs->n_pairs - 1] += 1;
+    pairs->map[keys[i] & 0xffffffff] = pairs->n_pairs - 1;
+  }
+  free (keys);
+}
+
+static void
+count_pairs_release (CountPairs *pairs)
+{
+  free (pairs->var1);
+  free (pairs->var2);
+  free (pairs->mult);
+  free (pairs->map);
+}
+
 /* Build list of unique random integers between 0...size */
 
 unsigned int *
-build_training_set (unsigned int set_size, unsigned int subset_size)
+build_training_set (unsigned int set_size, unsigned int subset_size, SampleRandom *rng)
 {
   unsigned int *train, i;
   train = (unsigned int *) malloc (set_size * sizeof (unsigned int));
@@ -182,7 +507,8 @@ build_training_set (unsigned int set_size, unsigned int subset_size)
   for (i = 0; i < subset_size; i++) {
     unsigned int p;
     unsigned int t;
-    p = (unsigned int) rand_long_long (0, set_size - 1);
+    /* Same as rand_long_long (0, set_size - 1) */
+    p = (unsigned int) ((unsigned long long) set_size * (sample_random (rng) / (RAND_MAX + 1.0)));
     t = train[i];
     train[i] = train[p];
     train[p] = t;
@@ -218,22 +544,122 @@ calculate_allele_freq (SNPCall *calls, unsigned int set[], unsigned int set_size
   }
 }
 
+static void optim_run (void *data);
+static void optim_range (void *data, unsigned long long start, unsigned long long end);
+
+/* Split evaluation into fixed chunks so that the result does not depend on the number of threads */
+
+static void
+l3_setup_chunks (L3Data *l3)
+{
+  unsigned int chunk_size, i;
+  l3->n_threads = (l3->n_calls + TRAIN_CHUNK_SIZE - 1) / TRAIN_CHUNK_SIZE;
+  if (l3->n_threads > MAX_THREADS) l3->n_threads = MAX_THREADS;
+  if (l3->n_threads < 1) l3->n_threads = 1;
+  chunk_size = (l3->n_calls + l3->n_threads - 1) / l3->n_threads;
+  for (i = 0; i < l3->n_threads; i++) {
+    l3->optims[i].l3 = l3;
+    l3->optims[i].first_call = i * chunk_size;
+    l3->optims[i].n_calls = chunk_size;
+    if (l3->optims[i].first_call + l3->optims[i].n_calls > l3->n_calls) {
+      l3->optims[i].n_calls = l3->n_calls - l3->optims[i].first_call;
+    }
+    l3->optims[i].sum = 0;
+  }
+}
+
+static void
+train_start_run (void *data)
+{
+  TrainStarts *ts = (TrainStarts *) data;
+  unsigned int idx, seed;
+  float deltas[7];
+  float *params;
+  L3Data l3;
+
+  idx = __sync_fetch_and_add (&ts->next, 1);
+  if (idx >= ts->n_starts) return;
+
+  params = ts->start_params + idx * 7;
+  memcpy (params, ts->params, sizeof (ts->params));
+  memcpy (deltas, ts->deltas, sizeof (deltas));
+  memset (&l3, 0, sizeof (l3));
+  l3.params = params;
+  l3.n_calls = ts->n_calls;
+  l3.var1 = ts->var1;
+  l3.var2 = ts->var2;
+  l3.mult = ts->mult;
+  l3.pB = ts->pB;
+  l3_setup_chunks (&l3);
+  /* Chunks are forked to the shared pool, idle threads steal them if fewer starts than threads remain */
+  l3.pool = (ts->n_threads > 1) ? pool : NULL;
+
+  seed = ts->seed + idx;
+  ts->distances[idx] = downhill_simplex_seeded (7, params, deltas, 1e-6, ts->nruns, 100, distanceL3, &l3, &seed);
+  __sync_fetch_and_add (&ts->n_evals, l3.n_evals);
+  if (debug) fprintf (stderr, "Start %u distance %.6f\n", idx, ts->distances[idx]);
+}
+
+/* Run independent simplex optimizations concurrently, keep the best (lowest index if equal) */
+
+static void
+train_starts (float params[], const float deltas[], unsigned int nruns, unsigned int nstarts, unsigned int seed, L3Data *l3, unsigned int nthreads)
+{
+  TrainStarts ts;
+  GT4PoolGroup group;
+  unsigned int i, best;
+
+  memset (&ts, 0, sizeof (ts));
+  ts.n_starts = nstarts;
+  ts.n_threads = nthreads;
+  ts.seed = seed;
+  ts.nruns = nruns;
+  ts.n_calls = l3->n_calls;
+  ts.var1 = l3->var1;
+  ts.var2 = l3->var2;
+  ts.mult = l3->mult;
+  ts.pB = l3->pB;
+  memcpy (ts.params, params, sizeof (ts.params));
+  memcpy (ts.deltas, deltas, sizeof (ts.deltas));
+  ts.start_params = (float *) malloc (nstarts * 7 * sizeof (float));
+  ts.distances = (float *) malloc (nstarts * sizeof (float));
+
+  gt4_pool_group_init (&group);
+  for (i = 0; i < nstarts; i++) {
+    gt4_pool_fork (pool, &group, train_start_run, &ts);
+  }
+  gt4_pool_join (pool, &group);
+
+  best = 0;
+  for (i = 1; i < nstarts; i++) {
+    if (ts.distances[i] < ts.distances[best]) best = i;
+  }
+  if (debug) fprintf (stderr, "Best start %u distance %.6f\n", best, ts.distances[best]);
+  l3->n_evals += ts.n_evals;
+  memcpy (params, ts.start_params + best * 7, 7 * sizeof (float));
+  free (ts.start_params);
+  free (ts.distances);
+}
+
 static void
-train_model (SNPCall *calls, unsigned int ncalls, unsigned int max_training, unsigned int nruns, float v[], float *pB, unsigned int mul, unsigned int nthreads)
+train_model (SNPCall *calls, unsigned int ncalls, const CallerOptions *opts, SampleRandom *rng, float v[], float *pB, unsigned int mul)
 {
+  unsigned int nthreads = opts->nthreads;
   unsigned int *train;
   unsigned int ntrain;
   double s0, s1, ppB, npB;
   double keskmine;
   float params[7], deltas[7];
   L3Data l3;
+  CountPairs pairs;
   unsigned int i;
   unsigned int chunk_size;
+  double dist = 0;
 
   /* Train model */
   if (debug) fprintf (stderr, "Building training set...");
-  ntrain = MIN (ncalls, max_training);
-  train = build_training_set (ncalls, ntrain);
+  ntrain = MIN (ncalls, opts->max_training);
+  train = build_training_set (ncalls, ntrain, rng);
   if (debug) fprintf (stderr, "done\n");
 
   if (debug) fprintf (stderr, "Calculating mean...");
@@ -281,19 +707,20 @@ train_model (SNPCall *calls, unsigned int ncalls, unsigned int max_training, uns
 
   for (i = 0; i < 7; i++) deltas[i] = params[i] / 10;
 
+  /* Likelihood is evaluated once per unique count pair */
+  count_pairs_build (&pairs, calls, train, ntrain);
+  if (debug) fprintf (stderr, "Unique count pairs %u\n", pairs.n_pairs);
+  memset (&l3, 0, sizeof (l3));
   l3.params = params;
-  l3.n_calls = ntrain;
+  l3.n_calls = pairs.n_pairs;
   l3.pB = *pB;
-  l3.var1 = malloc (ntrain * sizeof (float));
-  l3.var2 = malloc (ntrain * sizeof (float));
-  for (i = 0; i < ntrain; i++) {
-    l3.var1[i] = calls[train[i]].counts[0];
-    l3.var2[i] = calls[train[i]].counts[1];
-  }
+  l3.var1 = pairs.var1;
+  l3.var2 = pairs.var2;
+  l3.mult = pairs.mult;
 
-  chunk_size = (ntrain + nthreads - 1) / nthreads;
+  chunk_size = (l3.n_calls + nthreads - 1) / nthreads;
   if (chunk_size < 2000) chunk_size = 2000;
-  nthreads = (ntrain + chunk_size - 1) / chunk_size;
+  nthreads = (l3.n_calls + chunk_size - 1) / chunk_size;
   l3.n_threads = nthreads;
   l3.pool = pool;
   for (i = 0; i < l3.n_threads; i++) {
@@ -306,16 +733,37 @@ train_model (SNPCall *calls, unsigned int ncalls, unsigned int max_training, uns
     l3.optims[i].sum = 0;
   }
 
-  downhill_simplex (7, params, deltas, 1e-6, nruns, 100, distanceL3, &l3);
+  if (opts->optimizer == OPTIMIZER_LBFGS) {
+    /* Deterministic, runs restart history from the previous result until it stops improving */
+    double values[7], last = 0;
+    lbfgs_from_params (values, params);
+    for (i = 0; i < opts->nruns; i++) {
+      dist = lbfgs_minimize (7, values, distanceL3_d, &l3, LBFGS_ITERATIONS, LBFGS_TOLERANCE, &l3.n_evals);
+      if (debug) fprintf (stderr, "Run %u distance %.6f evaluations %u\n", i, dist, l3.n_evals);
+      if (i && ((last - dist) <= LBFGS_TOLERANCE * fabs (dist))) break;
+      last = dist;
+    }
+    lbfgs_report_bounds (values);
+    lbfgs_to_params (params, values);
+  } else if (opts->nstarts > 1) {
+    train_starts (params, deltas, opts->nruns, opts->nstarts, opts->seed, &l3, nthreads);
+  } else {
+    downhill_simplex_random (7, params, deltas, 1e-6, opts->nruns, 100, distanceL3, &l3, sample_random, rng);
+  }
 
   if (debug) {
-    float dist = distanceL3 (7, params, &l3);
+    unsigned int n_evals = l3.n_evals;
+    float best = distanceL3 (7, params, &l3);
     print_params (params, "Best", stderr);
-    fprintf (stderr, "Best distance %.6f\n", dist);
+    fprintf (stderr, "Best distance %.6f\n", best);
+    /* Exported float parameters should give the same distance as L-BFGS */
+    if ((opts->optimizer == OPTIMIZER_LBFGS) && opts->nruns && (fabs (best - dist) > 1e-5 * fabs (dist))) {
+      fprintf (stderr, "Warning: exported parameters give distance %.6f, L-BFGS %.6f\n", best, dist);
+    }
+    fprintf (stderr, "Likelihood evaluations %u\n", n_evals);
   }
 
-  free (l3.var1);
-  free (l3.var2);
+  count_pairs_release (&pairs);
 
   /* Kui mitu sellist k-meeri-lugemit näeme siis, kui antud k-meeri tegelikult genoomis ei esinenud... */
   v[0] = logit_1_clamped (params[0], MIN_P, 0.1f);
@@ -339,134 +787,392 @@ struct _PData {
   double sum;
   unsigned int best;
 };
+
+/* Count pairs per batch of genotype probabilities */
+#define CALC_BLOCK 256
+
 typedef struct _POptim POptim;
 struct _POptim {
-  SNPCall *calls;
-  unsigned int first;
-  unsigned int ncalls;
+  /* Unique count pairs */
+  const unsigned int *var1;
+  const unsigned int *var2;
   float pB;
   float *params;
   PData *pdata;
 };
 
 static void
-calc_run (void *data)
+calc_range (void *data, unsigned long long start, unsigned long long end)
 {
-  unsigned int i;
   POptim *optim = (POptim *) data;
-  /* fprintf (stderr, "Run %u-%u\n", optim->first, optim->first + optim->ncalls); */
-  for (i = 0; i < optim->ncalls; i++) {
-    unsigned int var1, var2, j;
-    double best;
-    var1 = optim->calls[i].counts[0];
-    var2 = optim->calls[i].counts[1];
-    genotype_probabilities (optim->pdata[i].a, optim->pB, var1, var2, optim->params[L_VIGA], optim->params[P_0], optim->params[P_1], optim->params[P_2], optim->params[LAMBDA], optim->params[SIZE], optim->params[SIZE2]);
-    optim->pdata[i].sum = optim->pdata[i].a[0];
-    optim->pdata[i].best = 0;
-    best = optim->pdata[i].a[0];
-    for (j = 1; j < NUM_GENOTYPES; j++) {
-      optim->pdata[i].sum += optim->pdata[i].a[j];
-      if (optim->pdata[i].a[j] > best) {
-        optim->pdata[i].best = j;
-        best = optim->pdata[i].a[j];
+  float a[CALC_BLOCK * NUM_GENOTYPES], log_scale[CALC_BLOCK];
+  unsigned long long first;
+  /* fprintf (stderr, "Run %llu-%llu\n", start, end); */
+  for (first = start; first < end; first += CALC_BLOCK) {
+    unsigned int nb = (end - first < CALC_BLOCK) ? end - first : CALC_BLOCK;
+    unsigned int i, j;
+    genotype_probabilities_v (a, log_scale, nb, optim->pB, optim->var1 + first, optim->var2 + first, optim->params[L_VIGA], optim->params[P_0], optim->params[P_1], optim->params[P_2], optim->params[LAMBDA], optim->params[SIZE], optim->params[SIZE2]);
+    for (i = 0; i < nb; i++) {
+      PData *pd = &optim->pdata[first + i];
+      double scale = exp (log_scale[i]);
+      double best;
+      for (j = 0; j < NUM_GENOTYPES; j++) pd->a[j] = a[i * NUM_GENOTYPES + j] * scale;
+      pd->sum = pd->a[0];
+      pd->best = 0;
+      best = pd->a[0];
+      for (j = 1; j < NUM_GENOTYPES; j++) {
+        pd->sum += pd->a[j];
+        if (pd->a[j] > best) {
+          pd->best = j;
+          best = pd->a[j];
+        }
+      }
+    }
+  }
+}
+
+/* Output formatting */
+#define FORMAT_CHUNK_SIZE 4096
+/* Upper bound of single %.2f */
+#define FORMAT_FLOAT_SIZE 320
+
+typedef struct _PFormat PFormat;
+struct _PFormat {
+  const unsigned char **lines;
+  SNPCall *calls;
+  unsigned int ncalls;
+  PData *pdata;
+  unsigned int *map;
+  unsigned int nalleles;
+  float pc;
+  unsigned int alt;
+  /* VCF records instead of table, haploid genotypes */
+  unsigned int vcf;
+  unsigned int haploid;
+  /* Compress chunks to BGZF blocks */
+  unsigned int bgzf;
+};
+
+typedef struct _PChunk PChunk;
+struct _PChunk {
+  PFormat *fmt;
+  unsigned int first;
+  unsigned int n;
+  char *buf;
+  unsigned long long len;
+  unsigned long long size;
+  unsigned char *zbuf;
+  unsigned long long zlen;
+  unsigned long long zsize;
+};
+
+/* Output options */
+static unsigned int vcf = 0;
+static unsigned int bgzf = 0;
+
+static unsigned int
+format_uint (char *d, unsigned long long v)
+{
+  char t[24];
+  unsigned int n = 0, i;
+  do {
+    t[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  for (i = 0; i < n; i++) d[i] = t[n - 1 - i];
+  return n;
+}
+
+/* Same as %.2f, values near rounding ties and out of range are left to snprintf */
+static unsigned int
+format_fixed2 (char *d, double v)
+{
+  if ((v >= 0) && !signbit (v) && (v < 1e6)) {
+    double y = v * 100, f = floor (y), frac = y - f;
+    if (fabs (frac - 0.5) > 1e-7) {
+      unsigned int r = (unsigned int) f + (frac > 0.5), n;
+      n = format_uint (d, r / 100);
+      d[n++] = '.';
+      d[n++] = '0' + (r % 100) / 10;
+      d[n++] = '0' + r % 10;
+      return n;
+    }
+  }
+  return snprintf (d, FORMAT_FLOAT_SIZE, "%.2f", v);
+}
+
+/* Copy field up to separator or end and append tab */
+static char *
+copy_field (char *d, const unsigned char **p, const unsigned char *e, char sep)
+{
+  const unsigned char *q = *p;
+  while ((q < e) && (*q != sep)) q += 1;
+  memcpy (d, *p, q - *p);
+  d += q - *p;
+  *d++ = '\t';
+  *p = (q < e) ? q + 1 : q;
+  return d;
+}
+
+/* Same records as scripts/generate_vcf.pl, ID is CHR:POS:ID:REF/ALT */
+static char *
+format_vcf_call (char *d, const unsigned char *p, unsigned int len, unsigned int best_gt, unsigned int cancall, unsigned int haploid, const SNPCall *call)
+{
+  const unsigned char *e = p + len, *q;
+  unsigned int a0 = 0, a1 = 0, i;
+  for (i = 0; i < 3; i++) d = copy_field (d, &p, e, ':');
+  q = p;
+  while ((q < e) && (*q != ':')) q += 1;
+  d = copy_field (d, &p, q, '/');
+  d = copy_field (d, &p, q, '/');
+  if (cancall) {
+    if (haploid) {
+      if (best_gt == B) a0 = a1 = 1;
+    } else {
+      if (best_gt == AB) a1 = 1;
+      if (best_gt == BB) a0 = a1 = 1;
+    }
+  }
+  memcpy (d, "*\t*\t*\tGT:GQ\t", 12);
+  d += 12;
+  *d++ = '0' + a0;
+  *d++ = '/';
+  *d++ = '0' + a1;
+  *d++ = ':';
+  d += format_uint (d, (unsigned long long) call->counts[0] + call->counts[1]);
+  *d++ = '\t';
+  if (cancall) {
+    i = strlen (gt[best_gt]);
+    memcpy (d, gt[best_gt], i);
+    d += i;
+  } else {
+    memcpy (d, "NC", 2);
+    d += 2;
+  }
+  *d++ = '\n';
+  return d;
+}
+
+static void
+format_chunk (void *data)
+{
+  PChunk *chunk = (PChunk *) data;
+  PFormat *fmt = chunk->fmt;
+  unsigned int k;
+  chunk->len = 0;
+  for (k = chunk->first; k < chunk->first + chunk->n; k++) {
+    double *a;
+    double summa;
+    unsigned int best_gt, j, cancall;
+    const unsigned char *p;
+    SNPCall *call = fmt->calls + k;
+    PData *pd = fmt->pdata + fmt->map[k];
+    char *d;
+    a = pd->a;
+    summa = pd->sum;
+    best_gt = pd->best;
+
+    p = fmt->lines[call->line];
+    j = 0;
+    while (p[j] && (p[j] != '\t')) j += 1;
+    if (chunk->len + j + (NUM_GENOTYPES + 1) * (FORMAT_FLOAT_SIZE + 1) + 64 > chunk->size) {
+      chunk->size = (chunk->len + j + (NUM_GENOTYPES + 1) * (FORMAT_FLOAT_SIZE + 1) + 64) * 2;
+      chunk->buf = (char *) realloc (chunk->buf, chunk->size);
+    }
+    d = chunk->buf + chunk->len;
+    cancall = 0;
+    if (fmt->nalleles == 0) {
+      cancall = 1;
+    } else if (fmt->nalleles == 1) {
+      if ((best_gt == A) || (best_gt == B)) cancall = 1;
+    } else if (fmt->nalleles == 2) {
+      if ((best_gt == AA) || (best_gt == AB) || (best_gt == BB)) cancall = 1;
+    }
+    if (a[best_gt] < fmt->pc) cancall = 0;
+    if (!call->counts[0] && !call->counts[1]) cancall = 0;
+    if (fmt->vcf) {
+      d = format_vcf_call (d, p, j, best_gt, cancall, fmt->haploid, call);
+      chunk->len = d - chunk->buf;
+      continue;
+    }
+    memcpy (d, p, j);
+    d += j;
+    *d++ = '\t';
+    if (cancall) {
+      j = strlen (gt[best_gt]);
+      memcpy (d, gt[best_gt], j);
+      d += j;
+      *d++ = '\t';
+      d += format_fixed2 (d, a[best_gt] / summa);
+    } else {
+      memcpy (d, "NC\t", 3);
+      d += 3;
+    }
+    *d++ = '\t';
+    d += format_uint (d, call->counts[0]);
+    *d++ = '\t';
+    d += format_uint (d, call->counts[1]);
+    if (fmt->alt) {
+      for (j = 0; j < NUM_GENOTYPES; j++) {
+        *d++ = '\t';
+        d += format_fixed2 (d, a[j] / summa);
       }
     }
+    *d++ = '\n';
+    chunk->len = d - chunk->buf;
+  }
+  if (fmt->bgzf) {
+    if (gt4_bgzf_bound (chunk->len) > chunk->zsize) {
+      chunk->zsize = gt4_bgzf_bound (chunk->len);
+      chunk->zbuf = (unsigned char *) realloc (chunk->zbuf, chunk->zsize);
+    }
+    chunk->zlen = gt4_bgzf_compress (chunk->zbuf, chunk->buf, chunk->len, GT4_BGZF_DEFAULT_LEVEL);
   }
 }
 
+/* Format window of chunks while previous one is written */
 static void
-print_genotypes (const unsigned char *lines[], SNPCall *calls, unsigned int ncalls, float params[], float pB, unsigned int nalleles, float pc, unsigned int alt, unsigned int nthreads)
-{
-  POptim optim[32];
-  unsigned int chunk_size = 5000;
-  unsigned int pos = 0;
-  unsigned int iter = 0;
-  PData *pdata = (PData *) malloc (nthreads * chunk_size * sizeof (PData));
-
-  memset (optim, 0, sizeof (optim));
-
-  while (pos < ncalls) {
-    unsigned int cpos = pos;
-    unsigned int tidx, j, t;
-    if (debug > 1) fprintf (stderr, "Printing iteration %u\n", iter++);
-    for (tidx = 0; tidx < nthreads; tidx++) {
-      unsigned int cend;
-      if (cpos >= ncalls) break;
-      optim[tidx].calls = calls + cpos;
-      optim[tidx].first = cpos;
-      optim[tidx].pdata = pdata + tidx * chunk_size;
-      cend = cpos + chunk_size;
-      if (cend >= ncalls) cend = ncalls;
-      optim[tidx].ncalls = cend - cpos;
-      optim[tidx].pB = pB;
-      optim[tidx].params = params;
-      aosora_thread_pool_submit (pool, NULL, calc_run, NULL, NULL, &optim[tidx]);
-      cpos = cend;
-    }
-    aosora_thread_pool_run (pool);
-    for (t = 0; t < tidx; t++) {
-      unsigned int k;
-      for (k = 0; k < optim[t].ncalls; k++) {
-        double *a;
-        double summa;
-        unsigned int best_gt;
-        char c[64];
-        const unsigned char *p;
-        unsigned int cancall;
-        SNPCall *call = calls + optim[t].first + k;
-        a = optim[t].pdata[k].a;
-        summa = optim[t].pdata[k].sum;
-        best_gt = optim[t].pdata[k].best;
-
-        p = lines[call->line];
-        j = 0;
-        while (p[j] != '\t') j += 1;
-        memcpy (c, p, j);
-        c[j] = 0;
-        fprintf (stdout, "%s", c);
-        cancall = 0;
-        if (nalleles == 0) {
-          cancall = 1;
-        } else if (nalleles == 1) {
-          if ((best_gt == A) || (best_gt == B)) cancall = 1;
-        } else if (nalleles == 2) {
-          if ((best_gt == AA) || (best_gt == AB) || (best_gt == BB)) cancall = 1;
-        }
-        if (a[best_gt] < pc) cancall = 0;
-        if (!optim[t].calls[k].counts[0] && !optim[t].calls[k].counts[1]) cancall = 0;
-        if (cancall) {
-          fprintf (stdout, "\t%s\t%.2f", gt[best_gt], a[best_gt] / summa);
+write_genotypes (PFormat *fmt, FILE *ofs)
+{
+  unsigned int wsize, nwindows, w, i;
+  PChunk *chunks;
+  GT4PoolGroup group;
+
+  wsize = 4 * (gt4_pool_get_num_workers (pool) + 1);
+  nwindows = (fmt->ncalls + wsize * FORMAT_CHUNK_SIZE - 1) / (wsize * FORMAT_CHUNK_SIZE);
+  chunks = (PChunk *) malloc (2 * wsize * sizeof (PChunk));
+  memset (chunks, 0, 2 * wsize * sizeof (PChunk));
+  for (w = 0; w <= nwindows; w++) {
+    PChunk *next = chunks + (w % 2) * wsize;
+    PChunk *prev = chunks + ((w + 1) % 2) * wsize;
+    gt4_pool_group_init (&group);
+    for (i = 0; i < wsize; i++) {
+      unsigned long long first = ((unsigned long long) w * wsize + i) * FORMAT_CHUNK_SIZE;
+      next[i].fmt = fmt;
+      next[i].len = 0;
+      next[i].zlen = 0;
+      if ((w == nwindows) || (first >= fmt->ncalls)) continue;
+      next[i].first = first;
+      next[i].n = MIN (FORMAT_CHUNK_SIZE, fmt->ncalls - first);
+      gt4_pool_fork (pool, &group, format_chunk, &next[i]);
+    }
+    if (w > 0) {
+      for (i = 0; i < wsize; i++) {
+        if (fmt->bgzf) {
+          if (prev[i].zlen) fwrite (prev[i].zbuf, 1, prev[i].zlen, ofs);
         } else {
-          fprintf (stdout, "\tNC\t");
+          if (prev[i].len) fwrite (prev[i].buf, 1, prev[i].len, ofs);
         }
-        fprintf (stdout, "\t%u\t%u", call->counts[0], call->counts[1]);
-        if (alt) {
-          for (j = 0; j < NUM_GENOTYPES; j++) {
-            fprintf (stdout, "\t%.2f", a[j] / summa);
-          }
-        }
-        fprintf (stdout, "\n");
       }
     }
-    pos = cpos;
-    if (debug > 1) fprintf (stderr, "Writing, pos %u\n", pos);
+    gt4_pool_join (pool, &group);
+  }
+  for (i = 0; i < 2 * wsize; i++) {
+    free (chunks[i].buf);
+    free (chunks[i].zbuf);
   }
+  free (chunks);
+}
+
+static void
+print_genotypes (const unsigned char *lines[], SNPCall *calls, unsigned int ncalls, float params[], float pB, unsigned int nalleles, unsigned int haploid, float pc, unsigned int alt, FILE *ofs)
+{
+  POptim optim;
+  PFormat fmt;
+  CountPairs pairs;
+  PData *pdata;
+
+  /* Genotype probabilities are calculated once per unique count pair */
+  count_pairs_build (&pairs, calls, NULL, ncalls);
+  if (debug > 1) fprintf (stderr, "Calls %u unique count pairs %u\n", ncalls, pairs.n_pairs);
+  pdata = (PData *) malloc ((pairs.n_pairs + 1) * sizeof (PData));
+  optim.var1 = pairs.var1;
+  optim.var2 = pairs.var2;
+  optim.pdata = pdata;
+  optim.pB = pB;
+  optim.params = params;
+  gt4_pool_parallel_for (pool, pairs.n_pairs, 256, calc_range, &optim);
+
+  /* Chunks are formatted in parallel and written in order */
+  memset (&fmt, 0, sizeof (fmt));
+  fmt.lines = lines;
+  fmt.calls = calls;
+  fmt.ncalls = ncalls;
+  fmt.pdata = pdata;
+  fmt.map = pairs.map;
+  fmt.nalleles = nalleles;
+  fmt.haploid = haploid;
+  fmt.vcf = vcf;
+  fmt.bgzf = bgzf;
+  fmt.pc = pc;
+  fmt.alt = alt;
+  write_genotypes (&fmt, ofs);
+  count_pairs_release (&pairs);
   free (pdata);
 }
 
+/* Write directly or as BGZF blocks */
+static void
+write_output (const char *data, unsigned long long len, FILE *ofs)
+{
+  if (bgzf) {
+    unsigned char *zbuf = (unsigned char *) malloc (gt4_bgzf_bound (len));
+    unsigned long long zlen = gt4_bgzf_compress (zbuf, data, len, GT4_BGZF_DEFAULT_LEVEL);
+    fwrite (zbuf, 1, zlen, ofs);
+    free (zbuf);
+  } else {
+    fwrite (data, 1, len, ofs);
+  }
+}
+
+/* Same header as scripts/generate_vcf.pl */
+static void
+print_vcf_header (const char *source, FILE *ofs)
+{
+  time_t now = time (NULL);
+  /* Batch lanes write headers concurrently, localtime buffer is shared */
+  struct tm d;
+  unsigned int size = strlen (source) + 1024, len;
+  char *b = (char *) malloc (size);
+  localtime_r (&now, &d);
+  len = snprintf (b, size, "##fileformat=VCFv4.1\n"
+    "##fileDate=%4d%02d%02d\n"
+    "##source=%s\n"
+    "##reference=HumanNCBI37_UCSC\n"
+    "##phasing=none\n"
+    "##FILTER=<ID=q20,Description=\"Quality below 20\">\n"
+    "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n"
+    "##FORMAT=<ID=GQ,Number=1,Type=Integer,Description=\"Genotype Quality\">\n"
+    "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT\t****\n",
+    1900 + d.tm_year, 1 + d.tm_mon, d.tm_mday, source);
+  write_output (b, len, ofs);
+  free (b);
+}
+
 static void
 print_usage (FILE *ofs)
 {
   fprintf (ofs, "Usage:\n");
   fprintf (ofs, "  gmer_caller ARGUMENTS COUNTS_FILE\n");
+  fprintf (ofs, "  gmer_caller ARGUMENTS --manifest FILE\n");
+  fprintf (ofs, "    COUNTS_FILE is gmer_counter text or binary (--binary/--varint) output\n");
   fprintf (ofs, "Arguments:\n");
+  fprintf (ofs, "    --manifest FILE     - Call all samples listed in FILE (lines COUNTS_FILE [OUTPUT_FILE], default output COUNTS_FILE.gt/.vcf/.vcf.gz)\n");
+  fprintf (ofs, "    --batch_jobs NUM    - Process up to NUM manifest samples concurrently (default number of threads)\n");
   fprintf (ofs, "    --training_size NUM - Use NUM markers for training (default 100000)\n");
   fprintf (ofs, "    --runs NUMBER       - Perfom NUMBER runs of model training (use 0 for no training)\n");
+  fprintf (ofs, "    --starts NUMBER     - Run NUMBER independent model trainings concurrently and keep the best (default 1)\n");
+  fprintf (ofs, "    --seed NUMBER       - Random seed for training set and simplex restarts (default 1)\n");
+  fprintf (ofs, "    --optimizer NAME    - Model training method, simplex or lbfgs (default simplex)\n");
+  fprintf (ofs, "                          lbfgs needs fewer evaluations but may stop at a different optimum or\n");
+  fprintf (ofs, "                          at a parameter clamp (reported as warning), it ignores --starts\n");
   fprintf (ofs, "    --num_threads NUM   - Use NUM threads (min 1, max %u, default %u)\n", MAX_THREADS, MAX_THREADS / 2);
   fprintf (ofs, "    --header            - Print table header\n");
   fprintf (ofs, "    --non_canonical     - Output non-canonical genotypes\n");
   fprintf (ofs, "    --prob_cutoff       - probability cutoff for calling genotype (default 0)\n");
   fprintf (ofs, "    --alternatives      - Print probabilities of all alternative genotypes\n");
+  fprintf (ofs, "    --vcf               - Print genotypes in VCF format (same as scripts/generate_vcf.pl)\n");
+  fprintf (ofs, "    --bgzf              - Compress VCF output with BGZF (bgzip)\n");
   fprintf (ofs, "    --info              - Print information about individual\n");
   fprintf (ofs, "    --no_genotypes      - Print only summary information, not actual genotypes\n");
   fprintf (ofs, "    --model TYPE        - Model type (full, diploid, haploid)\n");
@@ -477,185 +1183,78 @@ print_usage (FILE *ofs)
 
 enum { MODEL_FULL, MODEL_DIPLOID, MODEL_HAPLOID };
 
-int
-main (int argc, const char *argv[])
-{
-  const char *call_fn = NULL;
-  unsigned int nruns = 5;
-  unsigned int max_training = 100000;
-  unsigned int nthreads = MAX_THREADS / 2;
-  unsigned int header = 0;
-  unsigned int non_canonical = 0;
-  float prob_cutoff = 0;
-  unsigned int alternatives = 0;
-  unsigned int info = 0;
-  unsigned int print_gt = 1;
-  unsigned int model = MODEL_FULL;
-  unsigned int params_specified = 0;
-  unsigned int coverage_specified = 0;
+/* Call genotypes of one counts file, return 0 on success */
 
+static int
+process_sample (const CallerOptions *opts, const char *call_fn, FILE *ofs)
+{
   unsigned int i;
   float pB;
-  int aidx;
   float params[7], x_params[7];
   const unsigned char *cdata;
   unsigned long long csize;
+  GT4Counts counts, *bin = NULL;
   unsigned int nlines;
   const unsigned char **lines;
   unsigned int na, nx, ny;
   unsigned int *a, *x, *y;
   unsigned int a_med, x_med, y_med;
   double p_XX, p_X, p_Y, p_1;
-  SNPCall *calls_a, *calls_x, *calls_y;
-
-  /* Initial parameters (diploid) */
-  params[L_VIGA] = 0.0547219f;
-  params[P_0] = 4.2603e-05f;
-  params[P_1] = 0.014934f;
-  params[P_2] = 0.985023f;
-  params[LAMBDA] = 0;
-  params[SIZE] = 65.48f;
-  params[SIZE2] = -0.6792684f;
+  SNPCall *calls_a, *calls_x = NULL, *calls_y = NULL;
+  unsigned char *classes;
+  ParsedCounts pc;
+  SampleRandom rng;
 
-  srand (1);
+  memcpy (params, opts->params, sizeof (params));
+  /* Every sample draws its training set and simplex restarts from its own sequence */
+  sample_random_init (&rng, opts->seed);
 
-  /* Initialize combination table for multithreaded use */
-  init_combination_tables ();
-
-  aidx = 1;
-  while (aidx < argc) {
-    if (!strcmp (argv[aidx], "-D")) {
-      debug += 1;
-    } else if (!strcmp (argv[aidx], "--runs")) {
-      aidx += 1;
-      if (aidx >= argc) {
-        print_usage (stderr);
-        exit (1);
-      }
-      nruns = strtol (argv[aidx], NULL, 10);
-    } else if (!strcmp (argv[aidx], "--training_size")) {
-      aidx += 1;
-      if (aidx >= argc) {
-        print_usage (stderr);
-        exit (1);
-      }
-      max_training = strtol (argv[aidx], NULL, 10);
-    } else if (!strcmp (argv[aidx], "--num_threads")) {
-      aidx += 1;
-      if (aidx >= argc) {
-        print_usage (stderr);
-        exit (1);
-      }
-      nthreads = strtol (argv[aidx], NULL, 10);
-    } else if (!strcmp (argv[aidx], "--header")) {
-      header = 1;
-    } else if (!strcmp (argv[aidx], "--non_canonical")) {
-      non_canonical = 1;
-    } else if (!strcmp (argv[aidx], "--prob_cutoff")) {
-      aidx += 1;
-      if (aidx >= argc) {
-        print_usage (stderr);
-        exit (1);
-      }
-      prob_cutoff = atof (argv[aidx]);
-    } else if (!strcmp (argv[aidx], "--model")) {
-      aidx += 1;
-      if (aidx >= argc) {
-        print_usage (stderr);
-        exit (1);
-      }
-      if (!strcmp (argv[aidx], "full")) {
-        model = MODEL_FULL;
-      } else if (!strcmp (argv[aidx], "diploid")) {
-        model = MODEL_DIPLOID;
-      } else if (!strcmp (argv[aidx], "haploid")) {
-        model = MODEL_HAPLOID;
-      } else {
-        print_usage (stderr);
-        exit (1);
-      }
-      prob_cutoff = atof (argv[aidx]);
-    } else if (!strcmp (argv[aidx], "--params")) {
-      aidx += 1;
-      if ((aidx + 6) >= argc) {
-        print_usage (stderr);
-        exit (1);
-      }
-      for (i = 0; i < 7; i++) {
-        params[i] = atof (argv[aidx + i]);
-      }
-      params_specified = 1;
-      aidx += 6;
-    } else if (!strcmp (argv[aidx], "--coverage")) {
-      aidx += 1;
-      if (aidx >= argc) {
-        print_usage (stderr);
-        exit (1);
-      }
-      params[LAMBDA] = atof (argv[aidx]);
-      coverage_specified = 1;
-    } else if (!strcmp (argv[aidx], "--alternatives")) {
-      alternatives = 1;
-    } else if (!strcmp (argv[aidx], "--info")) {
-      info = 1;
-    } else if (!strcmp (argv[aidx], "--no_genotypes")) {
-      print_gt = 0;
-    } else {
-      if (call_fn) {
-        print_usage (stderr);
-        exit (1);
-      }
-      call_fn = argv[aidx];
-    }
-    aidx += 1;
-  }
-
-  if (!call_fn) {
-    fprintf (stderr, "No input file specified\n");
-    print_usage (stderr);
-  }
-  if ((nthreads < 1) || (nthreads > MAX_THREADS)) {
-    fprintf (stderr, "Invalid number of threads %u - should be 1-%u\n", nthreads, MAX_THREADS);
-    print_usage (stderr);
-  }
-
-  /* If no user-specified params and haploid model change default probabilities */
-  if ((model == MODEL_HAPLOID) && !params_specified) {
-    params[P_1] = 0.985023f;
-    params[P_2] = 0.014934f;
-  }
-
-  pool = aosora_thread_pool_new (nthreads);
-
-  /* Read calls */
-  if (debug) fprintf (stderr, "Reading %s...", call_fn);
-  cdata = (const unsigned char *) gt4_mmap (call_fn, &csize);
-  if (!cdata) {
-    fprintf (stderr, "Cannot read %s\n", call_fn);
-    exit (1);
-  }
-  nlines = count_lines (cdata, csize);
-  if (nlines < 1) {
-    fprintf (stderr, "File contains no lines\n");
-    exit (1);
-  }
-  if (debug) fprintf (stderr, "done (%u lines)\n", nlines);
-  if (debug) fprintf (stderr, "Building line table...");
-  lines = (const unsigned char **) malloc ((nlines + 1) * sizeof (unsigned char *));
-  nlines = parse_lines (lines, cdata, csize);
-  lines[nlines] = cdata + csize;
-  if (debug) fprintf (stderr, "done\n");
+  /* Read calls */
+  if (debug) fprintf (stderr, "Reading %s...", call_fn);
+  cdata = (const unsigned char *) gt4_mmap (call_fn, &csize);
+  if (!cdata) {
+    fprintf (stderr, "Cannot read %s\n", call_fn);
+    return 1;
+  }
+  if (gt4_counts_is_binary (cdata, csize)) {
+    /* Binary counts, lines are node names */
+    if (gt4_counts_init_from_data (&counts, cdata, csize)) {
+      fprintf (stderr, "Invalid binary counts file %s\n", call_fn);
+      gt4_munmap (cdata, csize);
+      return 1;
+    }
+    bin = &counts;
+    if (counts.n_nodes < 1) {
+      fprintf (stderr, "File contains no nodes\n");
+      gt4_munmap (cdata, csize);
+      return 1;
+    }
+    nlines = index_binary_counts (bin, &lines, &classes, &pc);
+    if (debug) fprintf (stderr, "done (%u binary nodes)\n", nlines);
+  } else {
+    /* Lines are indexed and counts parsed in parallel */
+    nlines = index_text_counts (cdata, csize, &lines, &classes, &pc);
+    if (nlines < 1) {
+      fprintf (stderr, "File contains no lines\n");
+      free (lines);
+      free (classes);
+      parsed_counts_release (&pc);
+      gt4_munmap (cdata, csize);
+      return 1;
+    }
+    if (debug) fprintf (stderr, "done (%u lines)\n", nlines);
+  }
 
   /* Count chromosomes */
   /* Full counts are only needed for FULL model, otherwise treat all as autosomes */
   if (debug) fprintf (stderr, "Counting chromosomes...");
   na = nx = ny = 0;
   for (i = 0; i < nlines; i++) {
-    if ((model != MODEL_FULL) || ((lines[i][0] > '0') && (lines[i][0] <= '9'))) {
+    if ((opts->model != MODEL_FULL) || (classes[i] == LINE_AUTOSOME)) {
       na += 1;
-    } else if (lines[i][0] == 'X') {
+    } else if (classes[i] == LINE_X) {
       nx += 1;
-    } else if (lines[i][0] == 'Y') {
+    } else if (classes[i] == LINE_Y) {
       ny += 1;
     }
   }
@@ -664,24 +1263,35 @@ main (int argc, const char *argv[])
   y = (unsigned int *) malloc (ny * sizeof (unsigned int));
   na = nx = ny = 0;
   for (i = 0; i < nlines; i++) {
-    if ((model != MODEL_FULL) || ((lines[i][0] > '0') && (lines[i][0] <= '9'))) {
+    if ((opts->model != MODEL_FULL) || (classes[i] == LINE_AUTOSOME)) {
       a[na++] = i;
-    } else if (lines[i][0] == 'X') {
+    } else if (classes[i] == LINE_X) {
       x[nx++] = i;
-    } else if (lines[i][0] == 'Y') {
+    } else if (classes[i] == LINE_Y) {
       y[ny++] = i;
     }
   }
+  free (classes);
   if (debug) fprintf (stderr, "done\n");
   if (debug) fprintf (stderr, "Autosomes %u X %u Y %u\n", na, nx, ny);
+  if (!na && !nx && !ny) {
+    fprintf (stderr, "File contains no calls\n");
+    free (a);
+    free (x);
+    free (y);
+    free (lines);
+    parsed_counts_release (&pc);
+    gt4_munmap (cdata, csize);
+    return 1;
+  }
 
   /* Pair medians */
   a_med = x_med = y_med = 0;
   if (debug) fprintf (stderr, "Calculating medians...");
-  a_med = get_pair_median (cdata, csize, lines, a, na);
-  if (model == MODEL_FULL) {
-    x_med = get_pair_median (cdata, csize, lines, x, nx);
-    y_med = get_pair_median (cdata, csize, lines, y, ny);
+  a_med = get_pair_median (&pc, a, na);
+  if (opts->model == MODEL_FULL) {
+    x_med = get_pair_median (&pc, x, nx);
+    y_med = get_pair_median (&pc, y, ny);
   }
   if (debug) fprintf (stderr, "done\n");
   if (debug) fprintf (stderr, "Autosomes/unspecified %u X %u Y %u\n", a_med, x_med, y_med);
@@ -689,7 +1299,7 @@ main (int argc, const char *argv[])
   /* Determine sex */
   /* Only for full model */
   p_XX = p_X = p_Y = p_1 = 0;
-  if (model == MODEL_FULL) {
+  if (opts->model == MODEL_FULL) {
     p_XX = poisson (x_med, a_med);
     p_X = poisson (x_med, a_med / 2);
     p_Y = poisson (y_med, a_med / 2);
@@ -715,19 +1325,19 @@ main (int argc, const char *argv[])
 
   /* Parse autosome/unspecified calls calls */
   if (debug) fprintf (stderr, "Reading autosome/unspecified calls...");
-  calls_a = parse_calls (lines, a, na, a_med);
+  calls_a = parse_calls (&pc, a, &na, a_med);
   if (debug) fprintf (stderr, "done\n");
 
   /* Train autosome model */
   /* Only if na > 0 && nruns > 0 */
-  if (nruns && (na > 0)) {
+  if (opts->nruns && (na > 0)) {
     if (debug) fprintf (stderr, "Training autosome/unspecified model\n");
-    if ((model == MODEL_FULL) || (model == MODEL_DIPLOID)) {
+    if ((opts->model == MODEL_FULL) || (opts->model == MODEL_DIPLOID)) {
       /* Train full model */
-      train_model (calls_a, na, max_training, nruns, params, &pB, 1, nthreads);
-    } else if (model == MODEL_HAPLOID) {
+      train_model (calls_a, na, opts, &rng, params, &pB, 1);
+    } else if (opts->model == MODEL_HAPLOID) {
       /* Haploid model */
-      train_model (calls_a, na, max_training, nruns, params, &pB, 2, nthreads);
+      train_model (calls_a, na, opts, &rng, params, &pB, 2);
     }
   } else {
     /* Estimate MAF */
@@ -735,72 +1345,449 @@ main (int argc, const char *argv[])
   }
 
 
-  if (info) {
-    if (model == MODEL_FULL) fprintf (stdout, "#Sex\t%s\n", (p_XX > p_X) ? "F" : "M");
-    fprintf (stdout, "#EstimatedCoverage\t%g\n", params[LAMBDA]);
-    fprintf (stdout, "#AverageMAF\t%g\n", pB);
-    fprintf (stdout, "#AutosomeModel\t%g %g %g %g %g %g %g\n", params[L_VIGA], params[P_0], params[P_1], params[P_2], params[LAMBDA], params[SIZE], params[SIZE2]);
+  /* Table metadata is not valid in VCF */
+  if (opts->info && !vcf) {
+    if (opts->model == MODEL_FULL) fprintf (ofs, "#Sex\t%s\n", (p_XX > p_X) ? "F" : "M");
+    fprintf (ofs, "#EstimatedCoverage\t%g\n", params[LAMBDA]);
+    fprintf (ofs, "#AverageMAF\t%g\n", pB);
+    fprintf (ofs, "#AutosomeModel\t%g %g %g %g %g %g %g\n", params[L_VIGA], params[P_0], params[P_1], params[P_2], params[LAMBDA], params[SIZE], params[SIZE2]);
   }
 
   /* Default X model is diploid */
   memcpy (x_params, params, sizeof (params));
   /* If model is FULL, parse X calls */
-  if (model == MODEL_FULL) {
+  if (opts->model == MODEL_FULL) {
     if (debug) fprintf (stderr, "Reading X calls...");
-    calls_x = parse_calls (lines, x, nx, x_med);
+    calls_x = parse_calls (&pc, x, &nx, x_med);
     if (debug) fprintf (stderr, "done\n");
     /* Train separate haploid model */
-    if ((nx > 0) && nruns && (p_XX <= p_X)) {
+    if ((nx > 0) && opts->nruns && (p_XX <= p_X)) {
       /* Male */
       x_params[P_1] = 0.98f;
       x_params[P_2] = 0.01f;
       if (debug) fprintf (stderr, "Training X model\n");
-      train_model (calls_x, nx, max_training, nruns, x_params, &pB, 2, nthreads);
-      if (info) {
-        fprintf (stdout, "#XModel\t%g %g %g %g %g %g %g\n", x_params[L_VIGA], x_params[P_0], x_params[P_1], x_params[P_2], x_params[LAMBDA], x_params[SIZE], x_params[SIZE2]);
+      train_model (calls_x, nx, opts, &rng, x_params, &pB, 2);
+      if (opts->info && !vcf) {
+        fprintf (ofs, "#XModel\t%g %g %g %g %g %g %g\n", x_params[L_VIGA], x_params[P_0], x_params[P_1], x_params[P_2], x_params[LAMBDA], x_params[SIZE], x_params[SIZE2]);
       }
     }
   }
 
   /* Print genotypes */
-  if (print_gt) {
-    if (header) {
-      fprintf (stdout, "#ID\tGT\tPROB\tA_KMERS\tB_KMERS");
-      if (header) {
+  if (opts->print_gt) {
+    if (vcf) {
+      print_vcf_header (call_fn, ofs);
+    } else if (opts->header) {
+      fprintf (ofs, "#ID\tGT\tPROB\tA_KMERS\tB_KMERS");
+      if (opts->header) {
         unsigned int j;
         for (j = 0; j < NUM_GENOTYPES; j++) {
-          fprintf (stdout, "\t%s", gt[j]);
+          fprintf (ofs, "\t%s", gt[j]);
         }
       }
-      fprintf (stdout, "\n");
+      fprintf (ofs, "\n");
     }
-    if (model != MODEL_HAPLOID) {
-      print_genotypes (lines, calls_a, na, params, pB, (non_canonical) ? 0 : 2, prob_cutoff, alternatives, nthreads);
+    if (opts->model != MODEL_HAPLOID) {
+      print_genotypes (lines, calls_a, na, params, pB, (opts->non_canonical) ? 0 : 2, 0, opts->prob_cutoff, opts->alternatives, ofs);
     } else {
-      print_genotypes (lines, calls_a, na, params, pB, (non_canonical) ? 0 : 1, prob_cutoff, alternatives, nthreads);
+      print_genotypes (lines, calls_a, na, params, pB, (opts->non_canonical) ? 0 : 1, 1, opts->prob_cutoff, opts->alternatives, ofs);
     }
-    if (model == MODEL_FULL) {
+    if (opts->model == MODEL_FULL) {
       if (p_XX > p_X) {
         /* Female */
-        print_genotypes (lines, calls_x, nx, params, pB, (non_canonical) ? 0 : 2, prob_cutoff, alternatives, nthreads);
+        print_genotypes (lines, calls_x, nx, params, pB, (opts->non_canonical) ? 0 : 2, 0, opts->prob_cutoff, opts->alternatives, ofs);
       } else {
         /* Male */
-        print_genotypes (lines, calls_x, nx, x_params, pB, (non_canonical) ? 0 : 1, prob_cutoff, alternatives, nthreads);
+        print_genotypes (lines, calls_x, nx, x_params, pB, (opts->non_canonical) ? 0 : 1, 1, opts->prob_cutoff, opts->alternatives, ofs);
         if (debug) fprintf (stderr, "Reading Y calls...");
-        calls_y = parse_calls (lines, y, ny, y_med);
+        calls_y = parse_calls (&pc, y, &ny, y_med);
         if (debug) fprintf (stderr, "done\n");
-        print_genotypes (lines, calls_y, ny, x_params, pB, (non_canonical) ? 0 : 1, prob_cutoff, alternatives, nthreads);
+        print_genotypes (lines, calls_y, ny, x_params, pB, (opts->non_canonical) ? 0 : 1, 1, opts->prob_cutoff, opts->alternatives, ofs);
       }
     }
   }
 
-  aosora_thread_pool_delete (pool);
+  if (bgzf) gt4_bgzf_write_eof (ofs);
+
+  free (calls_a);
+  free (calls_x);
+  free (calls_y);
+  free (a);
+  free (x);
+  free (y);
+  free (lines);
+  parsed_counts_release (&pc);
+  gt4_munmap (cdata, csize);
+
+  return 0;
+}
+
 
+/* Samples of batch run, lanes take the next unprocessed sample */
+typedef struct _Batch Batch;
+
+struct _Batch {
+  const CallerOptions *opts;
+  unsigned int n_samples;
+  char **inputs;
+  char **outputs;
+  int *results;
+  unsigned int next;
+};
+
+/*
+ * Manifest lines are COUNTS_FILE [OUTPUT_FILE], empty lines and lines starting with # are skipped
+ * Default output is COUNTS_FILE with .gt, .vcf or .vcf.gz appended
+ */
+
+static int
+read_manifest (Batch *batch, const char *filename)
+{
+  FILE *ifs;
+  char line[4096];
+  unsigned int size = 0;
+
+  ifs = fopen (filename, "r");
+  if (!ifs) {
+    fprintf (stderr, "Cannot open manifest %s\n", filename);
+    return 1;
+  }
+  while (fgets (line, sizeof (line), ifs)) {
+    char *input, *output, *save;
+    input = strtok_r (line, " \t\r\n", &save);
+    if (!input || (input[0] == '#')) continue;
+    output = strtok_r (NULL, " \t\r\n", &save);
+    if (batch->n_samples >= size) {
+      size = (size) ? size * 2 : 64;
+      batch->inputs = (char **) realloc (batch->inputs, size * sizeof (char *));
+      batch->outputs = (char **) realloc (batch->outputs, size * sizeof (char *));
+    }
+    batch->inputs[batch->n_samples] = strdup (input);
+    if (output) {
+      batch->outputs[batch->n_samples] = strdup (output);
+    } else {
+      const char *ext = (vcf) ? ((bgzf) ? ".vcf.gz" : ".vcf") : ".gt";
+      batch->outputs[batch->n_samples] = (char *) malloc (strlen (input) + strlen (ext) + 1);
+      strcpy (batch->outputs[batch->n_samples], input);
+      strcat (batch->outputs[batch->n_samples], ext);
+    }
+    batch->n_samples += 1;
+  }
+  fclose (ifs);
+  if (!batch->n_samples) {
+    fprintf (stderr, "Manifest %s contains no samples\n", filename);
+    return 1;
+  }
   return 0;
 }
 
+/* Run stages of samples one by one, their parallel work goes to shared pool */
+static void *
+batch_lane (void *data)
+{
+  Batch *batch = (Batch *) data;
+  unsigned int idx;
+  while ((idx = __sync_fetch_and_add (&batch->next, 1)) < batch->n_samples) {
+    /* Written to temporary file, output appears only if the whole sample succeeds */
+    char *tmp_fn = (char *) malloc (strlen (batch->outputs[idx]) + 5);
+    FILE *ofs;
+    sprintf (tmp_fn, "%s.tmp", batch->outputs[idx]);
+    ofs = fopen (tmp_fn, "w");
+    if (!ofs) {
+      fprintf (stderr, "Cannot open %s\n", tmp_fn);
+      batch->results[idx] = 1;
+      free (tmp_fn);
+      continue;
+    }
+    if (debug) fprintf (stderr, "Sample %u: %s -> %s\n", idx, batch->inputs[idx], batch->outputs[idx]);
+    batch->results[idx] = process_sample (batch->opts, batch->inputs[idx], ofs);
+    if (fclose (ofs)) {
+      fprintf (stderr, "Cannot write %s\n", tmp_fn);
+      batch->results[idx] = 1;
+    }
+    if (!batch->results[idx] && rename (tmp_fn, batch->outputs[idx])) {
+      fprintf (stderr, "Cannot rename %s to %s\n", tmp_fn, batch->outputs[idx]);
+      batch->results[idx] = 1;
+    }
+    if (batch->results[idx]) {
+      unlink (tmp_fn);
+      fprintf (stderr, "Sample %s failed\n", batch->inputs[idx]);
+    }
+    free (tmp_fn);
+  }
+  return NULL;
+}
+
+/*
+ * Call all samples of manifest, up to njobs at time
+ * Lanes are separate threads that join pool tasks like the main thread, so one sample can read
+ * its counts or write genotypes while others are trained, tables and pool are shared
+ */
+
+static int
+run_batch (const CallerOptions *opts, const char *manifest_fn, unsigned int njobs)
+{
+  Batch batch;
+  pthread_t *lanes;
+  unsigned int i;
+  int result;
+
+  memset (&batch, 0, sizeof (batch));
+  batch.opts = opts;
+  if (read_manifest (&batch, manifest_fn)) return 1;
+  batch.results = (int *) malloc (batch.n_samples * sizeof (int));
+  if (njobs > batch.n_samples) njobs = batch.n_samples;
+  if (debug) fprintf (stderr, "Batch of %u samples, %u concurrently\n", batch.n_samples, njobs);
+
+  lanes = (pthread_t *) malloc (njobs * sizeof (pthread_t));
+  for (i = 1; i < njobs; i++) pthread_create (&lanes[i], NULL, batch_lane, &batch);
+  batch_lane (&batch);
+  for (i = 1; i < njobs; i++) pthread_join (lanes[i], NULL);
+
+  result = 0;
+  for (i = 0; i < batch.n_samples; i++) {
+    if (batch.results[i]) result = 1;
+    free (batch.inputs[i]);
+    free (batch.outputs[i]);
+  }
+  free (batch.inputs);
+  free (batch.outputs);
+  free (batch.results);
+  free (lanes);
+  return result;
+}
+
+int
+main (int argc, const char *argv[])
+{
+  const char *call_fn = NULL;
+  const char *manifest_fn = NULL;
+  unsigned int njobs = 0;
+  unsigned int nruns = 5;
+  unsigned int nstarts = 1;
+  unsigned int seed = 1;
+  unsigned int optimizer = OPTIMIZER_SIMPLEX;
+  unsigned int max_training = 100000;
+  unsigned int nthreads = MAX_THREADS / 2;
+  unsigned int header = 0;
+  unsigned int non_canonical = 0;
+  float prob_cutoff = 0;
+  unsigned int alternatives = 0;
+  unsigned int info = 0;
+  unsigned int print_gt = 1;
+  unsigned int model = MODEL_FULL;
+  unsigned int params_specified = 0;
+  unsigned int coverage_specified = 0;
+
+  unsigned int i;
+  int aidx, result;
+  float params[7];
+  CallerOptions opts;
+
+  /* Initial parameters (diploid) */
+  params[L_VIGA] = 0.0547219f;
+  params[P_0] = 4.2603e-05f;
+  params[P_1] = 0.014934f;
+  params[P_2] = 0.985023f;
+  params[LAMBDA] = 0;
+  params[SIZE] = 65.48f;
+  params[SIZE2] = -0.6792684f;
+
+  /* Initialize combination table for multithreaded use */
+  init_combination_tables ();
+
+  aidx = 1;
+  while (aidx < argc) {
+    if (!strcmp (argv[aidx], "-D")) {
+      debug += 1;
+    } else if (!strcmp (argv[aidx], "--runs")) {
+      aidx += 1;
+      if (aidx >= argc) {
+        print_usage (stderr);
+        exit (1);
+      }
+      nruns = strtol (argv[aidx], NULL, 10);
+    } else if (!strcmp (argv[aidx], "--starts")) {
+      aidx += 1;
+      if (aidx >= argc) {
+        print_usage (stderr);
+        exit (1);
+      }
+      nstarts = strtol (argv[aidx], NULL, 10);
+    } else if (!strcmp (argv[aidx], "--seed")) {
+      aidx += 1;
+      if (aidx >= argc) {
+        print_usage (stderr);
+        exit (1);
+      }
+      seed = strtol (argv[aidx], NULL, 10);
+    } else if (!strcmp (argv[aidx], "--optimizer")) {
+      aidx += 1;
+      if (aidx >= argc) {
+        print_usage (stderr);
+        exit (1);
+      }
+      if (!strcmp (argv[aidx], "simplex")) {
+        optimizer = OPTIMIZER_SIMPLEX;
+      } else if (!strcmp (argv[aidx], "lbfgs")) {
+        optimizer = OPTIMIZER_LBFGS;
+      } else {
+        print_usage (stderr);
+        exit (1);
+      }
+    } else if (!strcmp (argv[aidx], "--manifest")) {
+      aidx += 1;
+      if (aidx >= argc) {
+        print_usage (stderr);
+        exit (1);
+      }
+      manifest_fn = argv[aidx];
+    } else if (!strcmp (argv[aidx], "--batch_jobs")) {
+      aidx += 1;
+      if (aidx >= argc) {
+        print_usage (stderr);
+        exit (1);
+      }
+      njobs = strtol (argv[aidx], NULL, 10);
+    } else if (!strcmp (argv[aidx], "--training_size")) {
+      aidx += 1;
+      if (aidx >= argc) {
+        print_usage (stderr);
+        exit (1);
+      }
+      max_training = strtol (argv[aidx], NULL, 10);
+    } else if (!strcmp (argv[aidx], "--num_threads")) {
+      aidx += 1;
+      if (aidx >= argc) {
+        print_usage (stderr);
+        exit (1);
+      }
+      nthreads = strtol (argv[aidx], NULL, 10);
+    } else if (!strcmp (argv[aidx], "--header")) {
+      header = 1;
+    } else if (!strcmp (argv[aidx], "--non_canonical")) {
+      non_canonical = 1;
+    } else if (!strcmp (argv[aidx], "--vcf")) {
+      vcf = 1;
+    } else if (!strcmp (argv[aidx], "--bgzf")) {
+      bgzf = 1;
+    } else if (!strcmp (argv[aidx], "--prob_cutoff")) {
+      aidx += 1;
+      if (aidx >= argc) {
+        print_usage (stderr);
+        exit (1);
+      }
+      prob_cutoff = atof (argv[aidx]);
+    } else if (!strcmp (argv[aidx], "--model")) {
+      aidx += 1;
+      if (aidx >= argc) {
+        print_usage (stderr);
+        exit (1);
+      }
+      if (!strcmp (argv[aidx], "full")) {
+        model = MODEL_FULL;
+      } else if (!strcmp (argv[aidx], "diploid")) {
+        model = MODEL_DIPLOID;
+      } else if (!strcmp (argv[aidx], "haploid")) {
+        model = MODEL_HAPLOID;
+      } else {
+        print_usage (stderr);
+        exit (1);
+      }
+      prob_cutoff = atof (argv[aidx]);
+    } else if (!strcmp (argv[aidx], "--params")) {
+      aidx += 1;
+      if ((aidx + 6) >= argc) {
+        print_usage (stderr);
+        exit (1);
+      }
+      for (i = 0; i < 7; i++) {
+        params[i] = atof (argv[aidx + i]);
+      }
+      params_specified = 1;
+      aidx += 6;
+    } else if (!strcmp (argv[aidx], "--coverage")) {
+      aidx += 1;
+      if (aidx >= argc) {
+        print_usage (stderr);
+        exit (1);
+      }
+      params[LAMBDA] = atof (argv[aidx]);
+      coverage_specified = 1;
+    } else if (!strcmp (argv[aidx], "--alternatives")) {
+      alternatives = 1;
+    } else if (!strcmp (argv[aidx], "--info")) {
+      info = 1;
+    } else if (!strcmp (argv[aidx], "--no_genotypes")) {
+      print_gt = 0;
+    } else {
+      if (call_fn) {
+        print_usage (stderr);
+        exit (1);
+      }
+      call_fn = argv[aidx];
+    }
+    aidx += 1;
+  }
+
+  if (!call_fn && !manifest_fn) {
+    fprintf (stderr, "No input file specified\n");
+    print_usage (stderr);
+    exit (1);
+  }
+  if (call_fn && manifest_fn) {
+    fprintf (stderr, "COUNTS_FILE and --manifest cannot be used together\n");
+    exit (1);
+  }
+  if ((nthreads < 1) || (nthreads > MAX_THREADS)) {
+    fprintf (stderr, "Invalid number of threads %u - should be 1-%u\n", nthreads, MAX_THREADS);
+    print_usage (stderr);
+  }
+  if (bgzf && !vcf) {
+    fprintf (stderr, "--bgzf can only be used with --vcf\n");
+    exit (1);
+  }
+
+  /* If no user-specified params and haploid model change default probabilities */
+  if ((model == MODEL_HAPLOID) && !params_specified) {
+    params[P_1] = 0.985023f;
+    params[P_2] = 0.014934f;
+  }
+
+  opts.nruns = nruns;
+  opts.nstarts = nstarts;
+  opts.seed = seed;
+  opts.optimizer = optimizer;
+  opts.max_training = max_training;
+  opts.nthreads = nthreads;
+  opts.header = header;
+  opts.non_canonical = non_canonical;
+  opts.prob_cutoff = prob_cutoff;
+  opts.alternatives = alternatives;
+  opts.info = info;
+  opts.print_gt = print_gt;
+  opts.model = model;
+  memcpy (opts.params, params, sizeof (params));
+
+  /* Main thread runs tasks while joining */
+  pool = gt4_pool_new (nthreads - 1);
+
+  if (manifest_fn) {
+    result = run_batch (&opts, manifest_fn, (njobs) ? njobs : nthreads);
+  } else {
+    result = process_sample (&opts, call_fn, stdout);
+  }
+  gt4_pool_delete (pool);
+
+  return result;
+}
+
+
+
+/* Training likelihood stays in double precision, float32 errors shared by all calls with the same count make it too rough for simplex */
+
 static double
-mlogL3 (float l_viga, float p_0, float p_1, float p_2, float lambda, float size, float size2, unsigned int n_calls, float pB, const unsigned int var1[], const unsigned int var2[])
+mlogL3 (float l_viga, float p_0, float p_1, float p_2, float lambda, float size, float size2, unsigned int n_calls, float pB, const unsigned int var1[], const unsigned int var2[], const unsigned int mult[])
 {
   unsigned int i;
   double sum;
@@ -822,7 +1809,7 @@ mlogL3 (float l_viga, float p_0, float p_1, float p_2, float lambda, float size,
     /* abi[abi<1e-30]=1e-30 */
     if (abi < 1e-30) abi = 1e-30;
     /* l = sum(log(abi))+3000000 */
-    sum += log (abi);
+    sum += mult[i] * log (abi);
   }
 
   return -sum;
@@ -841,7 +1828,46 @@ optim_run (void *data)
   size = optim->l3->params[5];
   size2 = -expf (optim->l3->params[6]);
   if (debug > 2) fprintf (stderr, "Optimization: %u-%u\n", optim->first_call, optim->first_call + optim->n_calls);
-  optim->sum = mlogL3 (l_viga, p_0, p_1, p_2, lambda, size, size2, optim->n_calls, optim->l3->pB, optim->l3->var1 + optim->first_call, optim->l3->var2 + optim->first_call);
+  optim->sum = mlogL3 (l_viga, p_0, p_1, p_2, lambda, size, size2, optim->n_calls, optim->l3->pB, optim->l3->var1 + optim->first_call, optim->l3->var2 + optim->first_call, optim->l3->mult + optim->first_call);
+}
+
+/* Negative log likelihood and its gradient by actual parameters */
+
+static double
+mlogL3_d (double grad[], const double values[], unsigned int n_calls, float pB, const unsigned int var1[], const unsigned int var2[], const unsigned int mult[])
+{
+  unsigned int i, j;
+  double sum;
+  sum = 0;
+  for (j = 0; j < 7; j++) grad[j] = 0;
+  for (i = 0; i < n_calls; i++) {
+    double g[GENOTYPE_NUM_PARAMS];
+    sum += mult[i] * genotype_log_likelihood_d (g, pB, var1[i], var2[i], values[0], values[1], values[2], values[3], values[4], values[5], values[6]);
+    for (j = 0; j < 7; j++) grad[j] -= mult[i] * g[j];
+  }
+  return -sum;
+}
+
+static void
+optim_grad_run (void *data)
+{
+  L3Optim *optim = (L3Optim *) data;
+  if (debug > 2) fprintf (stderr, "Gradient: %u-%u\n", optim->first_call, optim->first_call + optim->n_calls);
+  optim->sum = mlogL3_d (optim->grad, optim->l3->values, optim->n_calls, optim->l3->pB, optim->l3->var1 + optim->first_call, optim->l3->var2 + optim->first_call, optim->l3->mult + optim->first_call);
+}
+
+static void
+optim_range (void *data, unsigned long long start, unsigned long long end)
+{
+  L3Data *l3 = (L3Data *) data;
+  unsigned long long i;
+  for (i = start; i < end; i++) {
+    if (l3->gradient) {
+      optim_grad_run (&l3->optims[i]);
+    } else {
+      optim_run (&l3->optims[i]);
+    }
+  }
 }
 
 static float
@@ -871,11 +1897,18 @@ distanceL3 (int ndim, const float params[], void *data)
   size = l3->params[5];
   size2 = -expf (l3->params[6]);
 
-  for (i = 0; i < l3->n_threads; i++) {
-    l3->optims[i].sum = 0;
-    aosora_thread_pool_submit (l3->pool, NULL, optim_run, NULL, NULL, &l3->optims[i]);
+  if (l3->has_best && !memcmp (l3->params, l3->best_params, sizeof (l3->best_params))) {
+    return l3->best_result;
+  }
+
+  for (i = 0; i < l3->n_threads; i++) l3->optims[i].sum = 0;
+  l3->gradient = 0;
+  l3->n_evals += 1;
+  if (l3->pool) {
+    gt4_pool_parallel_for (l3->pool, l3->n_threads, 1, optim_range, l3);
+  } else {
+    optim_range (l3, 0, l3->n_threads);
   }
-  aosora_thread_pool_run (l3->pool);
   result = 0;
   for (i = 0; i < l3->n_threads; i++) {
     result += l3->optims[i].sum;
@@ -896,11 +1929,195 @@ distanceL3 (int ndim, const float params[], void *data)
   }
 
   if (debug > 1) fprintf (stderr, "Iteration %d delta %.6f\n", iter++, result);
+  if (!l3->has_best || ((float) result < l3->best_result)) {
+    memcpy (l3->best_params, l3->params, sizeof (l3->best_params));
+    l3->best_result = (float) result;
+    l3->has_best = 1;
+  }
   return (float) result;
 }
 
+/*
+ * L-BFGS parameters
+ * l_viga, lambda and size2 are transformed as in simplex, size by logit of its fraction of LBFGS_MAX_SIZE
+ * p_1 and p_2 are logits of their fractions of the remaining probability so that p_0 + p_1 + p_2 <= 1,
+ * otherwise the penalty wall of distanceL3 stops line searches at the optimum (p_lisa close to 0)
+ */
+
+static double
+lbfgs_logit (double p, double min, double max)
+{
+  double f = (p - min) / (max - min);
+  if (f < 1e-9) f = 1e-9;
+  if (f > 1 - 1e-9) f = 1 - 1e-9;
+  return log (f / (1 - f));
+}
+
+/* Actual parameters with derivatives (p_1 by p_0 in dp1, p_2 by p_0 and p_1 in dp2) */
+
+static void
+lbfgs_actual_params (double v[], double dv[], double *dp1, double *dp2, const double u[])
+{
+  double s;
+  s = 1 / (1 + exp (-u[0]));
+  v[0] = MIN_P + (0.1f - MIN_P) * s;
+  dv[0] = (0.1f - MIN_P) * s * (1 - s);
+  s = 1 / (1 + exp (-u[1]));
+  v[1] = MIN_P + (1 - 2 * MIN_P) * s;
+  dv[1] = (1 - 2 * MIN_P) * s * (1 - s);
+  s = 1 / (1 + exp (-u[2]));
+  v[2] = MIN_P + (1 - v[1] - MIN_P) * s;
+  dv[2] = (1 - v[1] - MIN_P) * s * (1 - s);
+  *dp1 = -s;
+  s = 1 / (1 + exp (-u[3]));
+  v[3] = MIN_P + (1 - v[1] - v[2] - MIN_P) * s;
+  dv[3] = (1 - v[1] - v[2] - MIN_P) * s * (1 - s);
+  *dp2 = -s;
+  v[4] = exp (u[4]);
+  dv[4] = v[4];
+  s = 1 / (1 + exp (-u[5]));
+  v[5] = LBFGS_MAX_SIZE * s;
+  dv[5] = v[5] * (1 - s);
+  v[6] = -exp (u[6]);
+  dv[6] = v[6];
+}
+
+static void
+lbfgs_from_params (double u[], const float params[])
+{
+  double p_0, p_1, p_2;
+  p_0 = logit_1_clamped (params[1], MIN_P, 1 - MIN_P);
+  p_1 = logit_1_clamped (params[2], MIN_P, 1 - MIN_P);
+  p_2 = logit_1_clamped (params[3], MIN_P, 1 - MIN_P);
+  u[0] = params[0];
+  u[1] = params[1];
+  u[2] = lbfgs_logit (p_1, MIN_P, 1 - p_0);
+  u[3] = lbfgs_logit (p_2, MIN_P, 1 - p_0 - p_1);
+  u[4] = params[4];
+  u[5] = lbfgs_logit ((params[5] > 1e-3f) ? params[5] : 1e-3f, 0, LBFGS_MAX_SIZE);
+  u[6] = params[6];
+}
+
+static void
+lbfgs_to_params (float params[], const double u[])
+{
+  double v[7], dv[7], dp1, dp2;
+  unsigned int i;
+  lbfgs_actual_params (v, dv, &dp1, &dp2, u);
+  params[0] = (float) u[0];
+  params[1] = (float) u[1];
+  params[2] = (float) lbfgs_logit (v[2], MIN_P, 1 - MIN_P);
+  params[3] = (float) lbfgs_logit (v[3], MIN_P, 1 - MIN_P);
+  /*
+   * Float rounding (or p_0 close to 1, where the MIN_P floors do not fit) may push p_0 + p_1 + p_2 over 1
+   * and into the penalty of distanceL3, shrink p_2 (or p_1, p_0 if at floor) until the sum fits
+   */
+  for (i = 0; i < 100; i++) {
+    float p[3], excess, a;
+    unsigned int k;
+    for (k = 0; k < 3; k++) p[k] = logit_1_clamped (params[1 + k], MIN_P, 1 - MIN_P);
+    excess = p[0] + p[1] + p[2] - 1;
+    if (excess <= 0) break;
+    k = (p[2] - 2 * excess > MIN_P) ? 2 : (p[1] - 2 * excess > MIN_P) ? 1 : 0;
+    a = logit_clamped (p[k] - 2 * excess, MIN_P, 1 - MIN_P);
+    params[1 + k] = (a < params[1 + k]) ? a : nextafterf (params[1 + k], -INFINITY);
+  }
+  params[4] = (float) u[4];
+  params[5] = (float) v[5];
+  params[6] = (float) u[6];
+}
+
+/*
+ * Warn if L-BFGS ends on the l_viga or size clamp
+ * Simplex is not drawn there as easily, so its results may differ
+ */
+
+static void
+lbfgs_report_bounds (const double u[])
+{
+  double v[7], dv[7], dp1, dp2;
+  lbfgs_actual_params (v, dv, &dp1, &dp2, u);
+  if (v[0] >= 0.1f - 1e-4 * (0.1f - MIN_P)) {
+    fprintf (stderr, "Warning: L-BFGS l_viga %g is at its upper clamp %g\n", v[0], 0.1f);
+  } else if (v[0] <= MIN_P + 1e-4 * (0.1f - MIN_P)) {
+    fprintf (stderr, "Warning: L-BFGS l_viga %g is at its lower clamp %g\n", v[0], MIN_P);
+  }
+  if (v[5] >= (1 - 1e-4) * LBFGS_MAX_SIZE) {
+    fprintf (stderr, "Warning: L-BFGS size %g is at its clamp %g (Poisson limit)\n", v[5], LBFGS_MAX_SIZE);
+  }
+}
+
+/* Same objective as distanceL3 in double precision, gradient by L-BFGS parameters */
+
 static double
-logL2 (const float arg[], unsigned int count, unsigned int tulem2[], unsigned int katvus2[])
+distanceL3_d (int ndim, const double params[], double grad[], void *data)
+{
+  static int iter = 1;
+  L3Data *l3;
+  unsigned int i, j;
+  double dv[7], g[7], dp1, dp2;
+  double l_viga, p_0, p_1, p_2, lambda, size, size2;
+  double delta0, delta1;
+  double result;
+
+  l3 = (L3Data *) data;
+
+  lbfgs_actual_params (l3->values, dv, &dp1, &dp2, params);
+  l_viga = l3->values[0];
+  p_0 = l3->values[1];
+  p_1 = l3->values[2];
+  p_2 = l3->values[3];
+  lambda = l3->values[4];
+  size = l3->values[5];
+  size2 = l3->values[6];
+
+  for (i = 0; i < l3->n_threads; i++) l3->optims[i].sum = 0;
+  l3->gradient = 1;
+  l3->n_evals += 1;
+  if (l3->pool) {
+    gt4_pool_parallel_for (l3->pool, l3->n_threads, 1, optim_range, l3);
+  } else {
+    optim_range (l3, 0, l3->n_threads);
+  }
+  result = 0;
+  for (j = 0; j < 7; j++) g[j] = 0;
+  for (i = 0; i < l3->n_threads; i++) {
+    result += l3->optims[i].sum;
+    for (j = 0; j < 7; j++) g[j] += l3->optims[i].grad[j];
+  }
+
+  /* Penalties of distanceL3, but size ones grow with violation (there they decrease, gradient steps would follow) */
+  if (p_0 + p_1 + p_2 > 1) {
+    result = result + 10000 - 100000 * (1 - p_0 - p_1 - p_2);
+    g[1] += 100000;
+    g[2] += 100000;
+    g[3] += 100000;
+  }
+  delta0 = size + size2 * lambda / 2;
+  if (delta0 < 0) {
+    result = result + 10000 - 100 * delta0;
+    g[4] -= 100 * size2 / 2;
+    g[5] -= 100;
+    g[6] -= 100 * lambda / 2;
+  }
+  delta1 = size + size2 * l_viga;
+  if (delta1 < 0) {
+    result = result + 10000 - 100 * delta1;
+    g[0] -= 100 * size2;
+    g[5] -= 100;
+    g[6] -= 100 * l_viga;
+  }
+
+  /* p_1 and p_2 depend on preceding probabilities */
+  g[2] += dp2 * g[3];
+  g[1] += dp2 * g[3] + dp1 * g[2];
+  for (j = 0; j < 7; j++) grad[j] = g[j] * dv[j];
+  if (debug > 1) fprintf (stderr, "Gradient iteration %d delta %.6f\n", iter++, result);
+  return result;
+}
+
+static double
+logL2 (const float arg[], unsigned int count, unsigned int tulem2[], unsigned int katvus2[], const unsigned int mult[])
 {
   /* AAA, BBB */
   double p1 = arg[0];
@@ -941,70 +2158,35 @@ logL2 (const float arg[], unsigned int count, unsigned int tulem2[], unsigned in
 
     if (v <= 0) {
       /* fprintf (stdout, "Negative %u %u %g p1 = %g p2 = %g x = %g z = %g dbinom = %g\n", tulem2[i], katvus2[i], v, p1, p2, x, z, dbinom (tulem2[i], katvus2[i], 0.9)); */
-      logL += 1000000;
+      logL += 1000000.0 * mult[i];
     } else {
-      logL -= log (v);
+      logL -= mult[i] * log (v);
     }
   }
   return logL;
 }
 
 static unsigned int
-get_pair_median (const unsigned char *cdata, unsigned long long csize, const unsigned char *lines[], unsigned int autos[], unsigned int nautos)
+get_pair_median (const ParsedCounts *pc, const unsigned int indices[], unsigned int nindices)
 {
-  unsigned int pair_median, ntokenz, i;
-  const unsigned char *tokenz[16];
-  unsigned int lengths[16];
-  unsigned int max, min, med;
-  unsigned int *medians_6 = (unsigned int *) malloc (nautos * sizeof (unsigned int));
-  for (i = 0; i < nautos; i++) {
+  unsigned int pair_median, n, i;
+  unsigned int *medians_6 = (unsigned int *) malloc ((nindices + 1) * sizeof (unsigned int));
+  n = 0;
+  for (i = 0; i < nindices; i++) {
+    const int *values = pc->values + pc->first[indices[i]];
     unsigned int npairs, sum, j;
-    ntokenz = split_line (lines[autos[i]], lines[autos[i] + 1] - lines[autos[i]], tokenz, lengths, 8);
-    if (ntokenz < 4) continue;
-    npairs = (ntokenz - 2) / 2;
+    npairs = (pc->first[indices[i] + 1] - pc->first[indices[i]]) / 2;
+    if (!npairs) continue;
     sum = 0;
     for (j = 0; j < npairs; j ++) {
-      sum += strtol ((const char *) tokenz[2 + 2 * j], NULL, 10);
-      sum += strtol ((const char *) tokenz[2 + 2 * j + 1], NULL, 10);
+      sum += values[2 * j];
+      sum += values[2 * j + 1];
     }
     sum = sum * 6 / npairs;
-    medians_6[i] = sum;
-  }
-  max = 0;
-  min = 0xffffffff;
-  for (i = 0; i < nautos; i++) {
-    if (medians_6[i] > max) max = medians_6[i];
-    if (medians_6[i] < min) min = medians_6[i];
-  }
-  med = (min + max) / 2;
-  while (max > min) {
-    unsigned int above = 0, below = 0, equal;
-    for (i = 0; i < nautos; i++) {
-      if (medians_6[i] > med) above += 1;
-      if (medians_6[i] < med) below += 1;
-    }
-    equal = nautos - above - below;
-    if (debug > 1) fprintf (stderr, "Trying median %u (%u) - equal %u, below %u, above %u\n", med / 6, med, equal, below, above);
-    /* Special case: min == med, max == med + 1 */
-    if (max == (min + 1)) {
-      if (above > (below + equal)) {
-        /* Max is true median */
-        med = max;
-      }
-      break;
-    }
-    if (above > below) {
-      if ((above - below) < equal) break;
-      min = med;
-    } else if (below > above) {
-      if ((below - above) < equal) break;
-      max = med;
-    } else {
-      break;
-    }
-    med = (min + max) / 2;
+    medians_6[n++] = sum;
   }
-  pair_median = med / 6;
+  pair_median = gt4_median_bisect (medians_6, n) / 6;
+  if (debug > 1) fprintf (stderr, "Pair median %u of %u lines\n", pair_median, n);
   free (medians_6);
 
   return pair_median;
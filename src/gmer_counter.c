@@ -14,6 +14,8 @@
 #include "queue.h"
 #include "wordmap.h"
 #include "database.h"
+#include "counts.h"
+#include "median.h"
 
 #define MAX_LINES 10000000000
 #define MAX_FILESIZE 10000000000
@@ -42,6 +44,44 @@ struct _TaskTable {
 TaskTable *task_table_new (unsigned int index);
 void task_table_free (TaskTable *tt);
 
+/* Streaming read index */
+
+typedef struct _IndexEntry IndexEntry;
+struct _IndexEntry {
+  unsigned int kmer;
+  Read read;
+};
+
+typedef struct _IndexBuilder IndexBuilder;
+struct _IndexBuilder {
+  /* Per-thread entry buffers */
+  unsigned int nthreads;
+  unsigned long long *buf_size;
+  IndexEntry **bufs;
+  unsigned long long *buf_len;
+  /* Sorted run files */
+  pthread_mutex_t mutex;
+  unsigned int nruns;
+  FILE **runs;
+  unsigned long long *run_len;
+  /* Number of reads per kmer */
+  unsigned int *counts;
+  /* Largest subsequence + 1 (0 - no reads) */
+  unsigned int *max_subseq;
+  unsigned int max_kmer_pos;
+  GT4SequenceFile **seq_files;
+};
+
+/* Entries per run in merge buffers */
+#define INDEX_RUN_BUFFER 65536
+#define DEFAULT_INDEX_MEMORY 1024
+
+static IndexBuilder *index_builder_new (unsigned int nthreads, unsigned long long memory, unsigned long long n_kmers, unsigned int nfiles, GT4SequenceFile **seq_files);
+static void index_builder_flush (IndexBuilder *ib, unsigned int thread);
+static void index_builder_finish (IndexBuilder *ib, GT4Index *index, unsigned long long n_kmers, unsigned int nfiles);
+static unsigned long long index_builder_write_reads (GT4Index *index, FILE *ofs, void *data);
+static unsigned int find_subsequence (GT4SequenceFile *seqfile, unsigned long long name_pos);
+
 typedef struct _SNPQueue SNPQueue;
 struct _SNPQueue {
   Queue queue;
@@ -54,8 +94,8 @@ struct _SNPQueue {
   TaskTable *full_tables;
   /* Data */
   KMerDB *db;
-  /* Read lists */
-  ReadList **reads;
+  /* Read index */
+  IndexBuilder *ib;
 };
 
 /* Main thread loop */
@@ -74,6 +114,9 @@ print_usage (FILE *ofs) {
   fprintf (ofs, "    -db DATABASE     - SNP/KMER database file\n");
   fprintf (ofs, "    -dbb DBBINARY    - binary database file\n");
   fprintf (ofs, "    -w FILENAME      - write binary database to file\n");
+  fprintf (ofs, "    --publish NAME   - publish database in shared memory segment (stays after exit)\n");
+  fprintf (ofs, "    --attach NAME    - use database from shared memory segment\n");
+  fprintf (ofs, "    --unpublish NAME - remove shared memory segment\n");
   fprintf (ofs, "    -32              - use 32-bit integeres for counts (default 16-bit)\n");
   fprintf (ofs, "    --max_kmers NUM  - maximum number of kmers per node\n");
   fprintf (ofs, "    --silent         - do not output kmer counts (useful if only compiling db or index is needed\n");
@@ -81,7 +124,11 @@ print_usage (FILE *ofs) {
   fprintf (ofs, "    --total          - print the total number of kmers per node\n");
   fprintf (ofs, "    --unique         - print the number of nonzero kmers per node\n");
   fprintf (ofs, "    --kmers          - print individual kmer counts (default if no other output)\n");
+  fprintf (ofs, "    --binary         - write kmer counts in binary format (no header or metadata)\n");
+  fprintf (ofs, "    --varint         - write kmer counts in binary format with varint compression\n");
   fprintf (ofs, "    --compile_index FILENAME - Add read index to database and write it to file\n");
+  fprintf (ofs, "    --index_memory MB - memory for read index entries before spilling to temporary files (default %u)\n", DEFAULT_INDEX_MEMORY);
+  fprintf (ofs, "    --hash_index     - look up kmers with minimal perfect hash (also added to written database)\n");
   fprintf (ofs, "    --distribution NUM  - print kmer distribution (up to given number)\n");
   fprintf (ofs, "    --num_threads    - number of worker threads (default %u)\n", DEFAULT_NUM_THREADS);
   fprintf (ofs, "    --prefetch       - prefetch memory mapped files (faster on high-memory systems)\n");
@@ -94,10 +141,14 @@ main (int argc, const char *argv[])
   const char *db_name = NULL;
   const char *dbb = NULL;
   const char *wdb = NULL;
+  const char *publish = NULL, *attach = NULL, *unpublish = NULL;
   const char *index = NULL;
+  unsigned long long index_memory = DEFAULT_INDEX_MEMORY;
   unsigned int max_kmers_per_node = 1000000000;
   unsigned int silent = 0, header = 0, total = 0, unique = 0, kmers = 0, distro = 0, big = 0, dm = 0;
   unsigned int lowmem = 1;
+  unsigned int hash_index = 0;
+  unsigned int binary = 0, varint = 0;
   unsigned int nseqs = 0;
   const char *seqnames[1024];
   GT4SequenceFile *seq_files[1024];
@@ -134,6 +185,27 @@ main (int argc, const char *argv[])
         exit (1);
       }
       wdb = argv[i];
+    } else if (!strcmp (argv[i], "--publish")) {
+      i += 1;
+      if (i >= argc) {
+        print_usage (stderr);
+        exit (1);
+      }
+      publish = argv[i];
+    } else if (!strcmp (argv[i], "--attach")) {
+      i += 1;
+      if (i >= argc) {
+        print_usage (stderr);
+        exit (1);
+      }
+      attach = argv[i];
+    } else if (!strcmp (argv[i], "--unpublish")) {
+      i += 1;
+      if (i >= argc) {
+        print_usage (stderr);
+        exit (1);
+      }
+      unpublish = argv[i];
     } else if (!strcmp (argv[i], "--max_kmers")) {
       i += 1;
       if (i >= argc) {
@@ -151,6 +223,11 @@ main (int argc, const char *argv[])
       unique = 1;
     } else if (!strcmp (argv[i], "--kmers")) {
       kmers = 1;
+    } else if (!strcmp (argv[i], "--binary")) {
+      binary = 1;
+    } else if (!strcmp (argv[i], "--varint")) {
+      binary = 1;
+      varint = 1;
     } else if (!strcmp (argv[i], "-32")) {
       big = 1;
     } else if (!strcmp (argv[i], "--double_median")) {
@@ -163,6 +240,13 @@ main (int argc, const char *argv[])
         exit (1);
       }
       index = argv[i];
+    } else if (!strcmp (argv[i], "--index_memory")) {
+      i += 1;
+      if (i >= argc) {
+        print_usage (stderr);
+        exit (1);
+      }
+      index_memory = strtoll (argv[i], NULL, 10);
     } else if (!strcmp (argv[i], "--distribution")) {
       i += 1;
       if (i >= argc) {
@@ -177,6 +261,8 @@ main (int argc, const char *argv[])
         exit (1);
       }
       nthreads = strtol (argv[i], NULL, 10);
+    } else if (!strcmp (argv[i], "--hash_index")) {
+      hash_index = 1;
     } else if (!strcmp (argv[i], "--prefetch")) {
       lowmem = 0;
     } else if (!strcmp (argv[i], "--count_trie_allocations")) {
@@ -193,7 +279,14 @@ main (int argc, const char *argv[])
     }
   }
 
-  if (!nseqs && !wdb) {
+  if (unpublish) {
+    if (gt4_db_unlink_shm (unpublish)) {
+      fprintf (stderr, "Cannot remove shared memory segment %s\n", unpublish);
+      exit (1);
+    }
+    if (!nseqs && !wdb && !publish) exit (0);
+  }
+  if (!nseqs && !wdb && !publish) {
     fprintf (stderr, "Nothing to do!\n");
     print_usage (stderr);
     exit (1);
@@ -208,9 +301,24 @@ main (int argc, const char *argv[])
     print_usage (stderr);
     exit (1);
   }
+  if (attach && (db_name || dbb || wdb || publish)) {
+    fprintf (stderr, "Shared database cannot be combined with other databases\n");
+    print_usage (stderr);
+    exit (1);
+  }
   if (!total && !unique && !distro) {
     kmers = 1;
   }
+  if (binary && (total || unique || distro)) {
+    fprintf (stderr, "Binary output contains only kmer counts\n");
+    print_usage (stderr);
+    exit (1);
+  }
+  if (binary && (dm || header)) {
+    fprintf (stderr, "Binary output has no header or pair median\n");
+    print_usage (stderr);
+    exit (1);
+  }
   if (distro > 65536) {
     distro = 65536;
   }
@@ -227,7 +335,7 @@ main (int argc, const char *argv[])
       exit (1);
     }
     if (!lowmem) scout_mmap (cdata, csize);
-    if (!read_db_from_text (&db, cdata, csize, max_kmers_per_node, (big) ? 32 : 16)) {
+    if (!read_db_from_text_parallel (&db, cdata, csize, max_kmers_per_node, (big) ? 32 : 16, nthreads)) {
       fprintf (stderr, "Cannot read text database %s\n", dbb);
       exit (1);
     }
@@ -252,9 +360,29 @@ main (int argc, const char *argv[])
     if (debug) fprintf (stderr, "Finished loading binary database (index = %u)\n", db.index.read_blocks != NULL);
   }
 
+  if (attach) {
+    /* Attach to shared database */
+    if (debug) fprintf (stderr, "Attaching shared database %s\n", attach);
+    if (!gt4_db_attach_shm (&db, attach)) {
+      fprintf (stderr, "Cannot attach shared database %s\n", attach);
+      exit (1);
+    }
+  }
+
+  if (hash_index && !db.hash.n_keys) {
+    if (debug) fprintf (stderr, "Building hash index\n");
+    if (gt4_db_build_hash (&db)) {
+      fprintf (stderr, "Cannot build hash index\n");
+      exit (1);
+    }
+  }
+
   if (gt4_trie_debug & GT4_TRIE_COUNT_ALLOCATIONS) {
     fprintf (stderr, "Trie: %u allocations, total memory %llu MiB\n", db.trie.num_allocations, db.trie.total_memory / (1024 * 1024));
   }
+  if ((wdb || publish) && !trie_compact (&db.trie)) {
+    fprintf (stderr, "Cannot compact trie\n");
+  }
   if (wdb) {
     /* Write binary database */
     FILE *ofs;
@@ -272,8 +400,19 @@ main (int argc, const char *argv[])
       fprintf (stderr, "Done\n");
     }
   }
+  if (publish) {
+    /* Publish database in shared memory */
+    if (debug) fprintf (stderr, "Publishing database as %s\n", publish);
+    if (gt4_db_publish_shm (&db, publish)) {
+      fprintf (stderr, "Cannot publish database as %s\n", publish);
+      exit (1);
+    }
+  }
 
   if (nseqs > 0) {
+    /* Written index database, mapped while reads are printed */
+    const unsigned char *idata = NULL;
+    unsigned long long isize = 0;
     memset (&snpq, 0, sizeof (SNPQueue));
     queue_init (&snpq.queue, nthreads);
     /* Read files */
@@ -298,8 +437,7 @@ main (int argc, const char *argv[])
       snpq.free_tables = tt;
     }
     if (index) {
-      snpq.reads = (ReadList **) malloc (db.n_kmers * sizeof (ReadList *));
-      memset (snpq.reads, 0, db.n_kmers * sizeof (ReadList *));
+      snpq.ib = index_builder_new (nthreads, index_memory * 1024 * 1024, db.n_kmers, nseqs, seq_files);
     }
     queue_create_threads (&snpq.queue, process, &snpq);
     process (&snpq.queue, 0, &snpq);
@@ -314,8 +452,11 @@ main (int argc, const char *argv[])
       fprintf (stderr, "Finished reading files\n");
     }
 
-    if (db_name) fprintf (stdout, "#TextDatabase\t%s\n", db_name);
-    if (dbb) fprintf (stdout, "#BinaryDatabase\t%s\n", dbb);
+    if (!binary) {
+      if (db_name) fprintf (stdout, "#TextDatabase\t%s\n", db_name);
+      if (dbb) fprintf (stdout, "#BinaryDatabase\t%s\n", dbb);
+      if (attach) fprintf (stdout, "#SharedDatabase\t%s\n", attach);
+    }
         
     if (dm) {
       unsigned int med = get_pair_median (&db);
@@ -333,10 +474,6 @@ main (int argc, const char *argv[])
   
     if (index) {
       /* Build read index */
-      unsigned long long max_name_pos = 0;
-      unsigned int max_file_idx = 0, max_kmer_pos = 0;
-      unsigned long long read_start = 0;
-      
       gt4_db_clear_index (&db);
 
       /* Files */
@@ -345,76 +482,15 @@ main (int argc, const char *argv[])
       for (i = 0; i < nseqs; i++) {
         db.index.files[i] = (char *) seqnames[i];
       }
-      max_file_idx = nseqs - 1;
+      /* Reads are merged from sorted runs while writing */
+      index_builder_finish (snpq.ib, &db.index, db.n_kmers, nseqs);
+      if (debug) fprintf (stderr, "NBits file %u npos %u kmer %u reads %llu\n", db.index.nbits_file, db.index.nbits_npos, db.index.nbits_kmer, db.index.n_reads);
 
-      if (debug) fprintf (stderr, "Calculate bitsizes\n");
-      for (i = 0; i < db.n_nodes; i++) {
-        unsigned int j;
-        for (j = 0; j < db.nodes[i].nkmers; j++) {
-          unsigned int kmer_idx;
-          ReadList *rl;
-          kmer_idx = db.nodes[i].kmers + j;
-          for (rl = snpq.reads[kmer_idx]; rl; rl = rl->next) {
-            unsigned long long name_pos = seq_files[rl->read.file_idx]->subseqs[rl->read.subseq].name_pos;
-            if (name_pos > max_name_pos) max_name_pos = name_pos;
-            if (rl->read.kmer_pos > max_kmer_pos) max_kmer_pos = rl->read.kmer_pos;
-          }
-        }
-      }
-      
-      if (debug) fprintf (stderr, "Num files %u Max name pos %llu Max sequence pos %u\n", nseqs, max_name_pos, max_kmer_pos);
-      db.index.nbits_file = 1;
-      while (max_file_idx > 1) {
-        db.index.nbits_file += 1;
-        max_file_idx /= 2;
-      }
-      db.index.nbits_npos = 1;
-      while (max_name_pos > 1) {
-        db.index.nbits_npos += 1;
-        max_name_pos /= 2;
-      }
-      db.index.nbits_kmer = 1;
-      while (max_kmer_pos > 1) {
-        db.index.nbits_kmer += 1;
-        max_kmer_pos /= 2;
-      }
-      if (debug) fprintf (stderr, "NBits file %u npos %u kmer %u\n", db.index.nbits_file, db.index.nbits_npos, db.index.nbits_kmer);
-      db.index.n_kmers = db.n_kmers;
-      db.index.read_blocks = (unsigned long long *) malloc (db.n_kmers * sizeof (unsigned long long));
-      if (debug) fprintf (stderr, "Calculate number of reads\n");
-      for (i = 0; i < db.n_kmers; i++) {
-        ReadList *rl;
-        for (rl = snpq.reads[i]; rl; rl = rl->next) db.index.n_reads += 1;
-      }
-      db.index.reads = (unsigned long long *) malloc (db.index.n_reads * sizeof (unsigned long long));
-      if (debug) fprintf (stderr, "Writing reads\n");
-      for (i = 0; i < db.n_kmers; i++) {
-        unsigned int read_idx = 0;
-        ReadList *rl;
-        for (rl = snpq.reads[i]; rl; rl = rl->next) {
-          unsigned long long name_pos = seq_files[rl->read.file_idx]->subseqs[rl->read.subseq].name_pos;
-          unsigned long long code = ((unsigned long long) rl->read.dir << (db.index.nbits_file + db.index.nbits_npos + db.index.nbits_kmer)) |
-            ((unsigned long long) rl->read.file_idx << (db.index.nbits_npos + db.index.nbits_kmer)) |
-            (name_pos << db.index.nbits_kmer) |
-            rl->read.kmer_pos;
-          db.index.reads[read_start + read_idx] = code;
-#if 0
-          unsigned long long _name_pos = (code >> db.index.nbits_kmer) & ((1ULL << db.index.nbits_npos) - 1);
-          unsigned long long _file_idx = (code >> (db.index.nbits_npos + db.index.nbits_kmer)) & ((1ULL << db.index.nbits_file) - 1);
-          unsigned long long _dir = (code >> (db.index.nbits_npos + db.index.nbits_kmer + db.index.nbits_file)) & 1;
-          unsigned long long _kmer_pos = code & ((1ULL << db.index.nbits_kmer) - 1);
-          assert (_name_pos == name_pos);
-          assert (_file_idx == rl->read.file_idx);
-          assert (_dir == rl->read.dir);
-          assert (_kmer_pos == rl->read.kmer_pos);
-#endif
-          read_idx += 1;
-        }
-        db.index.read_blocks[i] = (unsigned long long) read_start << 24 | read_idx;
-        read_start += read_idx;
-      }
       /* Write database with index */
       FILE *ofs;
+      if (!trie_compact (&db.trie)) {
+        fprintf (stderr, "Cannot compact trie\n");
+      }
       if (debug) {
         fprintf (stderr, "Writing index database to %s\n", index);
       }
@@ -428,9 +504,38 @@ main (int argc, const char *argv[])
       if (debug) {
         fprintf (stderr, "Done\n");
       }
+      if (!silent && !binary) {
+        /* Use reads from written file */
+        KMerDB idb;
+        memset (&idb, 0, sizeof (idb));
+        idata = gt4_mmap (index, &isize);
+        if (!idata || !read_database_from_binary (&idb, idata, isize)) {
+          fprintf (stderr, "Cannot read index database %s\n", index);
+          exit (1);
+        }
+        db.index.reads = idb.index.reads;
+      }
     }
 
-    if (!silent) {
+    if (!silent && binary) {
+      /* Binary kmer counts */
+      const char **names = (const char **) malloc (db.n_nodes * sizeof (const char *));
+      unsigned long long *first = (unsigned long long *) malloc (db.n_nodes * 8);
+      unsigned int *nkmers = (unsigned int *) malloc (db.n_nodes * 4);
+      for (i = 0; i < db.n_nodes; i++) {
+        names[i] = db.names + db.nodes[i].name;
+        first[i] = db.nodes[i].kmers;
+        nkmers[i] = db.nodes[i].nkmers;
+      }
+      if (!gt4_counts_write (stdout, db.n_nodes, names, first, nkmers, (db.count_bits == 16) ? (const void *) db.kmers_16 : (const void *) db.kmers_32,
+        db.count_bits, (varint) ? GT4_COUNTS_VARINT : 0)) {
+        fprintf (stderr, "Cannot write binary counts\n");
+        exit (1);
+      }
+      free (names);
+      free (first);
+      free (nkmers);
+    } else if (!silent) {
       for (i = 0; i < db.n_nodes; i++) {
         unsigned int j;
         fprintf (stdout, "%s\t%u", db.names + db.nodes[i].name, db.nodes[i].nkmers);
@@ -494,17 +599,19 @@ main (int argc, const char *argv[])
         }
         if (index) {
           for (j = 0; j < db.nodes[i].nkmers; j++) {
-            unsigned int kmer_idx;
-            ReadList *rl;
-            kmer_idx = db.nodes[i].kmers + j;
-            for (rl = snpq.reads[kmer_idx]; rl; rl = rl->next) {
-              fprintf (stdout, " (%u/%u/%u)", rl->read.file_idx, rl->read.subseq, rl->read.kmer_pos);
+            unsigned long long start, name_pos, r;
+            unsigned int nreads, file_idx, dir, kmer_pos;
+            start = gt4_index_get_kmer_info (&db.index, db.nodes[i].kmers + j, &nreads);
+            for (r = 0; r < nreads; r++) {
+              kmer_pos = gt4_index_get_read_info (&db.index, start + r, &file_idx, &name_pos, &dir);
+              fprintf (stdout, " (%u/%u/%u)", file_idx, find_subsequence (seq_files[file_idx], name_pos), kmer_pos);
             }
           }
         }
         fprintf (stdout, "\n");
       }
     }
+    if (idata) gt4_munmap (idata, isize);
   }
   
   return 0;
@@ -569,13 +676,19 @@ process (Queue *queue, unsigned int idx, void *arg)
 
       pthread_mutex_unlock (&snpq->queue.mutex);
       if (debug > 1) fprintf (stderr, "Thread %d: table lookup\n", idx);
-      for (i = 0; i < tt->nwords; i++) {
-        if (debug > 1) {
-          if ((i % 10000) == 0) fprintf (stderr, ".");
+      gt4_db_lookup_batch (snpq->db, tt->words, tt->alleles, tt->nwords);
+      if (debug > 1) fprintf (stderr, "Thread %d: finished lookup\n", idx);
+      if (snpq->ib) {
+        /* Make room for index entries of this table */
+        IndexBuilder *ib = snpq->ib;
+        unsigned long long nmatches = 0;
+        for (i = 0; i < tt->nwords; i++) if (tt->alleles[i]) nmatches += 1;
+        if ((ib->buf_len[idx] + nmatches) > ib->buf_size[idx]) index_builder_flush (ib, idx);
+        if (nmatches > ib->buf_size[idx]) {
+          ib->buf_size[idx] = nmatches;
+          ib->bufs[idx] = (IndexEntry *) realloc (ib->bufs[idx], nmatches * sizeof (IndexEntry));
         }
-        tt->alleles[i] = trie_lookup (&snpq->db->trie, tt->words[i]);
       }
-      if (debug > 1) fprintf (stderr, "Thread %d: finished lookup\n", idx);
       pthread_mutex_lock (&snpq->queue.mutex);
 
       /* fixme: Create separate task / mutex */
@@ -584,28 +697,40 @@ process (Queue *queue, unsigned int idx, void *arg)
         code = tt->alleles[i];
         if (!code) continue;
         code &= 0x7fffffff;
-        node = (code >> db->kmer_bits) - 1;
-        if (node >= db->n_nodes) {
-          fprintf (stderr, "DB inconsistency: Node index %u is bigger than the number of nodes %llu\n", node, db->n_nodes);
-          break;
-        }
-        kmer = code & ((1 << db->kmer_bits) - 1);
-        if (kmer >= db->nodes[node].nkmers) {
-          fprintf (stderr, "DB inconsistency: KMer index %u is bigger than the number of kmers %u\n", kmer, db->nodes[node].nkmers);
-          break;
+        if (db->slot_codes) {
+          /* Code is the count slot, no node lookup needed */
+          kmer_idx = code - 1;
+          if (kmer_idx >= db->n_kmers) {
+            fprintf (stderr, "DB inconsistency: KMer slot %u is bigger than the number of kmers %llu\n", kmer_idx, db->n_kmers);
+            break;
+          }
+        } else {
+          node = (code >> db->kmer_bits) - 1;
+          if (node >= db->n_nodes) {
+            fprintf (stderr, "DB inconsistency: Node index %u is bigger than the number of nodes %llu\n", node, db->n_nodes);
+            break;
+          }
+          kmer = code & ((1 << db->kmer_bits) - 1);
+          if (kmer >= db->nodes[node].nkmers) {
+            fprintf (stderr, "DB inconsistency: KMer index %u is bigger than the number of kmers %u\n", kmer, db->nodes[node].nkmers);
+            break;
+          }
+          kmer_idx = db->nodes[node].kmers + kmer;
         }
         /* Increase kmer count */
-        kmer_idx = db->nodes[node].kmers + kmer;
         if (db->count_bits == 16) {
           if (db->kmers_16[kmer_idx] < 65535) db->kmers_16[kmer_idx] += 1;
         } else {
           if (db->kmers_32[kmer_idx] < 0xffffffff) db->kmers_32[kmer_idx] += 1;
         }
-        if (snpq->reads) {
-          ReadList *rl = gm4_read_list_new ();
-          rl->read = tt->reads[i];
-          rl->next = snpq->reads[kmer_idx];
-          snpq->reads[kmer_idx] = rl;
+        if (snpq->ib) {
+          IndexBuilder *ib = snpq->ib;
+          IndexEntry *e = &ib->bufs[idx][ib->buf_len[idx]++];
+          e->kmer = kmer_idx;
+          e->read = tt->reads[i];
+          ib->counts[kmer_idx] += 1;
+          if (e->read.subseq >= ib->max_subseq[e->read.file_idx]) ib->max_subseq[e->read.file_idx] = e->read.subseq + 1;
+          if (e->read.kmer_pos > ib->max_kmer_pos) ib->max_kmer_pos = e->read.kmer_pos;
         }
       }
       gt4_sequence_file_unref (tt->seqfile);
@@ -681,62 +806,25 @@ compare_counts (const void *lhs, const void *rhs) {
 static unsigned int
 get_pair_median (KMerDB *db)
 {
-  unsigned long long i;
-  unsigned int total, min, max, med, j;
+  unsigned long long i, n;
+  unsigned int *sums, med, j;
 
-  max = 0;
-  min = 0xffffffff;
-  total = 0;
+  n = 0;
+  for (i = 0; i < db->n_nodes; i++) n += db->nodes[i].nkmers / 2;
+  sums = (unsigned int *) malloc ((n + 1) * sizeof (unsigned int));
+  n = 0;
   for (i = 0; i < db->n_nodes; i++) {
-    total += db->nodes[i].nkmers / 2;
-    for (j = 0; j < db->nodes[i].nkmers; j += 2) {
-      unsigned int sum;
+    for (j = 0; j + 1 < db->nodes[i].nkmers; j += 2) {
       if (db->count_bits == 16) {
-        sum = db->kmers_16[db->nodes[i].kmers + j] + db->kmers_16[db->nodes[i].kmers + j + 1];
+        sums[n++] = db->kmers_16[db->nodes[i].kmers + j] + db->kmers_16[db->nodes[i].kmers + j + 1];
       } else {
-        sum = db->kmers_32[db->nodes[i].kmers + j] + db->kmers_32[db->nodes[i].kmers + j + 1];
-      }
-      if (sum > max) max = sum;
-      if (sum < min) min = sum;
-    }
-  }
-  med = (min + max) / 2;
-  while (max > min) {
-    unsigned int above = 0, below = 0, equal;
-    for (i = 0; i < db->n_nodes; i++) {
-      for (j = 0; j < db->nodes[i].nkmers; j += 2) {
-        unsigned int sum;
-        if (db->count_bits == 16) {
-          sum = db->kmers_16[db->nodes[i].kmers + j] + db->kmers_16[db->nodes[i].kmers + j + 1];
-        } else {
-          sum = db->kmers_32[db->nodes[i].kmers + j] + db->kmers_32[db->nodes[i].kmers + j + 1];
-        }
-        if (sum > med) above += 1;
-        if (sum < med) below += 1;
-      }
-    }
-
-    equal = total - above - below;
-    if (debug > 1) fprintf (stderr, "Trying median %u (%u) - equal %u, below %u, above %u\n", med / 6, med, equal, below, above);
-    /* Special case: min == med, max == med + 1 */
-    if (max == (min + 1)) {
-      if (above > (below + equal)) {
-        /* Max is true median */
-        med = max;
+        sums[n++] = db->kmers_32[db->nodes[i].kmers + j] + db->kmers_32[db->nodes[i].kmers + j + 1];
       }
-      break;
     }
-    if (above > below) {
-      if ((above - below) < equal) break;
-      min = med;
-    } else if (below > above) {
-      if ((below - above) < equal) break;
-      max = med;
-    } else {
-      break;
-    }
-    med = (min + max) / 2;
   }
+  med = gt4_median_bisect (sums, n);
+  if (debug > 1) fprintf (stderr, "Pair median %u of %llu pairs\n", med, n);
+  free (sums);
   return med;
 }
 
@@ -764,3 +852,210 @@ task_table_free (TaskTable *tt)
   }
   free (tt);
 }
+
+static IndexBuilder *
+index_builder_new (unsigned int nthreads, unsigned long long memory, unsigned long long n_kmers, unsigned int nfiles, GT4SequenceFile **seq_files)
+{
+  IndexBuilder *ib = (IndexBuilder *) malloc (sizeof (IndexBuilder));
+  unsigned int i;
+  memset (ib, 0, sizeof (IndexBuilder));
+  ib->nthreads = nthreads;
+  ib->buf_size = (unsigned long long *) malloc (nthreads * sizeof (unsigned long long));
+  ib->buf_len = (unsigned long long *) malloc (nthreads * sizeof (unsigned long long));
+  ib->bufs = (IndexEntry **) malloc (nthreads * sizeof (IndexEntry *));
+  for (i = 0; i < nthreads; i++) {
+    ib->buf_size[i] = memory / nthreads / sizeof (IndexEntry);
+    if (ib->buf_size[i] < INDEX_RUN_BUFFER) ib->buf_size[i] = INDEX_RUN_BUFFER;
+    ib->buf_len[i] = 0;
+    ib->bufs[i] = (IndexEntry *) malloc (ib->buf_size[i] * sizeof (IndexEntry));
+  }
+  pthread_mutex_init (&ib->mutex, NULL);
+  ib->counts = (unsigned int *) malloc (n_kmers * 4);
+  memset (ib->counts, 0, n_kmers * 4);
+  ib->max_subseq = (unsigned int *) malloc (nfiles * 4);
+  memset (ib->max_subseq, 0, nfiles * 4);
+  ib->seq_files = seq_files;
+  return ib;
+}
+
+static int
+compare_index_entries (const void *lhs, const void *rhs)
+{
+  const IndexEntry *l = (const IndexEntry *) lhs;
+  const IndexEntry *r = (const IndexEntry *) rhs;
+  if (l->kmer != r->kmer) return (l->kmer < r->kmer) ? -1 : 1;
+  if (l->read.file_idx != r->read.file_idx) return (l->read.file_idx < r->read.file_idx) ? -1 : 1;
+  if (l->read.subseq != r->read.subseq) return (l->read.subseq < r->read.subseq) ? -1 : 1;
+  if (l->read.kmer_pos != r->read.kmer_pos) return (l->read.kmer_pos < r->read.kmer_pos) ? -1 : 1;
+  if (l->read.dir != r->read.dir) return (l->read.dir < r->read.dir) ? -1 : 1;
+  return 0;
+}
+
+/* Sort thread buffer and write it to temporary run file */
+static void
+index_builder_flush (IndexBuilder *ib, unsigned int thread)
+{
+  FILE *ofs;
+  if (!ib->buf_len[thread]) return;
+  qsort (ib->bufs[thread], ib->buf_len[thread], sizeof (IndexEntry), compare_index_entries);
+  ofs = tmpfile ();
+  if (!ofs || (fwrite (ib->bufs[thread], sizeof (IndexEntry), ib->buf_len[thread], ofs) != ib->buf_len[thread])) {
+    fprintf (stderr, "Cannot write temporary index file\n");
+    exit (1);
+  }
+  pthread_mutex_lock (&ib->mutex);
+  ib->runs = (FILE **) realloc (ib->runs, (ib->nruns + 1) * sizeof (FILE *));
+  ib->run_len = (unsigned long long *) realloc (ib->run_len, (ib->nruns + 1) * sizeof (unsigned long long));
+  ib->runs[ib->nruns] = ofs;
+  ib->run_len[ib->nruns] = ib->buf_len[thread];
+  ib->nruns += 1;
+  pthread_mutex_unlock (&ib->mutex);
+  if (debug > 1) fprintf (stderr, "Thread %u: wrote index run %u (%llu entries)\n", thread, ib->nruns - 1, ib->buf_len[thread]);
+  ib->buf_len[thread] = 0;
+}
+
+/* Spill remaining entries and set up bit sizes and read blocks */
+static void
+index_builder_finish (IndexBuilder *ib, GT4Index *index, unsigned long long n_kmers, unsigned int nfiles)
+{
+  unsigned long long max_name_pos = 0, read_start = 0, i;
+  unsigned int max_file_idx = nfiles - 1, max_kmer_pos = ib->max_kmer_pos, t;
+
+  for (t = 0; t < ib->nthreads; t++) {
+    index_builder_flush (ib, t);
+    free (ib->bufs[t]);
+  }
+  /* Subsequences are added in file order so the last one has the largest name position */
+  for (t = 0; t < nfiles; t++) {
+    if (ib->max_subseq[t]) {
+      unsigned long long name_pos = ib->seq_files[t]->subseqs[ib->max_subseq[t] - 1].name_pos;
+      if (name_pos > max_name_pos) max_name_pos = name_pos;
+    }
+  }
+  if (debug) fprintf (stderr, "Num files %u Max name pos %llu Max sequence pos %u\n", nfiles, max_name_pos, max_kmer_pos);
+  index->nbits_file = 1;
+  while (max_file_idx > 1) {
+    index->nbits_file += 1;
+    max_file_idx /= 2;
+  }
+  index->nbits_npos = 1;
+  while (max_name_pos > 1) {
+    index->nbits_npos += 1;
+    max_name_pos /= 2;
+  }
+  index->nbits_kmer = 1;
+  while (max_kmer_pos > 1) {
+    index->nbits_kmer += 1;
+    max_kmer_pos /= 2;
+  }
+  index->n_kmers = n_kmers;
+  index->read_blocks = (unsigned long long *) malloc (n_kmers * sizeof (unsigned long long));
+  for (i = 0; i < n_kmers; i++) {
+    index->read_blocks[i] = (unsigned long long) read_start << 24 | ib->counts[i];
+    read_start += ib->counts[i];
+  }
+  free (ib->counts);
+  ib->counts = NULL;
+  index->n_reads = read_start;
+  index->reads = NULL;
+  index->write_reads = index_builder_write_reads;
+  index->write_data = ib;
+}
+
+typedef struct _IndexRun IndexRun;
+struct _IndexRun {
+  FILE *ifs;
+  IndexEntry *buf;
+  unsigned long long len, pos, remaining;
+};
+
+static unsigned int
+index_run_fill (IndexRun *run)
+{
+  unsigned long long n = (run->remaining > INDEX_RUN_BUFFER) ? INDEX_RUN_BUFFER : run->remaining;
+  if (!n) return 0;
+  if (fread (run->buf, sizeof (IndexEntry), n, run->ifs) != n) {
+    fprintf (stderr, "Cannot read temporary index file\n");
+    exit (1);
+  }
+  run->len = n;
+  run->pos = 0;
+  run->remaining -= n;
+  return 1;
+}
+
+static void
+index_heap_down (IndexRun *runs, unsigned int *heap, unsigned int nheap, unsigned int i)
+{
+  for (;;) {
+    unsigned int l = 2 * i + 1, r = 2 * i + 2, min = i, tmp;
+    if ((l < nheap) && (compare_index_entries (&runs[heap[l]].buf[runs[heap[l]].pos], &runs[heap[min]].buf[runs[heap[min]].pos]) < 0)) min = l;
+    if ((r < nheap) && (compare_index_entries (&runs[heap[r]].buf[runs[heap[r]].pos], &runs[heap[min]].buf[runs[heap[min]].pos]) < 0)) min = r;
+    if (min == i) break;
+    tmp = heap[i];
+    heap[i] = heap[min];
+    heap[min] = tmp;
+    i = min;
+  }
+}
+
+/* K-way merge of sorted runs directly into index file */
+static unsigned long long
+index_builder_write_reads (GT4Index *index, FILE *ofs, void *data)
+{
+  IndexBuilder *ib = (IndexBuilder *) data;
+  IndexRun *runs;
+  unsigned int *heap, nheap = 0, r;
+  unsigned long long written = 0;
+
+  runs = (IndexRun *) malloc ((ib->nruns + 1) * sizeof (IndexRun));
+  heap = (unsigned int *) malloc ((ib->nruns + 1) * sizeof (unsigned int));
+  for (r = 0; r < ib->nruns; r++) {
+    runs[r].ifs = ib->runs[r];
+    rewind (runs[r].ifs);
+    runs[r].buf = (IndexEntry *) malloc (INDEX_RUN_BUFFER * sizeof (IndexEntry));
+    runs[r].remaining = ib->run_len[r];
+    if (index_run_fill (&runs[r])) heap[nheap++] = r;
+  }
+  for (r = nheap / 2; r > 0; r--) index_heap_down (runs, heap, nheap, r - 1);
+  if (debug) fprintf (stderr, "Merging %u index runs\n", ib->nruns);
+  while (nheap > 0) {
+    IndexRun *run = &runs[heap[0]];
+    IndexEntry *e = &run->buf[run->pos];
+    unsigned long long name_pos = ib->seq_files[e->read.file_idx]->subseqs[e->read.subseq].name_pos;
+    unsigned long long code = ((unsigned long long) e->read.dir << (index->nbits_file + index->nbits_npos + index->nbits_kmer)) |
+      ((unsigned long long) e->read.file_idx << (index->nbits_npos + index->nbits_kmer)) |
+      (name_pos << index->nbits_kmer) |
+      e->read.kmer_pos;
+    fwrite (&code, 8, 1, ofs);
+    written += 8;
+    run->pos += 1;
+    if ((run->pos >= run->len) && !index_run_fill (run)) {
+      heap[0] = heap[--nheap];
+    }
+    index_heap_down (runs, heap, nheap, 0);
+  }
+  for (r = 0; r < ib->nruns; r++) {
+    fclose (runs[r].ifs);
+    free (runs[r].buf);
+  }
+  free (runs);
+  free (heap);
+  ib->nruns = 0;
+  return written;
+}
+
+static unsigned int
+find_subsequence (GT4SequenceFile *seqfile, unsigned long long name_pos)
+{
+  unsigned int lo = 0, hi = seqfile->n_subseqs;
+  while (lo + 1 < hi) {
+    unsigned int mid = (lo + hi) / 2;
+    if (seqfile->subseqs[mid].name_pos <= name_pos) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
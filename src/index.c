@@ -107,6 +107,8 @@ gt4_index_write (GT4Index *index, FILE *ofs, unsigned long long n_kmers)
   if (index->reads) {
     fwrite (index->reads, 8, index->n_reads, ofs);
     written += index->n_reads * 8;
+  } else if (index->write_reads) {
+    written += index->write_reads (index, ofs, index->write_data);
   }
   written = (written + 15) & 0xfffffffffffffff0;
   /* Starts */
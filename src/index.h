@@ -20,6 +20,9 @@ struct _GT4Index {
   unsigned long long *read_blocks;
   /* Read data */
   unsigned long long *reads;
+  /* If reads is NULL, called by gt4_index_write to stream reads (returns number of bytes written) */
+  unsigned long long (*write_reads) (GT4Index *index, FILE *ofs, void *data);
+  void *write_data;
 };
 
 /* Return the first read index */
@@ -0,0 +1,152 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "binomial.h"
+
+/* Compare float32 batch kernels against double precision functions */
+
+static double
+log_factorial (unsigned int v)
+{
+  return lgamma (v + 1.0);
+}
+
+#define CHECK_SIZE 4096
+
+static double
+check_error (double v, double ref, double scale)
+{
+  if (isinf (ref) && (v == ref)) return 0;
+  if (scale < 1) scale = 1;
+  return fabs (v - ref) / scale;
+}
+
+static double
+check_binomial_v (unsigned int verbose)
+{
+  static const float sizes[] = { 0.01f, 0.3f, 1, 2.5f, 7.9f, 8, 10, 37.7f, 200, 605.6f };
+  static const float mus[] = { 0.01f, 0.5f, 3, 15.5f, 60, 1000 };
+  static const float ps[] = { 0.001f, 0.1f, 0.5f, 0.77f, 0.999f };
+  unsigned int *x, *nn;
+  float *v, *f;
+  double err, max_err, total_err;
+  unsigned int i, j, k, n;
+
+  x = (unsigned int *) malloc (CHECK_SIZE * sizeof (unsigned int));
+  nn = (unsigned int *) malloc (CHECK_SIZE * sizeof (unsigned int));
+  v = (float *) malloc (CHECK_SIZE * sizeof (float));
+  f = (float *) malloc (CHECK_SIZE * sizeof (float));
+  /* Odd length to include tails */
+  n = CHECK_SIZE - 3;
+  for (i = 0; i < n; i++) x[i] = (i < 2048) ? i : 2048 + (i - 2048) * 31;
+  x[n - 1] = 65535;
+  total_err = 0;
+
+  /* Log factorial, log combinations and negative binomial */
+  max_err = 0;
+  log_factorial_v (f, x, n);
+  for (i = 0; i < n; i++) {
+    err = check_error (f[i], log_factorial (x[i]), log_factorial (x[i]));
+    if (err > max_err) max_err = err;
+  }
+  if (verbose) fprintf (stderr, "log_factorial_v: %g\n", max_err);
+  if (max_err > total_err) total_err = max_err;
+  max_err = 0;
+  for (j = 0; j < sizeof (sizes) / sizeof (sizes[0]); j++) {
+    log_combination_k_r_v (v, x, n, sizes[j]);
+    for (i = 0; i < n; i++) {
+      err = check_error (v[i], log_combination_k_r (x[i], sizes[j]), fabs (log_combination_k_r (x[i], sizes[j])));
+      if (err > max_err) max_err = err;
+    }
+  }
+  if (verbose) fprintf (stderr, "log_combination_k_r_v: %g\n", max_err);
+  if (max_err > total_err) total_err = max_err;
+  max_err = 0;
+  for (j = 0; j < sizeof (sizes) / sizeof (sizes[0]); j++) {
+    for (k = 0; k < sizeof (mus) / sizeof (mus[0]); k++) {
+      double size = sizes[j], mu = mus[k], p = mu / (size + mu);
+      log_dnbinom_mu_v (v, x, n, sizes[j], mus[k]);
+      for (i = 0; i < n; i++) {
+        double c = log_combination_k_r (x[i], size);
+        double ref = c + log (p) * x[i] + log (1 - p) * size;
+        err = check_error (v[i], ref, fabs (c) + fabs (log (p) * x[i]) + fabs (log (1 - p) * size));
+        if (err > max_err) max_err = err;
+      }
+    }
+  }
+  if (verbose) fprintf (stderr, "log_dnbinom_mu_v: %g\n", max_err);
+  if (max_err > total_err) total_err = max_err;
+
+  /* Binomial and Poisson for small counts */
+  max_err = 0;
+  for (j = 0; j < sizeof (ps) / sizeof (ps[0]); j++) {
+    n = 0;
+    for (i = 0; i <= 80; i++) {
+      for (k = 0; k <= i; k++) {
+        x[n] = k;
+        nn[n] = i;
+        n += 1;
+      }
+    }
+    log_dbinom_v (v, x, nn, n, ps[j]);
+    for (i = 0; i < n; i++) {
+      err = check_error (v[i], log_dbinom (x[i], nn[i], ps[j]), log_combinations_d (nn[i], x[i]) + fabs (log (ps[j]) * x[i]) + fabs (log (1 - ps[j]) * (nn[i] - x[i])));
+      if (err > max_err) max_err = err;
+    }
+  }
+  if (verbose) fprintf (stderr, "log_dbinom_v: %g\n", max_err);
+  if (max_err > total_err) total_err = max_err;
+  max_err = 0;
+  n = 1001;
+  for (i = 0; i < n; i++) x[i] = i;
+  for (k = 1; k < sizeof (mus) / sizeof (mus[0]); k++) {
+    log_poisson_v (v, x, n, mus[k]);
+    for (i = 0; i < n; i++) {
+      double ref = log (mus[k]) * x[i] - mus[k] - log_factorial (x[i]);
+      err = check_error (v[i], ref, log_factorial (x[i]) + fabs (log (mus[k]) * x[i]) + mus[k]);
+      if (err > max_err) max_err = err;
+    }
+  }
+  if (verbose) fprintf (stderr, "log_poisson_v: %g\n", max_err);
+  if (max_err > total_err) total_err = max_err;
+
+  /* Exponent relative to value */
+  max_err = 0;
+  n = CHECK_SIZE - 1;
+  for (i = 0; i < n; i++) f[i] = -87 + i * (175.0f / n);
+  exp_v (v, f, n);
+  for (i = 0; i < n; i++) {
+    err = fabs (v[i] - exp (f[i])) / exp (f[i]);
+    if (err > max_err) max_err = err;
+  }
+  if (verbose) fprintf (stderr, "exp_v: %g\n", max_err);
+  if (max_err > total_err) total_err = max_err;
+
+  free (x);
+  free (nn);
+  free (v);
+  free (f);
+  return total_err;
+}
+
+int
+main (int argc, const char *argv[])
+{
+  unsigned int verbose = 1;
+  unsigned int i;
+  double err;
+  for (i = 1; i < argc; i++) {
+    if (!strcmp (argv[i], "-q")) {
+      verbose = 0;
+    } else {
+      fprintf (stderr, "Usage: kerneltest [-q]\n");
+      exit (1);
+    }
+  }
+  init_combination_tables ();
+  err = check_binomial_v (verbose);
+  fprintf (stderr, "Largest relative error %g (tolerance %g)\n", err, BINOMIAL_V_TOLERANCE);
+  return err > BINOMIAL_V_TOLERANCE;
+}
@@ -0,0 +1,285 @@
+#define __GT4_KMERHASH_C__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kmerhash.h"
+
+#define GAMMA 2
+
+static unsigned long long
+hash_key (unsigned long long key, unsigned int level)
+{
+  key ^= 0x9e3779b97f4a7c15ULL * (level + 1);
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+  return key;
+}
+
+/* Bit position within all levels */
+static unsigned long long
+hash_position (KMerHash *hash, unsigned long long key, unsigned int level)
+{
+  unsigned long long nbits = hash->level_blocks[level] * KMERHASH_BLOCK_BITS;
+  unsigned long long pos = (unsigned long long) (((unsigned __int128) hash_key (key, level) * nbits) >> 64);
+  return hash->level_start[level] * KMERHASH_BLOCK_BITS + pos;
+}
+
+#define BLOCK_OF(p) ((p) / KMERHASH_BLOCK_BITS)
+#define WORD_OF(p) (1 + ((p) % KMERHASH_BLOCK_BITS) / 64)
+#define BIT_OF(p) ((p) % 64)
+
+static unsigned long long
+hash_rank (const unsigned long long *block, unsigned long long pos)
+{
+  unsigned long long rank = block[0];
+  unsigned int w, word = WORD_OF (pos);
+  for (w = 1; w < word; w++) rank += __builtin_popcountll (block[w]);
+  rank += __builtin_popcountll (block[word] & ((1ULL << BIT_OF (pos)) - 1));
+  return rank;
+}
+
+static void
+hash_setup_levels (KMerHash *hash)
+{
+  unsigned int l;
+  hash->n_blocks = 0;
+  for (l = 0; l < hash->n_levels; l++) {
+    hash->level_start[l] = hash->n_blocks;
+    hash->n_blocks += hash->level_blocks[l];
+  }
+}
+
+static int
+compare_entries (const void *lhs, const void *rhs)
+{
+  unsigned long long l, r;
+  memcpy (&l, lhs, 8);
+  memcpy (&r, rhs, 8);
+  return (l < r) ? -1 : (l > r) ? 1 : 0;
+}
+
+unsigned int
+kmer_hash_build (KMerHash *hash, const unsigned long long *keys, const unsigned int *values, unsigned long long n_keys)
+{
+  unsigned long long *remaining, *seen = NULL, *collided = NULL, *bits = NULL;
+  unsigned long long n_remaining, i, b, rank, nalloc;
+  unsigned int l;
+
+  memset (hash, 0, sizeof (KMerHash));
+  hash->n_keys = n_keys;
+  remaining = (unsigned long long *) malloc (n_keys * 8 + 8);
+  if (!remaining) goto failed;
+  memcpy (remaining, keys, n_keys * 8);
+  n_remaining = n_keys;
+
+  /* Level bits, the rank words are added later */
+  nalloc = (GAMMA * n_keys) / 64 + 64;
+  bits = (unsigned long long *) malloc (nalloc * 8);
+  seen = (unsigned long long *) malloc (nalloc * 8);
+  collided = (unsigned long long *) malloc (nalloc * 8);
+  if (!bits || !seen || !collided) goto failed;
+
+  for (l = 0; (l < KMERHASH_MAX_LEVELS) && n_remaining; l++) {
+    unsigned long long nblocks, nbits, start, n_next;
+    nblocks = (GAMMA * n_remaining + KMERHASH_BLOCK_BITS - 1) / KMERHASH_BLOCK_BITS;
+    nbits = nblocks * KMERHASH_BLOCK_BITS;
+    hash->level_blocks[l] = nblocks;
+    hash->n_levels = l + 1;
+    hash_setup_levels (hash);
+    start = hash->level_start[l] * KMERHASH_BLOCK_BITS;
+    if ((start + nbits) / 64 + 1 > nalloc) {
+      unsigned long long *p;
+      nalloc = ((start + nbits) / 64 + 1) * 2;
+      /* Old arrays stay valid (and freed on failure) if realloc fails */
+      if (!(p = (unsigned long long *) realloc (bits, nalloc * 8))) goto failed;
+      bits = p;
+      if (!(p = (unsigned long long *) realloc (seen, nalloc * 8))) goto failed;
+      seen = p;
+      if (!(p = (unsigned long long *) realloc (collided, nalloc * 8))) goto failed;
+      collided = p;
+    }
+    memset (seen, 0, (nbits / 64 + 1) * 8);
+    memset (collided, 0, (nbits / 64 + 1) * 8);
+    /* Mark positions */
+    for (i = 0; i < n_remaining; i++) {
+      unsigned long long p = hash_position (hash, remaining[i], l) - start;
+      if (seen[p / 64] & (1ULL << (p % 64))) {
+        collided[p / 64] |= (1ULL << (p % 64));
+      } else {
+        seen[p / 64] |= (1ULL << (p % 64));
+      }
+    }
+    /* Keep unique positions, move colliding keys to the next level */
+    n_next = 0;
+    for (i = 0; i < n_remaining; i++) {
+      unsigned long long p = hash_position (hash, remaining[i], l) - start;
+      if (collided[p / 64] & (1ULL << (p % 64))) remaining[n_next++] = remaining[i];
+    }
+    for (i = 0; i <= nbits / 64; i++) seen[i] &= ~collided[i];
+    /* Append level bits (levels are multiples of 64 bits) */
+    memcpy (bits + start / 64, seen, (nbits / 64) * 8);
+    n_remaining = n_next;
+  }
+  free (seen);
+  free (collided);
+  seen = collided = NULL;
+  hash->n_fallback = n_remaining;
+
+  /* Interleave ranks with bits, blocks are aligned to cache lines */
+  if (posix_memalign ((void **) &hash->blocks_data, 64, hash->n_blocks * KMERHASH_BLOCK_WORDS * 8 + 64)) {
+    hash->blocks_data = NULL;
+    goto failed;
+  }
+  rank = 0;
+  for (b = 0; b < hash->n_blocks; b++) {
+    unsigned long long *block = hash->blocks_data + b * KMERHASH_BLOCK_WORDS;
+    block[0] = rank;
+    memcpy (block + 1, bits + b * (KMERHASH_BLOCK_WORDS - 1), (KMERHASH_BLOCK_WORDS - 1) * 8);
+    for (i = 1; i < KMERHASH_BLOCK_WORDS; i++) rank += __builtin_popcountll (block[i]);
+  }
+  free (bits);
+  bits = NULL;
+  hash->blocks = hash->blocks_data;
+
+  /* Place entries */
+  hash->entries_data = (unsigned char *) malloc (n_keys * 12 + 8);
+  if (!hash->entries_data) goto failed;
+  hash->entries = hash->entries_data;
+  n_remaining = 0;
+  for (i = 0; i < n_keys; i++) {
+    unsigned long long slot = n_keys;
+    for (l = 0; l < hash->n_levels; l++) {
+      unsigned long long p = hash_position (hash, keys[i], l);
+      const unsigned long long *block = hash->blocks + BLOCK_OF (p) * KMERHASH_BLOCK_WORDS;
+      if (block[WORD_OF (p)] & (1ULL << BIT_OF (p))) {
+        slot = hash_rank (block, p);
+        break;
+      }
+    }
+    if (slot == n_keys) {
+      slot = n_keys - hash->n_fallback + n_remaining;
+      n_remaining += 1;
+    }
+    memcpy (hash->entries_data + slot * 12, &keys[i], 8);
+    memcpy (hash->entries_data + slot * 12 + 8, &values[i], 4);
+  }
+  qsort (hash->entries_data + (n_keys - hash->n_fallback) * 12, hash->n_fallback, 12, compare_entries);
+  free (remaining);
+  return 0;
+
+failed:
+  free (remaining);
+  free (bits);
+  free (seen);
+  free (collided);
+  kmer_hash_release (hash);
+  return 1;
+}
+
+void
+kmer_hash_release (KMerHash *hash)
+{
+  free (hash->blocks_data);
+  free (hash->entries_data);
+  memset (hash, 0, sizeof (KMerHash));
+}
+
+unsigned int
+kmer_hash_lookup (KMerHash *hash, unsigned long long key)
+{
+  unsigned long long lo, hi, k;
+  unsigned int l, value;
+  for (l = 0; l < hash->n_levels; l++) {
+    unsigned long long p = hash_position (hash, key, l);
+    const unsigned long long *block = hash->blocks + BLOCK_OF (p) * KMERHASH_BLOCK_WORDS;
+    if (block[WORD_OF (p)] & (1ULL << BIT_OF (p))) {
+      const unsigned char *entry = hash->entries + hash_rank (block, p) * 12;
+      memcpy (&k, entry, 8);
+      if (k != key) return 0;
+      memcpy (&value, entry + 8, 4);
+      return value;
+    }
+  }
+  /* Binary search from fallback */
+  lo = hash->n_keys - hash->n_fallback;
+  hi = hash->n_keys;
+  while (lo < hi) {
+    unsigned long long mid = (lo + hi) / 2;
+    memcpy (&k, hash->entries + mid * 12, 8);
+    if (k == key) {
+      memcpy (&value, hash->entries + mid * 12 + 8, 4);
+      return value;
+    } else if (k < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Binary layout
+ *
+ * 0   : n_keys (8)
+ * 8   : n_fallback (8)
+ * 16  : n_levels (4)
+ * 20  : header size (4), 0 in old files with blocks at 280
+ * 24  : level_blocks (8 * KMERHASH_MAX_LEVELS)
+ * 280 : padding to HEADER_SIZE
+ * 320 : Blocks (64 * n_blocks), 64-byte aligned if the section is
+ *     : Entries (12 * n_keys, padded to 8)
+ */
+
+#define HEADER_SIZE 320
+#define OLD_HEADER_SIZE (24 + 8 * KMERHASH_MAX_LEVELS)
+
+unsigned long long
+kmer_hash_write (KMerHash *hash, FILE *ofs)
+{
+  static const unsigned char zero[HEADER_SIZE - OLD_HEADER_SIZE] = { 0 };
+  unsigned long long len = 0, padding;
+  unsigned int header_size = HEADER_SIZE;
+  fwrite (&hash->n_keys, 8, 1, ofs);
+  fwrite (&hash->n_fallback, 8, 1, ofs);
+  fwrite (&hash->n_levels, 4, 1, ofs);
+  fwrite (&header_size, 4, 1, ofs);
+  fwrite (hash->level_blocks, 8, KMERHASH_MAX_LEVELS, ofs);
+  fwrite (zero, 1, HEADER_SIZE - OLD_HEADER_SIZE, ofs);
+  len += HEADER_SIZE;
+  fwrite (hash->blocks, 8 * KMERHASH_BLOCK_WORDS, hash->n_blocks, ofs);
+  len += hash->n_blocks * 8 * KMERHASH_BLOCK_WORDS;
+  fwrite (hash->entries, 12, hash->n_keys, ofs);
+  len += hash->n_keys * 12;
+  padding = (8 - (len % 8)) % 8;
+  fwrite (zero, 1, padding, ofs);
+  len += padding;
+  return len;
+}
+
+unsigned int
+kmer_hash_init_from_data (KMerHash *hash, const unsigned char *cdata, unsigned long long csize)
+{
+  unsigned int header_size;
+  memset (hash, 0, sizeof (KMerHash));
+  if (csize < OLD_HEADER_SIZE) return 1;
+  memcpy (&hash->n_keys, cdata, 8);
+  memcpy (&hash->n_fallback, cdata + 8, 8);
+  memcpy (&hash->n_levels, cdata + 16, 4);
+  memcpy (&header_size, cdata + 20, 4);
+  if (!header_size) header_size = OLD_HEADER_SIZE;
+  if ((hash->n_levels > KMERHASH_MAX_LEVELS) || (header_size < OLD_HEADER_SIZE) || (header_size % 8)) return 1;
+  memcpy (hash->level_blocks, cdata + 24, 8 * KMERHASH_MAX_LEVELS);
+  hash_setup_levels (hash);
+  if (csize < header_size + hash->n_blocks * 8 * KMERHASH_BLOCK_WORDS + hash->n_keys * 12) return 1;
+  /* Blocks crossing cache lines would double lookup misses */
+  if ((uintptr_t) (cdata + header_size) % 64) return 2;
+  hash->blocks = (const unsigned long long *) (cdata + header_size);
+  hash->entries = cdata + header_size + hash->n_blocks * 8 * KMERHASH_BLOCK_WORDS;
+  return 0;
+}
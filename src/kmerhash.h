@@ -0,0 +1,50 @@
+#ifndef __GT4_KMERHASH_H__
+#define __GT4_KMERHASH_H__
+
+#include <stdio.h>
+
+/*
+ * Minimal perfect hash of kmers (BBHash-style)
+ *
+ * Every level is a bit array of GAMMA * (remaining keys) bits, a key is placed
+ * at the first level where it does not collide with other keys. Bits are stored
+ * in 64-byte blocks of one rank word and 7 bit words, so finding the slot of a key
+ * usually touches one cache line. Keys are stored with values to reject absent kmers.
+ * Keys not placed in KMERHASH_MAX_LEVELS levels are kept sorted at the end of entries.
+ */
+
+#define KMERHASH_MAX_LEVELS 32
+#define KMERHASH_BLOCK_WORDS 8
+#define KMERHASH_BLOCK_BITS 448
+
+typedef struct _KMerHash KMerHash;
+
+struct _KMerHash {
+  unsigned long long n_keys;
+  unsigned long long n_fallback;
+  unsigned int n_levels;
+  /* Size of levels in blocks */
+  unsigned long long level_blocks[KMERHASH_MAX_LEVELS];
+  unsigned long long level_start[KMERHASH_MAX_LEVELS];
+  unsigned long long n_blocks;
+  const unsigned long long *blocks;
+  /* Key (8 bytes) + value (4 bytes) */
+  const unsigned char *entries;
+  /* Allocated data (NULL if mapped) */
+  unsigned long long *blocks_data;
+  unsigned char *entries_data;
+};
+
+/* Build hash from keys and values, the arrays are not needed afterwards */
+unsigned int kmer_hash_build (KMerHash *hash, const unsigned long long *keys, const unsigned int *values, unsigned long long n_keys);
+void kmer_hash_release (KMerHash *hash);
+
+/* Return value or 0 if key is not present */
+unsigned int kmer_hash_lookup (KMerHash *hash, unsigned long long key);
+
+/* Return number of bytes written */
+unsigned long long kmer_hash_write (KMerHash *hash, FILE *ofs);
+/* Set up from mapped data (no copy), return 1 if invalid or 2 if blocks are not 64-byte aligned (old file) */
+unsigned int kmer_hash_init_from_data (KMerHash *hash, const unsigned char *cdata, unsigned long long csize);
+
+#endif
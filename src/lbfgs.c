@@ -0,0 +1,163 @@
+#define __GT4_LBFGS_C__
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lbfgs.h"
+
+/* Sufficient decrease and curvature constants of Wolfe conditions */
+#define LBFGS_C1 1e-4
+#define LBFGS_C2 0.9
+/* Function evaluations per line search */
+#define LBFGS_MAX_LS 20
+
+static double
+dot (int n, const double a[], const double b[])
+{
+  double sum = 0;
+  int i;
+  for (i = 0; i < n; i++) sum += a[i] * b[i];
+  return sum;
+}
+
+/* d = -H g by two-loop recursion over stored pairs, oldest first in ring buffer */
+
+static void
+lbfgs_direction (int n, double d[], const double g[], double *s, double *y, const double rho[], int first, int count)
+{
+  double alpha[LBFGS_HISTORY];
+  double gamma;
+  int i, j, k;
+
+  for (i = 0; i < n; i++) d[i] = -g[i];
+  for (j = count - 1; j >= 0; j--) {
+    k = (first + j) % LBFGS_HISTORY;
+    alpha[j] = rho[k] * dot (n, s + k * n, d);
+    for (i = 0; i < n; i++) d[i] -= alpha[j] * y[k * n + i];
+  }
+  if (count > 0) {
+    /* Initial Hessian is scaled by the last step */
+    k = (first + count - 1) % LBFGS_HISTORY;
+    gamma = 1 / (rho[k] * dot (n, y + k * n, y + k * n));
+    for (i = 0; i < n; i++) d[i] *= gamma;
+  }
+  for (j = 0; j < count; j++) {
+    double beta;
+    k = (first + j) % LBFGS_HISTORY;
+    beta = rho[k] * dot (n, y + k * n, d);
+    for (i = 0; i < n; i++) d[i] += (alpha[j] - beta) * s[k * n + i];
+  }
+}
+
+double
+lbfgs_minimize (int n, double x[], double (*func) (int, const double[], double[], void *), void *data, int niterations, double tolerance, unsigned int *nevals)
+{
+  double *g, *d, *xn, *gn, *xl, *gl, *s, *y;
+  double rho[LBFGS_HISTORY];
+  double f, fn, fl, gd, step, sy, yy;
+  int first, count, iter, i;
+  unsigned int evals;
+
+  g = (double *) malloc ((6 + 2 * LBFGS_HISTORY) * n * sizeof (double));
+  d = g + n;
+  xn = d + n;
+  gn = xn + n;
+  xl = gn + n;
+  gl = xl + n;
+  s = gl + n;
+  y = s + LBFGS_HISTORY * n;
+  first = count = 0;
+
+  f = func (n, x, g, data);
+  evals = 1;
+  for (iter = 0; iter < niterations; iter++) {
+    double lo, hi;
+    unsigned int ls, accepted, has_lo;
+
+    lbfgs_direction (n, d, g, s, y, rho, first, count);
+    gd = dot (n, g, d);
+    if (!(gd < 0)) {
+      /* Not a descent direction, restart from steepest descent */
+      count = 0;
+      for (i = 0; i < n; i++) d[i] = -g[i];
+      gd = dot (n, g, d);
+      if (!(gd < 0)) break;
+    }
+    /* First step of steepest descent is limited to unit length */
+    step = (count > 0) ? 1 : 1 / sqrt (-gd);
+    if (step > 1) step = 1;
+
+    lo = 0;
+    hi = 0;
+    accepted = 0;
+    has_lo = 0;
+    fl = f;
+    for (ls = 0; ls < LBFGS_MAX_LS; ls++) {
+      for (i = 0; i < n; i++) xn[i] = x[i] + step * d[i];
+      fn = func (n, xn, gn, data);
+      evals += 1;
+      if (isnan (fn) || (fn > f + LBFGS_C1 * step * gd)) {
+        hi = step;
+      } else if (dot (n, gn, d) < LBFGS_C2 * gd) {
+        /* Sufficient decrease but still steep, remember as fallback */
+        lo = step;
+        if (!has_lo || (fn < fl)) {
+          memcpy (xl, xn, n * sizeof (double));
+          memcpy (gl, gn, n * sizeof (double));
+          fl = fn;
+          has_lo = 1;
+        }
+      } else {
+        accepted = 1;
+        break;
+      }
+      step = (hi > 0) ? (lo + hi) / 2 : 2 * step;
+    }
+    if (!accepted) {
+      if (has_lo) {
+        memcpy (xn, xl, n * sizeof (double));
+        memcpy (gn, gl, n * sizeof (double));
+        fn = fl;
+      } else if (count > 0) {
+        /* Retry with steepest descent */
+        count = 0;
+        continue;
+      } else {
+        break;
+      }
+    }
+
+    /* Store step and gradient change if curvature is positive (oldest pair is replaced if full) */
+    sy = yy = 0;
+    for (i = 0; i < n; i++) {
+      sy += (xn[i] - x[i]) * (gn[i] - g[i]);
+      yy += (gn[i] - g[i]) * (gn[i] - g[i]);
+    }
+    if (sy > 1e-12 * yy) {
+      int k = (first + count) % LBFGS_HISTORY;
+      for (i = 0; i < n; i++) {
+        s[k * n + i] = xn[i] - x[i];
+        y[k * n + i] = gn[i] - g[i];
+      }
+      rho[k] = 1 / sy;
+      if (count < LBFGS_HISTORY) {
+        count += 1;
+      } else {
+        first = (first + 1) % LBFGS_HISTORY;
+      }
+    }
+
+    memcpy (x, xn, n * sizeof (double));
+    memcpy (g, gn, n * sizeof (double));
+    if ((f - fn) <= tolerance * fabs (fn)) {
+      f = fn;
+      break;
+    }
+    f = fn;
+  }
+
+  free (g);
+  if (nevals) *nevals += evals;
+  return f;
+}
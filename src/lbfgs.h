@@ -0,0 +1,31 @@
+#ifndef __GT4_LBFGS_H__
+#define __GT4_LBFGS_H__
+
+/*
+ * Limited memory BFGS minimization
+ *
+ * Search direction is built from the last LBFGS_HISTORY steps and gradient
+ * changes, step length is found by bisection/doubling until the weak Wolfe
+ * conditions hold. Direction falls back to steepest descent if the history
+ * does not give descent.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LBFGS_HISTORY 6
+
+/*
+ * func returns value at values and writes its gradient to grad
+ * Stops after niterations or when value decreases less than tolerance * |value| in an iteration
+ * values are replaced by the best point found, its value is returned
+ * The number of func evaluations is added to nevals (if not NULL)
+ */
+double lbfgs_minimize (int nvalues, double values[], double (*func) (int, const double[], double[], void *), void *data, int niterations, double tolerance, unsigned int *nevals);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
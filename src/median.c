@@ -0,0 +1,116 @@
+#define __GT4_MEDIAN_C__
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+#include "median.h"
+
+/* Histogram is used if range is at most this times number of values (plus constant) */
+#define HISTOGRAM_RATIO 4
+#define HISTOGRAM_MIN 65536
+
+typedef struct _Ranks Ranks;
+
+/* Number of values below and not above a given value */
+struct _Ranks {
+  unsigned long long n;
+  unsigned int min;
+  unsigned int max;
+  /* Cumulative histogram, cum[v - min] is the number of values <= v */
+  unsigned long long *cum;
+  /* Sorted values (if range is too big for histogram) */
+  unsigned long long *sorted;
+};
+
+static void
+ranks_build (Ranks *r, const unsigned int values[], unsigned long long n)
+{
+  unsigned long long i, range;
+  memset (r, 0, sizeof (Ranks));
+  r->n = n;
+  r->min = 0xffffffff;
+  for (i = 0; i < n; i++) {
+    if (values[i] < r->min) r->min = values[i];
+    if (values[i] > r->max) r->max = values[i];
+  }
+  if (!n) return;
+  range = (unsigned long long) r->max - r->min + 1;
+  if (range <= HISTOGRAM_RATIO * n + HISTOGRAM_MIN) {
+    r->cum = (unsigned long long *) malloc (range * sizeof (unsigned long long));
+    memset (r->cum, 0, range * sizeof (unsigned long long));
+    for (i = 0; i < n; i++) r->cum[values[i] - r->min] += 1;
+    for (i = 1; i < range; i++) r->cum[i] += r->cum[i - 1];
+  } else {
+    r->sorted = (unsigned long long *) malloc (n * sizeof (unsigned long long));
+    for (i = 0; i < n; i++) r->sorted[i] = values[i];
+    hybridInPlaceRadixSort256 (r->sorted, r->sorted + n, NULL, 24);
+  }
+}
+
+static void
+ranks_release (Ranks *r)
+{
+  free (r->cum);
+  free (r->sorted);
+}
+
+/* Number of values <= v */
+static unsigned long long
+ranks_not_above (const Ranks *r, unsigned long long v)
+{
+  unsigned long long lo, hi;
+  if (!r->n || (v < r->min)) return 0;
+  if (v >= r->max) return r->n;
+  if (r->cum) return r->cum[v - r->min];
+  lo = 0;
+  hi = r->n;
+  while (lo < hi) {
+    unsigned long long mid = (lo + hi) / 2;
+    if (r->sorted[mid] <= v) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+unsigned int
+gt4_median_bisect (const unsigned int values[], unsigned long long n)
+{
+  unsigned int min, max, med;
+  Ranks r;
+  if (!n) return 0;
+  ranks_build (&r, values, n);
+  min = r.min;
+  max = r.max;
+  med = (unsigned int) (((unsigned long long) min + max) / 2);
+  while (max > min) {
+    unsigned long long above, below, equal;
+    below = (med > 0) ? ranks_not_above (&r, med - 1) : 0;
+    above = n - ranks_not_above (&r, med);
+    equal = n - above - below;
+    /* Special case: min == med, max == med + 1 */
+    if (max == (min + 1)) {
+      if (above > (below + equal)) {
+        /* Max is true median */
+        med = max;
+      }
+      break;
+    }
+    if (above > below) {
+      if ((above - below) < equal) break;
+      min = med;
+    } else if (below > above) {
+      if ((below - above) < equal) break;
+      max = med;
+    } else {
+      break;
+    }
+    med = (unsigned int) (((unsigned long long) min + max) / 2);
+  }
+  ranks_release (&r);
+  return med;
+}
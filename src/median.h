@@ -0,0 +1,19 @@
+#ifndef __GT4_MEDIAN_H__
+#define __GT4_MEDIAN_H__
+
+/*
+ * Medians of unsigned integer arrays
+ *
+ * Counting histogram is used if the value range is small compared to the
+ * array, otherwise a sorted copy. Values are never modified.
+ */
+
+/*
+ * Median found by bisecting between min and max value until the number of
+ * values above and below the probe differ less than the number of values
+ * equal to it (the historical pair median of gmer_counter and gmer_caller)
+ * Returns 0 for an empty array
+ */
+unsigned int gt4_median_bisect (const unsigned int values[], unsigned long long n);
+
+#endif
@@ -0,0 +1,103 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+
+#
+# Compare gmer_caller model training optimizers on a fixed synthetic sample
+#
+# optbench.pl [GMER_CALLER]
+#
+# Prints likelihood evaluations, final distance and parameters of both
+# simplex and lbfgs for autosome and X models, and any bound warnings
+# Fails if exported lbfgs parameters do not give the distance found by lbfgs
+#
+
+use File::Temp qw (tempfile);
+
+my $caller = $ARGV[0] || "./gmer_caller";
+
+if (!(-x $caller)) {
+  printf STDERR "No gmer_caller binary at %s\n", $caller;
+  exit (1);
+}
+
+# Own generator so that input is the same on all platforms
+my $seed = 1;
+sub uniform {
+  $seed = ($seed * 1103515245 + 12345) % 2147483648;
+  return $seed / 2147483648;
+}
+sub coverage {
+  my ($mean) = @_;
+  my $sum = 0;
+  for (my $i = 0; $i < 12; $i++) {
+    $sum += uniform ();
+  }
+  my $c = int ($mean + ($sum - 6) * sqrt ($mean));
+  return ($c > 0) ? $c : 0;
+}
+sub error {
+  return (uniform () < 0.02) ? 1 : 0;
+}
+
+# Male sample, X and Y have half coverage and one allele
+my ($ofs, $input) = tempfile ("optbenchXXXXXX", SUFFIX => ".txt", TMPDIR => 1, UNLINK => 1);
+for (my $i = 0; $i < 60000; $i++) {
+  my ($chr, $a, $b);
+  my $g = uniform ();
+  if ($i < 50000) {
+    $chr = 1 + $i % 22;
+    if ($g < 0.6) {
+      ($a, $b) = (coverage (30), error ());
+    } elsif ($g < 0.9) {
+      ($a, $b) = (coverage (15), coverage (15));
+    } else {
+      ($a, $b) = (error (), coverage (30));
+    }
+  } else {
+    $chr = ($i < 58000) ? "X" : "Y";
+    if ($g < 0.8) {
+      ($a, $b) = (coverage (15), error ());
+    } else {
+      ($a, $b) = (error (), coverage (15));
+    }
+  }
+  printf $ofs "%s:%d:rs%d:A/C\t1\t%d\t%d\n", $chr, $i, $i, $a, $b;
+}
+close ($ofs);
+
+my $failed = 0;
+printf STDOUT "OPTIMIZER\tMODEL\tEVALUATIONS\tDISTANCE\tL_VIGA\tP_0\tP_1\tP_2\tLAMBDA\tSIZE\tSIZE2\n";
+foreach my $optimizer ("simplex", "lbfgs") {
+  my $model = "";
+  my $distance = "";
+  my $run_distance = "";
+  my @params;
+  open (my $ifs, "$caller -D --no_genotypes --optimizer $optimizer $input 2>&1 >/dev/null |") or die $!;
+  while (my $line = <$ifs>) {
+    chomp ($line);
+    if ($line =~ /^Training (\S+) model/) {
+      $model = $1;
+    } elsif ($line =~ /^Run \d+ distance (\S+)/) {
+      $run_distance = $1;
+    } elsif ($line =~ /^Best distance (\S+)/) {
+      $distance = $1;
+      # Exported parameters have to keep the L-BFGS result
+      if (($run_distance ne "") && (abs ($distance - $run_distance) > 1e-5 * abs ($run_distance))) {
+        printf STDOUT "%s\t%s\tExported distance %s differs from L-BFGS distance %s\n", $optimizer, $model, $distance, $run_distance;
+        $failed = 1;
+      }
+      $run_distance = "";
+    } elsif ($line =~ /^Best (.*)/) {
+      @params = split (/ /, $1);
+    } elsif ($line =~ /^Likelihood evaluations (\d+)/) {
+      printf STDOUT "%s\t%s\t%s\t%s\t%s\n", $optimizer, $model, $1, $distance, join ("\t", @params);
+    } elsif ($line =~ /^Warning/) {
+      printf STDOUT "%s\t%s\t%s\n", $optimizer, $model, $line;
+    }
+  }
+  close ($ifs);
+}
+
+exit ($failed);
@@ -0,0 +1,321 @@
+#define __GT4_POOL_C__
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+/* Number of failed task searches before sleeping */
+#define POOL_SPIN 64
+#define POOL_DEQUE_SIZE 256
+/* Chunks per thread in parallel for */
+#define POOL_CHUNKS_PER_THREAD 4
+
+typedef struct _PoolTask PoolTask;
+typedef struct _PoolDeque PoolDeque;
+typedef struct _PoolWorker PoolWorker;
+typedef struct _PoolRange PoolRange;
+
+struct _PoolTask {
+  void (*run) (void *);
+  void *data;
+  GT4PoolGroup *group;
+};
+
+/* Ring buffer, owner uses bottom, thieves top */
+struct _PoolDeque {
+  pthread_spinlock_t lock;
+  unsigned int size;
+  volatile unsigned long long top;
+  volatile unsigned long long bottom;
+  PoolTask *tasks;
+};
+
+struct _PoolWorker {
+  GT4Pool *pool;
+  unsigned int idx;
+  pthread_t thread;
+};
+
+struct _GT4Pool {
+  unsigned int n_workers;
+  PoolWorker *workers;
+  /* One per worker + injection deque for other threads */
+  PoolDeque *deques;
+  /* Tasks in deques */
+  volatile unsigned int n_queued;
+  volatile unsigned int n_sleeping;
+  volatile unsigned int shutdown;
+  pthread_mutex_t mutex;
+  /* New work */
+  pthread_cond_t work;
+  /* Finished group */
+  pthread_cond_t done;
+};
+
+struct _PoolRange {
+  void (*run) (void *data, unsigned long long start, unsigned long long end);
+  void *data;
+  unsigned long long start;
+  unsigned long long end;
+};
+
+static __thread GT4Pool *current_pool = NULL;
+static __thread unsigned int current_worker = 0;
+
+static void
+deque_push (PoolDeque *deque, const PoolTask *task)
+{
+  pthread_spin_lock (&deque->lock);
+  if ((deque->bottom - deque->top) >= deque->size) {
+    unsigned int new_size = deque->size * 2;
+    PoolTask *tasks = (PoolTask *) malloc (new_size * sizeof (PoolTask));
+    unsigned long long i;
+    for (i = deque->top; i < deque->bottom; i++) tasks[i % new_size] = deque->tasks[i % deque->size];
+    free (deque->tasks);
+    deque->tasks = tasks;
+    deque->size = new_size;
+  }
+  deque->tasks[deque->bottom % deque->size] = *task;
+  deque->bottom += 1;
+  pthread_spin_unlock (&deque->lock);
+}
+
+static unsigned int
+deque_pop (PoolDeque *deque, PoolTask *task)
+{
+  unsigned int result = 0;
+  if (deque->bottom == deque->top) return 0;
+  pthread_spin_lock (&deque->lock);
+  if (deque->bottom > deque->top) {
+    deque->bottom -= 1;
+    *task = deque->tasks[deque->bottom % deque->size];
+    result = 1;
+  }
+  pthread_spin_unlock (&deque->lock);
+  return result;
+}
+
+static unsigned int
+deque_steal (PoolDeque *deque, PoolTask *task)
+{
+  unsigned int result = 0;
+  if (deque->bottom == deque->top) return 0;
+  pthread_spin_lock (&deque->lock);
+  if (deque->bottom > deque->top) {
+    *task = deque->tasks[deque->top % deque->size];
+    deque->top += 1;
+    result = 1;
+  }
+  pthread_spin_unlock (&deque->lock);
+  return result;
+}
+
+/* Own deque (self = n_workers for other threads), injection deque, other workers */
+static unsigned int
+find_task (GT4Pool *pool, unsigned int self, PoolTask *task)
+{
+  unsigned int i;
+  if (!pool->n_queued) return 0;
+  if (self < pool->n_workers) {
+    if (deque_pop (&pool->deques[self], task)) goto found;
+    if (deque_steal (&pool->deques[pool->n_workers], task)) goto found;
+  } else {
+    if (deque_pop (&pool->deques[pool->n_workers], task)) goto found;
+  }
+  for (i = 1; i <= pool->n_workers; i++) {
+    unsigned int victim = (self + i) % (pool->n_workers + 1);
+    if (victim == pool->n_workers) continue;
+    if (deque_steal (&pool->deques[victim], task)) goto found;
+  }
+  return 0;
+found:
+  __sync_fetch_and_sub (&pool->n_queued, 1);
+  return 1;
+}
+
+static void
+run_task (GT4Pool *pool, PoolTask *task)
+{
+  task->run (task->data);
+  if (__sync_sub_and_fetch (&task->group->pending, 1) == 0) {
+    /* Group may be released by joiner after this, only pool is touched */
+    pthread_mutex_lock (&pool->mutex);
+    pthread_cond_broadcast (&pool->done);
+    pthread_mutex_unlock (&pool->mutex);
+  }
+}
+
+static void *
+worker_main (void *data)
+{
+  PoolWorker *worker = (PoolWorker *) data;
+  GT4Pool *pool = worker->pool;
+  unsigned int spins = 0;
+  PoolTask task;
+  current_pool = pool;
+  current_worker = worker->idx;
+  while (!pool->shutdown) {
+    if (find_task (pool, worker->idx, &task)) {
+      run_task (pool, &task);
+      spins = 0;
+    } else if (spins < POOL_SPIN) {
+      spins += 1;
+      sched_yield ();
+    } else {
+      pthread_mutex_lock (&pool->mutex);
+      __sync_fetch_and_add (&pool->n_sleeping, 1);
+      while (!pool->n_queued && !pool->shutdown) pthread_cond_wait (&pool->work, &pool->mutex);
+      __sync_fetch_and_sub (&pool->n_sleeping, 1);
+      pthread_mutex_unlock (&pool->mutex);
+      spins = 0;
+    }
+  }
+  return NULL;
+}
+
+GT4Pool *
+gt4_pool_new (unsigned int nworkers)
+{
+  GT4Pool *pool;
+  unsigned int i;
+  if (nworkers > GT4_POOL_MAX_THREADS) nworkers = GT4_POOL_MAX_THREADS;
+  pool = (GT4Pool *) malloc (sizeof (GT4Pool));
+  memset (pool, 0, sizeof (GT4Pool));
+  pool->n_workers = nworkers;
+  pthread_mutex_init (&pool->mutex, NULL);
+  pthread_cond_init (&pool->work, NULL);
+  pthread_cond_init (&pool->done, NULL);
+  pool->deques = (PoolDeque *) malloc ((nworkers + 1) * sizeof (PoolDeque));
+  for (i = 0; i <= nworkers; i++) {
+    pthread_spin_init (&pool->deques[i].lock, PTHREAD_PROCESS_PRIVATE);
+    pool->deques[i].size = POOL_DEQUE_SIZE;
+    pool->deques[i].top = 0;
+    pool->deques[i].bottom = 0;
+    pool->deques[i].tasks = (PoolTask *) malloc (POOL_DEQUE_SIZE * sizeof (PoolTask));
+  }
+  pool->workers = (PoolWorker *) malloc ((nworkers + 1) * sizeof (PoolWorker));
+  for (i = 0; i < nworkers; i++) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].idx = i;
+    pthread_create (&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]);
+  }
+  return pool;
+}
+
+void
+gt4_pool_delete (GT4Pool *pool)
+{
+  unsigned int i;
+  pthread_mutex_lock (&pool->mutex);
+  pool->shutdown = 1;
+  pthread_cond_broadcast (&pool->work);
+  pthread_mutex_unlock (&pool->mutex);
+  for (i = 0; i < pool->n_workers; i++) pthread_join (pool->workers[i].thread, NULL);
+  for (i = 0; i <= pool->n_workers; i++) {
+    pthread_spin_destroy (&pool->deques[i].lock);
+    free (pool->deques[i].tasks);
+  }
+  pthread_cond_destroy (&pool->work);
+  pthread_cond_destroy (&pool->done);
+  pthread_mutex_destroy (&pool->mutex);
+  free (pool->deques);
+  free (pool->workers);
+  free (pool);
+}
+
+unsigned int
+gt4_pool_get_num_workers (GT4Pool *pool)
+{
+  return pool->n_workers;
+}
+
+void
+gt4_pool_group_init (GT4PoolGroup *group)
+{
+  group->pending = 0;
+}
+
+void
+gt4_pool_fork (GT4Pool *pool, GT4PoolGroup *group, void (*run) (void *), void *data)
+{
+  PoolTask task;
+  unsigned int self = (current_pool == pool) ? current_worker : pool->n_workers;
+  task.run = run;
+  task.data = data;
+  task.group = group;
+  __sync_fetch_and_add (&group->pending, 1);
+  deque_push (&pool->deques[self], &task);
+  __sync_fetch_and_add (&pool->n_queued, 1);
+  if (pool->n_sleeping) {
+    pthread_mutex_lock (&pool->mutex);
+    pthread_cond_signal (&pool->work);
+    pthread_mutex_unlock (&pool->mutex);
+  }
+}
+
+void
+gt4_pool_join (GT4Pool *pool, GT4PoolGroup *group)
+{
+  unsigned int is_worker = (current_pool == pool);
+  unsigned int self = (is_worker) ? current_worker : pool->n_workers;
+  unsigned int spins = 0;
+  PoolTask task;
+  while (group->pending) {
+    if (find_task (pool, self, &task)) {
+      run_task (pool, &task);
+      spins = 0;
+    } else if (is_worker || !pool->n_workers || (spins < POOL_SPIN)) {
+      /* Workers never sleep here, their own tasks may still be stolen and forked further */
+      spins += 1;
+      sched_yield ();
+    } else {
+      pthread_mutex_lock (&pool->mutex);
+      while (group->pending) pthread_cond_wait (&pool->done, &pool->mutex);
+      pthread_mutex_unlock (&pool->mutex);
+    }
+  }
+  __sync_synchronize ();
+}
+
+static void
+run_range (void *data)
+{
+  PoolRange *range = (PoolRange *) data;
+  range->run (range->data, range->start, range->end);
+}
+
+void
+gt4_pool_parallel_for (GT4Pool *pool, unsigned long long n, unsigned long long min_chunk,
+  void (*run) (void *data, unsigned long long start, unsigned long long end), void *data)
+{
+  unsigned long long nchunks, chunk_size, i;
+  PoolRange *ranges;
+  GT4PoolGroup group;
+  if (!n) return;
+  if (min_chunk < 1) min_chunk = 1;
+  nchunks = n / min_chunk;
+  if (nchunks > POOL_CHUNKS_PER_THREAD * (pool->n_workers + 1)) nchunks = POOL_CHUNKS_PER_THREAD * (pool->n_workers + 1);
+  if (nchunks <= 1) {
+    run (data, 0, n);
+    return;
+  }
+  chunk_size = (n + nchunks - 1) / nchunks;
+  nchunks = (n + chunk_size - 1) / chunk_size;
+  ranges = (PoolRange *) malloc (nchunks * sizeof (PoolRange));
+  gt4_pool_group_init (&group);
+  for (i = 0; i < nchunks; i++) {
+    ranges[i].run = run;
+    ranges[i].data = data;
+    ranges[i].start = i * chunk_size;
+    ranges[i].end = (i + 1) * chunk_size;
+    if (ranges[i].end > n) ranges[i].end = n;
+  }
+  /* First chunk is run by calling thread */
+  for (i = 1; i < nchunks; i++) gt4_pool_fork (pool, &group, run_range, &ranges[i]);
+  run_range (&ranges[0]);
+  gt4_pool_join (pool, &group);
+  free (ranges);
+}
@@ -0,0 +1,45 @@
+#ifndef __GT4_POOL_H__
+#define __GT4_POOL_H__
+
+/*
+ * Work-stealing thread pool
+ *
+ * Every worker has its own deque, tasks forked by a worker are pushed to and
+ * popped from the bottom of its deque, idle workers steal from the top of the
+ * others. Tasks forked by other threads go to a shared injection deque.
+ * Sleeping workers are woken as soon as a task is pushed.
+ *
+ * Joining thread executes pending tasks until all tasks of the group are
+ * finished, so fork/join can be nested inside tasks. A pool without workers
+ * runs all tasks in the joining thread.
+ */
+
+#define GT4_POOL_MAX_THREADS 256
+
+typedef struct _GT4Pool GT4Pool;
+typedef struct _GT4PoolGroup GT4PoolGroup;
+
+struct _GT4PoolGroup {
+  /* Number of unfinished tasks */
+  volatile unsigned int pending;
+};
+
+/* Create pool with nworkers worker threads (0 - tasks are run by joining thread) */
+GT4Pool *gt4_pool_new (unsigned int nworkers);
+void gt4_pool_delete (GT4Pool *pool);
+unsigned int gt4_pool_get_num_workers (GT4Pool *pool);
+
+/* Fork/join */
+void gt4_pool_group_init (GT4PoolGroup *group);
+void gt4_pool_fork (GT4Pool *pool, GT4PoolGroup *group, void (*run) (void *), void *data);
+/* Wait until all tasks of group are finished */
+void gt4_pool_join (GT4Pool *pool, GT4PoolGroup *group);
+
+/*
+ * Run range [0, n) in chunks of at least min_chunk elements and wait for completion
+ * Chunks only depend on n, min_chunk and the number of workers
+ */
+void gt4_pool_parallel_for (GT4Pool *pool, unsigned long long n, unsigned long long min_chunk,
+  void (*run) (void *data, unsigned long long start, unsigned long long end), void *data);
+
+#endif
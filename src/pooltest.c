@@ -0,0 +1,83 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <stdio.h>
+
+#include "pool.h"
+#include "thread-pool.h"
+
+/* Empty task dispatch latency of GT4Pool and AosoraThreadPool */
+
+static double
+get_time (void)
+{
+  struct timeval tv;
+  gettimeofday (&tv, NULL);
+  double dtval = (tv.tv_sec + tv.tv_usec / 1000000.0);
+  return dtval;
+}
+
+static void
+empty_task (void *data)
+{
+}
+
+static void
+empty_range (void *data, unsigned long long start, unsigned long long end)
+{
+}
+
+int
+main (int argc, const char *argv[])
+{
+  unsigned int nthreads = 4;
+  unsigned int rounds = 10000;
+  unsigned int aosora_rounds = 100;
+  unsigned int i;
+  double start, end;
+  for (i = 1; i < argc; i++) {
+    if (!strcmp (argv[i], "-threads")) {
+      nthreads = atoi (argv[++i]);
+    } else if (!strcmp (argv[i], "-rounds")) {
+      rounds = atoi (argv[++i]);
+    } else if (!strcmp (argv[i], "-aosora_rounds")) {
+      aosora_rounds = atoi (argv[++i]);
+    }
+  }
+  if (nthreads < 1) nthreads = 1;
+
+  fprintf (stdout, "Threads %u rounds %u\n", nthreads, rounds);
+
+  if (aosora_rounds) {
+    AosoraThreadPool *tpool = aosora_thread_pool_new (nthreads);
+    start = get_time ();
+    for (i = 0; i < aosora_rounds; i++) {
+      aosora_thread_pool_submit (tpool, NULL, empty_task, NULL, NULL, NULL);
+      aosora_thread_pool_run (tpool);
+    }
+    end = get_time ();
+    fprintf (stdout, "AosoraThreadPool submit/run: %.2f us per task (%u rounds)\n", (end - start) * 1000000 / aosora_rounds, aosora_rounds);
+    aosora_thread_pool_delete (tpool);
+  }
+
+  GT4Pool *pool = gt4_pool_new (nthreads - 1);
+  GT4PoolGroup group;
+  start = get_time ();
+  for (i = 0; i < rounds; i++) {
+    gt4_pool_group_init (&group);
+    gt4_pool_fork (pool, &group, empty_task, NULL);
+    gt4_pool_join (pool, &group);
+  }
+  end = get_time ();
+  fprintf (stdout, "GT4Pool fork/join: %.2f us per task\n", (end - start) * 1000000 / rounds);
+
+  start = get_time ();
+  for (i = 0; i < rounds; i++) {
+    gt4_pool_parallel_for (pool, nthreads * 4, 1, empty_range, NULL);
+  }
+  end = get_time ();
+  fprintf (stdout, "GT4Pool parallel for (%u chunks): %.2f us per round\n", nthreads * 4, (end - start) * 1000000 / rounds);
+  gt4_pool_delete (pool);
+
+  return 0;
+}
@@ -145,6 +145,8 @@ maker_queue_add_file (MakerQueue *mq, const char *filename)
 {
         TaskFile *task;
         task = task_file_new (filename, 0);
+        task->nwordlengths = mq->nwordlengths;
+        memcpy (task->wordlengths, mq->wordlengths, sizeof (task->wordlengths));
         task->next = mq->files;
         mq->files = task;
 }
@@ -196,20 +198,34 @@ queue_get_sorted (MakerQueue *queue)
 	return queue->sorted[queue->nsorted];
 }
 
+unsigned int
+queue_get_mergeable_wordlength (MakerQueue *queue)
+{
+	unsigned int i, j;
+	for (i = 0; i < queue->nsorted; i++) {
+		for (j = i + 1; j < queue->nsorted; j++) {
+			if (queue->sorted[j]->wordlength == queue->sorted[i]->wordlength) return queue->sorted[i]->wordlength;
+		}
+	}
+	return 0;
+}
+
 wordtable *
-queue_get_smallest_sorted (MakerQueue *queue)
+queue_get_smallest_sorted (MakerQueue *queue, unsigned int wordlength)
 {
 	unsigned int i, min;
 	unsigned long long minwords;
 	wordtable *t;
-	min = 0;
-	minwords = queue->sorted[0]->nwords;
-	for (i = 1; i < queue->nsorted; i++) {
-		if (queue->sorted[i]->nwords < minwords) {
+	min = queue->nsorted;
+	minwords = 0;
+	for (i = 0; i < queue->nsorted; i++) {
+		if (queue->sorted[i]->wordlength != wordlength) continue;
+		if ((min == queue->nsorted) || (queue->sorted[i]->nwords < minwords)) {
 			min = i;
 			minwords = queue->sorted[i]->nwords;
 		}
 	}
+	if (min == queue->nsorted) return NULL;
 	t = queue->sorted[min];
 	queue->sorted[min] = queue->sorted[queue->nsorted - 1];
 	queue->nsorted -= 1;
@@ -217,19 +233,21 @@ queue_get_smallest_sorted (MakerQueue *queue)
 }
 
 wordtable *
-queue_get_mostavailable_sorted (MakerQueue *queue)
+queue_get_mostavailable_sorted (MakerQueue *queue, unsigned int wordlength)
 {
 	unsigned int i, max;
 	unsigned long long maxavail;
 	wordtable *t;
-	max = 0;
-	maxavail = queue->sorted[0]->nwordslots - queue->sorted[0]->nwords;
-	for (i = 1; i < queue->nsorted; i++) {
-		if ((queue->sorted[i]->nwordslots - queue->sorted[0]->nwords) > maxavail) {
+	max = queue->nsorted;
+	maxavail = 0;
+	for (i = 0; i < queue->nsorted; i++) {
+		if (queue->sorted[i]->wordlength != wordlength) continue;
+		if ((max == queue->nsorted) || ((queue->sorted[i]->nwordslots - queue->sorted[i]->nwords) > maxavail)) {
 			max = i;
 			maxavail = queue->sorted[i]->nwordslots - queue->sorted[i]->nwords;
 		}
 	}
+	if (max == queue->nsorted) return NULL;
 	t = queue->sorted[max];
 	queue->sorted[max] = queue->sorted[queue->nsorted - 1];
 	queue->nsorted -= 1;
@@ -327,6 +345,9 @@ task_file_read_nwords (TaskFile *tf, unsigned long long maxwords, unsigned int w
       if (tf->scout) scout_mmap (tf->seqfile->cdata, tf->seqfile->csize);
       fasta_reader_init_from_data (&tf->reader, wordsize, 1, tf->seqfile->cdata, tf->seqfile->csize);
     }
+    if (tf->nwordlengths) {
+      fasta_reader_set_wordlengths (&tf->reader, tf->wordlengths, tf->nwordlengths);
+    }
     tf->has_reader = 1;
   }
   return fasta_reader_read_nwords (&tf->reader, maxwords, start_sequence, end_sequence, read_character, read_nucleotide, read_word, data);
@@ -94,6 +94,9 @@ struct _MakerQueue {
 
         /* Parameters */
         unsigned int wordlen;
+        /* Several word lengths counted in one pass (0 - only wordlen) */
+        unsigned int nwordlengths;
+        unsigned int wordlengths[FASTA_MAX_WORDLENGTHS];
         unsigned long long tablesize;
         unsigned int cutoff;
         /* Number of worker tasks */
@@ -127,6 +130,8 @@ struct _TaskFile {
         unsigned int close_on_delete;
         unsigned int scout;
         unsigned int has_reader;
+        unsigned int nwordlengths;
+        unsigned int wordlengths[FASTA_MAX_WORDLENGTHS];
         FastaReader reader;
 };
 
@@ -145,6 +150,7 @@ unsigned int task_file_read_nwords (TaskFile *tf, unsigned long long maxwords, u
 	void *data);
 
 /* Add new file task to queue (not thread-safe) */
+/* Word lengths have to be set before adding files */
 void maker_queue_add_file (MakerQueue *mq, const char *filename);
 /* Get smallest table */
 wordtable *queue_get_smallest_table (MakerQueue *queue);
@@ -152,8 +158,11 @@ wordtable *queue_get_smallest_table (MakerQueue *queue);
 wordtable *queue_get_largest_table (MakerQueue *queue);
 
 wordtable *queue_get_sorted (MakerQueue *queue);
-wordtable *queue_get_smallest_sorted (MakerQueue *queue);
-wordtable *queue_get_mostavailable_sorted (MakerQueue *queue);
+/* Word length with at least two sorted tables (0 - none) */
+unsigned int queue_get_mergeable_wordlength (MakerQueue *queue);
+/* Only tables of given word length are considered */
+wordtable *queue_get_smallest_sorted (MakerQueue *queue, unsigned int wordlength);
+wordtable *queue_get_mostavailable_sorted (MakerQueue *queue, unsigned int wordlength);
 
 /* MMap scouting */
 
@@ -13,6 +13,31 @@
 
 float
 downhill_simplex (int NDIM, float MX[], float MdX[], float EMax, int nruns, int niterations, float (*func) (int, const float[], void *), void *data)
+{
+	return downhill_simplex_seeded (NDIM, MX, MdX, EMax, nruns, niterations, func, data, NULL);
+}
+
+static int
+simplex_rand (void *data)
+{
+	return rand ();
+}
+
+static int
+simplex_rand_r (void *data)
+{
+	return rand_r ((unsigned int *) data);
+}
+
+float
+downhill_simplex_seeded (int NDIM, float MX[], float MdX[], float EMax, int nruns, int niterations, float (*func) (int, const float[], void *), void *data, unsigned int *seed)
+{
+	if (seed) return downhill_simplex_random (NDIM, MX, MdX, EMax, nruns, niterations, func, data, simplex_rand_r, seed);
+	return downhill_simplex_random (NDIM, MX, MdX, EMax, nruns, niterations, func, data, simplex_rand, NULL);
+}
+
+float
+downhill_simplex_random (int NDIM, float MX[], float MdX[], float EMax, int nruns, int niterations, float (*func) (int, const float[], void *), void *data, int (*rnd) (void *), void *rnd_data)
 {
 	float MP[26][25];          /* Main matrix of simplex vertices         */
 	float Pb[25];              /* The point Pb.                           */
@@ -40,7 +65,7 @@ downhill_simplex (int NDIM, float MX[], float MdX[], float EMax, int nruns, int
 		ITR0 = 0;
 		for (i = 0; i < NDIM; i++) {
 			for (j = 0; j < MPTS; j++) MP[j][i] = MX[i];
-			MP[i][i] += MdX[i] * (0.9 + 0.2 * rand () / RAND_MAX) / (5 * ITR1 + 1);
+			MP[i][i] += MdX[i] * (0.9 + 0.2 * rnd (rnd_data) / RAND_MAX) / (5 * ITR1 + 1);
 			// MP[i][i] += MdX[i];
 			// MdX[i] /= 2;
 		}
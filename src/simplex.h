@@ -10,6 +10,10 @@ extern "C" {
 #endif
 
 float downhill_simplex (int nvalues, float values[], float deltas[], float maxerror, int nruns, int niterations, float (* distance) (int, const float[], void *), void *data);
+/* Random perturbations of restarts are drawn with rand_r (seed) instead of rand () (NULL - use rand ()) */
+float downhill_simplex_seeded (int nvalues, float values[], float deltas[], float maxerror, int nruns, int niterations, float (* distance) (int, const float[], void *), void *data, unsigned int *seed);
+/* Random perturbations are drawn with rnd (rnd_data), values 0...RAND_MAX */
+float downhill_simplex_random (int nvalues, float values[], float deltas[], float maxerror, int nruns, int niterations, float (* distance) (int, const float[], void *), void *data, int (* rnd) (void *), void *rnd_data);
 
 #ifdef __cplusplus
 }
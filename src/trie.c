@@ -1,6 +1,8 @@
 #define __GT4_TRIE_C__
 
+#include <sys/mman.h>
 #include <malloc.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <strings.h>
@@ -13,6 +15,9 @@ unsigned int gt4_trie_debug = 0;
 
 static TrieRef trie_node_add_word (Trie *trie, TrieRef ref, unsigned int level, unsigned long long word, unsigned int nbits, unsigned int count, unsigned int aidx);
 static unsigned int trie_node_lookup (Trie *trie, TrieRef ref, unsigned long long word, unsigned int nbits);
+static unsigned int trie_node_foreach (Trie *trie, TrieRef ref, unsigned long long prefix, unsigned int nbits, unsigned int (*func) (unsigned long long, unsigned int, void *), void *data);
+static unsigned long long trie_node_count_branches (Trie *trie, TrieRef ref);
+static TrieRef trie_node_build_sorted (Trie *trie, const unsigned long long words[], const unsigned int counts[], unsigned long long nwords, unsigned int nbits, unsigned int aidx);
 
 #define ALLOCATOR_BLOCK_SIZE 65536
 
@@ -33,6 +38,7 @@ trie_setup_full (Trie *trie, unsigned int nbits, unsigned int nbits_root, unsign
   trie->nbits_root = (nbits > nbits_root) ? nbits_root : nbits;
   root_size = (1ULL << trie->nbits_root) * sizeof (TrieRef);
   trie->roots = (TrieRef *) malloc (root_size);
+  trie->owned_roots = 1;
   if (gt4_trie_debug & GT4_TRIE_COUNT_ALLOCATIONS) {
     trie->num_allocations += 1;
     trie->total_memory += root_size;
@@ -45,20 +51,51 @@ trie_setup_full (Trie *trie, unsigned int nbits, unsigned int nbits_root, unsign
   memset (trie->allocators, 0, nallocators * sizeof (TrieAllocator));
 }
 
+unsigned int
+trie_select_root_bits (unsigned int nbits, unsigned long long nwords)
+{
+  unsigned int bits = TRIE_MIN_ROOT_BITS;
+  if (TRIE_ROOT_BITS) return TRIE_ROOT_BITS;
+  if ((nbits > KMER_MAX_BITS + TRIE_MIN_ROOT_BITS) && ((nbits - KMER_MAX_BITS) <= TRIE_MAX_ROOT_BITS) && ((1ULL << (nbits - KMER_MAX_BITS)) <= 4 * nwords)) {
+    /* All words fit into root table as kmers, roots cost less than one branch per word */
+    return nbits - KMER_MAX_BITS;
+  }
+  /* About one root per word */
+  while ((bits < TRIE_MAX_ROOT_BITS) && ((1ULL << bits) < nwords)) bits += 1;
+  return bits;
+}
+
 void
 trie_setup (Trie *trie, unsigned int nbits, unsigned int nbits_root)
 {
   trie_setup_full (trie, nbits, nbits_root, 1);
 }
 
+static void
+trie_release_blocks (Trie *trie)
+{
+  unsigned int i;
+  for (i = 0; i < 1024; i++) {
+    if (!trie->branches[i]) continue;
+    if (trie->allocators) {
+      munmap (trie->branches[i], TRIE_BLOCK_SIZE * sizeof (TrieNodeBranch));
+    } else if (trie->malloced_blocks) {
+      free (trie->branches[i]);
+    }
+    trie->branches[i] = NULL;
+  }
+}
+
 void
 trie_release (Trie *trie)
 {
+  /* Mapped blocks and roots belong to the data */
+  trie_release_blocks (trie);
   free (trie->allocators);
+  trie->allocators = NULL;
   pthread_mutex_destroy (&trie->mutex);
-  
-  /* fixme: Release nodes (Lauris) */
-  free (trie->roots);
+  if (trie->owned_roots) free (trie->roots);
+  trie->roots = NULL;
 }
 
 void
@@ -74,6 +111,29 @@ trie_add_word_with_allocator (Trie *trie, unsigned long long word, unsigned int
   trie->roots[word >> cbits] = trie_node_add_word (trie, trie->roots[word >> cbits], 0, word % (1ULL << cbits), cbits, count, aidx);
 }
 
+void
+trie_add_sorted_words_with_allocator (Trie *trie, const unsigned long long words[], const unsigned int counts[], unsigned long long nwords, unsigned int aidx)
+{
+  unsigned int cbits = trie->nbits - trie->nbits_root;
+  /* Insertion clips long branches, the shape then depends on insertion order */
+  unsigned int bottom_up = (cbits <= KMER_MAX_BITS + 1 + BRANCH_MAX_BITS_THIS);
+  unsigned long long i = 0, e;
+  while (i < nwords) {
+    unsigned long long r = words[i] >> cbits;
+    unsigned int repeated = 0;
+    for (e = i + 1; (e < nwords) && ((words[e] >> cbits) == r); e++) {
+      if (words[e] == words[e - 1]) repeated = 1;
+    }
+    if (bottom_up && !repeated && REF_IS_EMPTY (trie->roots[r])) {
+      trie->roots[r] = trie_node_build_sorted (trie, words + i, counts + i, e - i, cbits, aidx);
+    } else {
+      /* Repeated words and nonempty roots are inserted one by one */
+      for (; i < e; i++) trie_add_word_with_allocator (trie, words[i], counts[i], aidx);
+    }
+    i = e;
+  }
+}
+
 unsigned int
 trie_lookup (Trie *trie, unsigned long long word)
 {
@@ -81,6 +141,176 @@ trie_lookup (Trie *trie, unsigned long long word)
   return trie_node_lookup (trie, trie->roots[word >> cbits],  word % (1ULL << cbits), cbits);
 }
 
+/* Number of lookups advanced together */
+#define BATCH_WIDTH 16
+
+typedef struct _BatchLane BatchLane;
+struct _BatchLane {
+  unsigned long long idx;
+  unsigned long long word;
+  unsigned int nbits;
+  /* Root slot is read in the next round */
+  const TrieRef *root;
+  TrieRef ref;
+};
+
+void
+trie_lookup_batch (Trie *trie, const unsigned long long words[], unsigned int results[], unsigned long long nwords)
+{
+  BatchLane lanes[BATCH_WIDTH];
+  unsigned int cbits = trie->nbits - trie->nbits_root;
+  unsigned long long next = 0;
+  unsigned int nlanes = 0, l;
+  /* Fill lanes */
+  while ((nlanes < BATCH_WIDTH) && (next < nwords)) {
+    lanes[nlanes].idx = next;
+    lanes[nlanes].word = words[next] % (1ULL << cbits);
+    lanes[nlanes].nbits = cbits;
+    lanes[nlanes].root = &trie->roots[words[next] >> cbits];
+    __builtin_prefetch (lanes[nlanes].root);
+    nlanes += 1;
+    next += 1;
+  }
+  /* Advance every lane by one node per round */
+  while (nlanes > 0) {
+    for (l = 0; l < nlanes; l++) {
+      BatchLane *lane = &lanes[l];
+      unsigned int done = 0, result = 0;
+      if (lane->root) {
+        lane->ref = *lane->root;
+        lane->root = NULL;
+        if (!REF_IS_EMPTY (lane->ref) && REF_IS_BRANCH (lane->ref)) {
+          __builtin_prefetch (BRANCH_FROM_REF (trie, lane->ref));
+          continue;
+        }
+      }
+      if (REF_IS_EMPTY (lane->ref)) {
+        done = 1;
+      } else if (REF_IS_KMER (lane->ref)) {
+        if (KMER_GET_WORD (lane->ref) == lane->word) result = KMER_GET_COUNT (lane->ref);
+        done = 1;
+      } else {
+        TrieNodeBranch *branch = BRANCH_FROM_REF (trie, lane->ref);
+        unsigned long long nbits_this, nbits_children, cword;
+        nbits_this = BRANCH_GET_NBITS_THIS (branch);
+        nbits_children = BRANCH_GET_NBITS_CHILDREN (branch);
+        if (branch->word != (lane->word >> (lane->nbits - nbits_this))) {
+          done = 1;
+        } else {
+          cword = (lane->word >> (lane->nbits - nbits_this - nbits_children)) % (1ULL << nbits_children);
+          lane->nbits -= nbits_this + nbits_children;
+          lane->word = lane->word % (1ULL << lane->nbits);
+          lane->ref = branch->children[cword];
+          if (!REF_IS_EMPTY (lane->ref) && REF_IS_BRANCH (lane->ref)) {
+            __builtin_prefetch (BRANCH_FROM_REF (trie, lane->ref));
+          }
+        }
+      }
+      if (done) {
+        results[lane->idx] = result;
+        if (next < nwords) {
+          /* Start next word in this lane */
+          lane->idx = next;
+          lane->word = words[next] % (1ULL << cbits);
+          lane->nbits = cbits;
+          lane->root = &trie->roots[words[next] >> cbits];
+          __builtin_prefetch (lane->root);
+          next += 1;
+        } else {
+          /* Remove lane */
+          lanes[l] = lanes[nlanes - 1];
+          nlanes -= 1;
+          l -= 1;
+        }
+      }
+    }
+  }
+}
+
+unsigned int
+trie_foreach (Trie *trie, unsigned int (*func) (unsigned long long word, unsigned int count, void *data), void *data)
+{
+  unsigned int cbits = trie->nbits - trie->nbits_root;
+  unsigned long long i, nroots = 1ULL << trie->nbits_root;
+  for (i = 0; i < nroots; i++) {
+    if (REF_IS_EMPTY (trie->roots[i])) continue;
+    if (trie_node_foreach (trie, trie->roots[i], i, cbits, func, data)) return 1;
+  }
+  return 0;
+}
+
+unsigned long long
+trie_compact (Trie *trie)
+{
+  TrieNodeBranch *branches[1024];
+  TrieRef *roots = trie->roots;
+  unsigned long long nroots = 1ULL << trie->nbits_root;
+  unsigned long long i, n, next;
+  if (trie->compact) return trie->nbranches;
+  /* Slot 0 is reserved for empty ref */
+  n = 1;
+  for (i = 0; i < nroots; i++) n += trie_node_count_branches (trie, trie->roots[i]);
+  if (!trie->allocators && (n == trie->nbranches)) {
+    /* Mapped or read trie has no holes (it was written compacted), use it as is */
+    trie->compact = 1;
+    return n;
+  }
+  memset (branches, 0, sizeof (branches));
+  for (i = 0; i * TRIE_BLOCK_SIZE < n; i++) {
+    unsigned long long size = n - i * TRIE_BLOCK_SIZE;
+    if (size > TRIE_BLOCK_SIZE) size = TRIE_BLOCK_SIZE;
+    branches[i] = (TrieNodeBranch *) malloc (size * sizeof (TrieNodeBranch));
+    if (!branches[i]) {
+      while (i > 0) free (branches[--i]);
+      return 0;
+    }
+  }
+  if (!trie->owned_roots) {
+    /* Roots are in mapped data */
+    roots = (TrieRef *) malloc (nroots * sizeof (TrieRef));
+    if (!roots) {
+      for (i = 0; branches[i]; i++) free (branches[i]);
+      return 0;
+    }
+    memcpy (roots, trie->roots, nroots * sizeof (TrieRef));
+  }
+  memset (branches[0], 0, sizeof (TrieNodeBranch));
+  /* Copy every root subtree breadth-first, new slots double as queue */
+  next = 1;
+  for (i = 0; i < nroots; i++) {
+    unsigned long long head = next;
+    if (REF_IS_EMPTY (roots[i]) || REF_IS_KMER (roots[i])) continue;
+    branches[next / TRIE_BLOCK_SIZE][next % TRIE_BLOCK_SIZE] = *BRANCH_FROM_REF (trie, roots[i]);
+    roots[i] = TRIE_REF_FROM_ADDRESS (trie, next / TRIE_BLOCK_SIZE, next % TRIE_BLOCK_SIZE);
+    next += 1;
+    while (head < next) {
+      TrieNodeBranch *branch = &branches[head / TRIE_BLOCK_SIZE][head % TRIE_BLOCK_SIZE];
+      unsigned long long c;
+      for (c = 0; c < (1ULL << BRANCH_GET_NBITS_CHILDREN (branch)); c++) {
+        TrieRef child = branch->children[c];
+        if (REF_IS_EMPTY (child) || REF_IS_KMER (child)) continue;
+        branches[next / TRIE_BLOCK_SIZE][next % TRIE_BLOCK_SIZE] = *BRANCH_FROM_REF (trie, child);
+        branch->children[c] = TRIE_REF_FROM_ADDRESS (trie, next / TRIE_BLOCK_SIZE, next % TRIE_BLOCK_SIZE);
+        next += 1;
+      }
+      head += 1;
+    }
+  }
+  trie_release_blocks (trie);
+  if (trie->allocators) {
+    free (trie->allocators);
+    trie->allocators = NULL;
+    trie->nallocators = 0;
+  }
+  trie->roots = roots;
+  trie->owned_roots = 1;
+  memcpy (trie->branches, branches, sizeof (branches));
+  trie->malloced_blocks = 1;
+  trie->nbranches = n;
+  trie->compact = 1;
+  return n;
+}
+
 unsigned int
 trie_setup_from_file (Trie *trie, FILE *ifs)
 {
@@ -95,6 +325,7 @@ trie_setup_from_file (Trie *trie, FILE *ifs)
   nroots = 1ULL << trie->nbits_root;
   root_size = nroots * sizeof (TrieRef);
   trie->roots = (TrieRef *) malloc (root_size);
+  trie->owned_roots = 1;
   if (gt4_trie_debug & GT4_TRIE_COUNT_ALLOCATIONS) {
     trie->num_allocations += 1;
     trie->total_memory += root_size;
@@ -103,7 +334,9 @@ trie_setup_from_file (Trie *trie, FILE *ifs)
     fread (&trie->roots[i], sizeof (TrieRef), 1, ifs);
   }
   /* Blocks */
+  trie->malloced_blocks = 1;
   nbranches = trie->nbranches;
+  i = 0;
   while (nbranches > 0) {
     unsigned long long size = nbranches;
     unsigned long long branches_size;
@@ -116,6 +349,7 @@ trie_setup_from_file (Trie *trie, FILE *ifs)
     }
     fread (trie->branches[i], sizeof (TrieNodeBranch), size, ifs);
     nbranches -= size;
+    i += 1;
   }
   return 0;
 }
@@ -166,10 +400,8 @@ trie_write_to_file (Trie *trie, FILE *ofs)
   len += 8;
   /* Roots */
   unsigned long long nroots = 1ULL << trie->nbits_root;
-  for (i = 0; i < nroots; i++) {
-    fwrite (&trie->roots[i], sizeof (TrieRef), 1, ofs);
-    len += sizeof (TrieRef);
-  }
+  fwrite (trie->roots, sizeof (TrieRef), nroots, ofs);
+  len += nroots * sizeof (TrieRef);
   /* Blocks */
   for (i = 0; i < 1024; i++) {
     if (trie->branches[i] != NULL) {
@@ -199,7 +431,12 @@ trie_allocate_branch (Trie *trie, unsigned int aidx)
     }
     if (!trie->branches[block]) {
       unsigned long long size = TRIE_BLOCK_SIZE * sizeof (TrieNodeBranch);
-      trie->branches[block] = (TrieNodeBranch *) malloc (size);
+      /* Only reserve address space, pages are committed as branches are used */
+      trie->branches[block] = (TrieNodeBranch *) mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (trie->branches[block] == (TrieNodeBranch *) MAP_FAILED) {
+        fprintf (stderr, "trie_allocate_branch: Cannot allocate block %llu\n", block);
+        exit (1);
+      }
       if (gt4_trie_debug & GT4_TRIE_COUNT_ALLOCATIONS) {
         trie->num_allocations += 1;
         trie->total_memory += size;
@@ -366,6 +603,58 @@ trie_node_add_word (Trie *trie, TrieRef ref, unsigned int level, unsigned long l
   }
 }
 
+/*
+ * Build subtree of sorted unique words (low nbits are used) bottom-up, children before parent
+ * Gives the same nodes as adding words one by one (nbits <= KMER_MAX_BITS + 1 + BRANCH_MAX_BITS_THIS)
+ */
+
+static TrieRef
+trie_node_build_sorted (Trie *trie, const unsigned long long words[], const unsigned int counts[], unsigned long long nwords, unsigned int nbits, unsigned int aidx)
+{
+  unsigned long long mask = (1ULL << nbits) - 1;
+  unsigned long long word = words[0] & mask, diff, lo, hi;
+  unsigned int nbits_this, bit;
+  TrieRef ref, children[2];
+  TrieNodeBranch *branch;
+
+  diff = word ^ (words[nwords - 1] & mask);
+  /* Common prefix length */
+  nbits_this = (diff) ? __builtin_clzll (diff) - (64 - nbits) : nbits;
+  if (nbits > KMER_MAX_BITS) {
+    unsigned int nbits_chain = nbits - KMER_MAX_BITS - 1;
+    if (nbits_this > nbits_chain) {
+      /* Single child, as created for a new word */
+      bit = nbits - nbits_chain - 1;
+      children[0] = trie_node_build_sorted (trie, words, counts, nwords, bit, aidx);
+      ref = trie_node_branch_new (trie, word >> (bit + 1), nbits_chain, 1, aidx);
+      branch = BRANCH_FROM_REF (trie, ref);
+      branch->children[(word >> bit) & 1] = children[0];
+      return ref;
+    }
+  } else if (!diff) {
+    return trie_node_kmer_new (trie, word, nbits, counts[0]);
+  }
+  /* Split at the first differing bit, words with it unset come first */
+  bit = nbits - nbits_this - 1;
+  lo = 1;
+  hi = nwords - 1;
+  while (lo < hi) {
+    unsigned long long mid = (lo + hi) / 2;
+    if ((words[mid] >> bit) & 1) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  children[0] = trie_node_build_sorted (trie, words, counts, lo, bit, aidx);
+  children[1] = trie_node_build_sorted (trie, words + lo, counts + lo, nwords - lo, bit, aidx);
+  ref = trie_node_branch_new (trie, word >> (bit + 1), nbits_this, 1, aidx);
+  branch = BRANCH_FROM_REF (trie, ref);
+  branch->children[0] = children[0];
+  branch->children[1] = children[1];
+  return ref;
+}
+
 static unsigned int
 trie_node_kmer_lookup (TrieRef kmer, unsigned long long word, unsigned int nbits)
 {
@@ -411,3 +700,35 @@ trie_node_lookup (Trie *trie, TrieRef ref, unsigned long long word, unsigned int
     return trie_node_branch_lookup (trie, ref, word, nbits);
   }
 }
+
+static unsigned int
+trie_node_foreach (Trie *trie, TrieRef ref, unsigned long long prefix, unsigned int nbits, unsigned int (*func) (unsigned long long, unsigned int, void *), void *data)
+{
+  if (REF_IS_EMPTY(ref)) return 0;
+  if (REF_IS_KMER (ref)) {
+    return func ((prefix << nbits) | KMER_GET_WORD (ref), KMER_GET_COUNT (ref), data);
+  } else {
+    TrieNodeBranch *branch = BRANCH_FROM_REF(trie, ref);
+    unsigned long long nbits_this, nbits_children, c;
+    nbits_this = BRANCH_GET_NBITS_THIS (branch);
+    nbits_children = BRANCH_GET_NBITS_CHILDREN (branch);
+    prefix = (prefix << nbits_this) | branch->word;
+    for (c = 0; c < (1ULL << nbits_children); c++) {
+      if (trie_node_foreach (trie, branch->children[c], (prefix << nbits_children) | c, nbits - nbits_this - nbits_children, func, data)) return 1;
+    }
+    return 0;
+  }
+}
+
+static unsigned long long
+trie_node_count_branches (Trie *trie, TrieRef ref)
+{
+  TrieNodeBranch *branch;
+  unsigned long long c, n = 1;
+  if (REF_IS_EMPTY (ref) || REF_IS_KMER (ref)) return 0;
+  branch = BRANCH_FROM_REF (trie, ref);
+  for (c = 0; c < (1ULL << BRANCH_GET_NBITS_CHILDREN (branch)); c++) {
+    n += trie_node_count_branches (trie, branch->children[c]);
+  }
+  return n;
+}
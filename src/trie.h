@@ -24,10 +24,19 @@ struct _TrieNodeBranch {
 /* Debug flags */
 #define GT4_TRIE_COUNT_ALLOCATIONS 1
 
-/* Allocation */
+/* Allocation (binary databases are only readable with the same block bits) */
+#ifndef TRIE_BLOCK_BITS
 #define TRIE_BLOCK_BITS 30
+#endif
 #define TRIE_BLOCK_SIZE (1ULL << TRIE_BLOCK_BITS)
 
+/* Root table width, 0 - select from number of words (binary databases store their own) */
+#ifndef TRIE_ROOT_BITS
+#define TRIE_ROOT_BITS 0
+#endif
+#define TRIE_MIN_ROOT_BITS 8
+#define TRIE_MAX_ROOT_BITS 28
+
 #define TRIE_BLOCK_FROM_REF(r) ((((r) >> 2) >> TRIE_BLOCK_BITS) & 0x3ff)
 #define TRIE_INDEX_FROM_REF(r) (((r) >> 2) & (TRIE_BLOCK_SIZE - 1))
 #define TRIE_ADDRESS_FROM_REF(t,r) ((t)->branches[TRIE_BLOCK_FROM_REF(r)] + TRIE_INDEX_FROM_REF(r))
@@ -56,10 +65,10 @@ struct _TrieNodeBranch {
 #define MAKE_KMER(b,w,c) (((unsigned long long) (b) << 59) | ((unsigned long long) (w) << 33) | ((unsigned long long) (c) << 1) | TYPE_KMER)
 
 /* Branch */
-/* nbits_this:5 nbits_children:5 word:32 */
+/* nbits_this:5 nbits_children:6 word:26 */
 /* INVARIANT: branch max bits >= kmer max bits */
 
-#define BRANCH_MAX_BITS_THIS 52
+#define BRANCH_MAX_BITS_THIS 26
 #define BRANCH_MAX_BITS_CHILDREN 64
 
 #define BRANCH_GET_NBITS_THIS(n) (n)->_nbits_this
@@ -86,6 +95,12 @@ struct _Trie {
   /* Blocks */
   unsigned long long nbranches;
   TrieNodeBranch *branches[1024];
+  /* Rewritten by trie_compact */
+  unsigned int compact;
+  /* Blocks are malloced (compacted or read from file), otherwise mmapped by allocators or in mapped data */
+  unsigned int malloced_blocks;
+  /* Roots are allocated, otherwise in mapped data */
+  unsigned int owned_roots;
   /* Debug */
   unsigned int num_allocations;
   unsigned long long total_memory;
@@ -94,10 +109,29 @@ struct _Trie {
 Trie *trie_new (unsigned int nbits, unsigned int nbits_root, unsigned int nallocators);
 void trie_setup (Trie *trie, unsigned int nbits, unsigned int nbits_root);
 void trie_setup_full (Trie *trie, unsigned int nbits, unsigned int nbits_root, unsigned int nallocators);
+/* Root width for given word size and expected number of words */
+unsigned int trie_select_root_bits (unsigned int nbits, unsigned long long nwords);
+/* Frees allocated blocks and roots, mapped ones are left to the data */
 void trie_release (Trie *trie);
 void trie_add_word (Trie *trie, unsigned long long word, unsigned int count);
 void trie_add_word_with_allocator (Trie *trie, unsigned long long word, unsigned int count, unsigned int aidx);
+/*
+ * Add words sorted in ascending order, result is the same as with trie_add_word
+ * Subtrees of empty roots are built bottom-up from the sorted run
+ */
+void trie_add_sorted_words_with_allocator (Trie *trie, const unsigned long long words[], const unsigned int counts[], unsigned long long nwords, unsigned int aidx);
 unsigned int trie_lookup (Trie *trie, unsigned long long word);
+/* Look up many words, interleaving lookups and prefetching next nodes to hide memory latency */
+void trie_lookup_batch (Trie *trie, const unsigned long long words[], unsigned int results[], unsigned long long nwords);
+/* Call func for every word in trie (in order of roots), stop if func returns nonzero */
+unsigned int trie_foreach (Trie *trie, unsigned int (*func) (unsigned long long word, unsigned int count, void *data), void *data);
+
+/*
+ * Rewrite branches into minimal contiguous blocks, every root subtree breadth-first
+ * Mapped trie without holes is only marked compact
+ * No words can be added after compaction, returns number of branch slots (0 on error)
+ */
+unsigned long long trie_compact (Trie *trie);
 
 unsigned int trie_setup_from_file (Trie *trie, FILE *ofs);
 unsigned int trie_setup_from_data (Trie *trie, const unsigned char *cdata);
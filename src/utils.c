@@ -21,7 +21,11 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
+#include <stdio.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/time.h>
@@ -172,6 +176,34 @@ get_time (void)
 	return dtval;
 }
 
+unsigned long long
+get_thread_page_faults (void)
+{
+	struct rusage ru;
+	if (getrusage (RUSAGE_THREAD, &ru)) return 0;
+	return ru.ru_minflt + ru.ru_majflt;
+}
+
+void
+get_rss (unsigned long long *rss, unsigned long long *max_rss)
+{
+	struct rusage ru;
+	unsigned long long size = 0, resident = 0;
+	FILE *ifs;
+	*rss = 0;
+	ifs = fopen ("/proc/self/statm", "r");
+	if (ifs) {
+		if (fscanf (ifs, "%llu %llu", &size, &resident) == 2) {
+			*rss = resident * sysconf (_SC_PAGESIZE);
+		}
+		fclose (ifs);
+	}
+	*max_rss = 0;
+	if (!getrusage (RUSAGE_SELF, &ru)) {
+		*max_rss = (unsigned long long) ru.ru_maxrss * 1024;
+	}
+}
+
 unsigned long long
 rand_long_long (unsigned long long min, unsigned long long max)
 {
@@ -37,6 +37,11 @@ void insertionSort (unsigned long long *begin, unsigned long long *end, unsigned
 void hybridInPlaceRadixSort256 (unsigned long long *begin, unsigned long long *end, unsigned int *begfreq, unsigned int shift);
 
 double get_time (void);
+
+/* Page faults (minor + major) of the calling thread */
+unsigned long long get_thread_page_faults (void);
+/* Current and peak resident set size of the process in bytes */
+void get_rss (unsigned long long *rss, unsigned long long *max_rss);
 unsigned long long rand_long_long (unsigned long long min, unsigned long long max);
 
 /* Split line into tokens */
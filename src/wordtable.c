@@ -1,4 +1,5 @@
 #define WORDTABLE_C
+#define _GNU_SOURCE
 
 /*
  * GenomeTester4
@@ -25,6 +26,8 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "sequence.h"
 #include "wordtable.h"
@@ -35,6 +38,123 @@
 unsigned int debug_tables;
 unsigned long long total_memory = 0;
 
+/* Default address space reservation for mmap strategies (words) */
+#define WORDTABLE_DEFAULT_RESERVE (1ULL << 32)
+#define WORDTABLE_HUGEPAGE_SIZE (2ULL * 1024 * 1024)
+#define WORDTABLE_POOL_SIZE 512
+
+static unsigned int default_allocation = WORDTABLE_ALLOC_MALLOC;
+static unsigned long long default_reserve = WORDTABLE_DEFAULT_RESERVE;
+
+/*
+ * Pool of released mappings
+ * Pages stay committed, so recycled regions do not fault again
+ */
+
+typedef struct _MappedRegion {
+	void *mem;
+	unsigned long long size;
+	unsigned int allocation;
+} MappedRegion;
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int pool_nregions = 0;
+static MappedRegion pool_regions[WORDTABLE_POOL_SIZE];
+
+void
+wordtable_set_allocation (unsigned int allocation, unsigned long long reserve)
+{
+	default_allocation = allocation;
+	default_reserve = (reserve) ? reserve : WORDTABLE_DEFAULT_RESERVE;
+}
+
+static unsigned long long
+round_to_hugepage (unsigned long long size)
+{
+	return (size + WORDTABLE_HUGEPAGE_SIZE - 1) & ~(WORDTABLE_HUGEPAGE_SIZE - 1);
+}
+
+/* Get region of at least size bytes, size is updated to actual size */
+static void *
+region_map (unsigned long long *size, unsigned int allocation)
+{
+	unsigned int i, best;
+	void *mem;
+	/* Try pool first, prefer smallest sufficient region */
+	pthread_mutex_lock (&pool_mutex);
+	best = pool_nregions;
+	for (i = 0; i < pool_nregions; i++) {
+		if ((pool_regions[i].allocation == allocation) && (pool_regions[i].size >= *size)) {
+			if ((best == pool_nregions) || (pool_regions[i].size < pool_regions[best].size)) best = i;
+		}
+	}
+	if (best < pool_nregions) {
+		mem = pool_regions[best].mem;
+		*size = pool_regions[best].size;
+		pool_regions[best] = pool_regions[--pool_nregions];
+		pthread_mutex_unlock (&pool_mutex);
+		return mem;
+	}
+	pthread_mutex_unlock (&pool_mutex);
+	/* Reserve new address space, pages are committed on first touch */
+	*size = round_to_hugepage (*size);
+	mem = mmap (NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED) return NULL;
+	if (allocation == WORDTABLE_ALLOC_HUGE) {
+		madvise (mem, *size, MADV_HUGEPAGE);
+	}
+	return mem;
+}
+
+/* Grow region without copying, size is updated to actual size */
+static void *
+region_remap (void *mem, unsigned long long oldsize, unsigned long long *size, unsigned int allocation)
+{
+	void *newmem;
+	*size = round_to_hugepage (*size);
+	newmem = mremap (mem, oldsize, *size, MREMAP_MAYMOVE);
+	if (newmem == MAP_FAILED) return NULL;
+	if (allocation == WORDTABLE_ALLOC_HUGE) {
+		madvise (newmem, *size, MADV_HUGEPAGE);
+	}
+	return newmem;
+}
+
+/* Return region to pool (or unmap it if pool is full) */
+static void
+region_unmap (void *mem, unsigned long long size, unsigned int allocation)
+{
+	if (!mem) return;
+	pthread_mutex_lock (&pool_mutex);
+	if (pool_nregions < WORDTABLE_POOL_SIZE) {
+		pool_regions[pool_nregions].mem = mem;
+		pool_regions[pool_nregions].size = size;
+		pool_regions[pool_nregions].allocation = allocation;
+		pool_nregions += 1;
+		mem = NULL;
+	}
+	pthread_mutex_unlock (&pool_mutex);
+	if (mem) munmap (mem, size);
+}
+
+/* Ensure that array has at least size elements of given element size */
+static void *
+wordtable_reserve (wordtable *table, void *mem, unsigned long long *reserved, unsigned long long size, unsigned int esize)
+{
+	unsigned long long nbytes;
+	if (size <= *reserved) return mem;
+	if (!mem) {
+		nbytes = ((size > default_reserve) ? size : default_reserve) * esize;
+		mem = region_map (&nbytes, table->allocation);
+	} else {
+		nbytes = ((size > 2 * *reserved) ? size : 2 * *reserved) * esize;
+		mem = region_remap (mem, *reserved * esize, &nbytes, table->allocation);
+	}
+	if (!mem) return NULL;
+	*reserved = nbytes / esize;
+	return mem;
+}
+
 wordtable *
 wordtable_new (unsigned int wordlength, unsigned long long size)
 {
@@ -44,6 +164,7 @@ wordtable_new (unsigned int wordlength, unsigned long long size)
 	table = (wordtable *) malloc (sizeof (wordtable));
 	if (!table) return NULL;
 	memset (table, 0, sizeof (wordtable));
+	table->allocation = default_allocation;
 	/* Set ID */
 	char *c = "AA";
 	strcpy (table->id, c);
@@ -56,16 +177,34 @@ wordtable_new (unsigned int wordlength, unsigned long long size)
 	return table;
 }
 
-void 
-wordtable_delete (wordtable *table)
+/* Release words and frequencies, table itself is left intact */
+static void
+wordtable_release (wordtable *table)
 {
 	if (debug_tables) {
 		unsigned long long size =  table->nwordslots * 8 + table->nfreqslots * 4;
 		fprintf (stderr, "Table %s releasing %llu total %.2fG\n", table->id, (unsigned long long) size, (double) total_memory / 1073741824.0);
 		total_memory -= size;
 	}
-	free (table->words);
-	free (table->frequencies);
+	if (table->allocation == WORDTABLE_ALLOC_MALLOC) {
+		free (table->words);
+		free (table->frequencies);
+	} else {
+		region_unmap (table->words, table->nwordsreserved * sizeof (unsigned long long), table->allocation);
+		region_unmap (table->frequencies, table->nfreqsreserved * sizeof (unsigned int), table->allocation);
+	}
+	table->words = NULL;
+	table->frequencies = NULL;
+	table->nwordslots = 0;
+	table->nfreqslots = 0;
+	table->nwordsreserved = 0;
+	table->nfreqsreserved = 0;
+}
+
+void 
+wordtable_delete (wordtable *table)
+{
+	wordtable_release (table);
 	free (table);
 	return;
 }
@@ -88,7 +227,11 @@ wordtable_ensure_size (wordtable *table, unsigned long long size, unsigned long
 			fprintf (stderr, "Table %s allocating words %llu total %.2fG\n", table->id, (unsigned long long) asize, (double) total_memory / 1073741824.0);
 		}
 		table->nwordslots = size;
-		table->words = (unsigned long long *) realloc (table->words, table->nwordslots * sizeof (unsigned long long));
+		if (table->allocation == WORDTABLE_ALLOC_MALLOC) {
+			table->words = (unsigned long long *) realloc (table->words, table->nwordslots * sizeof (unsigned long long));
+		} else {
+			table->words = (unsigned long long *) wordtable_reserve (table, table->words, &table->nwordsreserved, size, sizeof (unsigned long long));
+		}
 		if (!table->words) return GT_OUT_OF_MEMORY_ERROR;
 	}
 	if (table->nfreqslots < freqsize) {
@@ -98,7 +241,11 @@ wordtable_ensure_size (wordtable *table, unsigned long long size, unsigned long
 			fprintf (stderr, "Table %s allocating freqs %llu total %.2fG\n", table->id, (unsigned long long) asize, (double) total_memory / 1073741824.0);
 		}
 		table->nfreqslots = freqsize;
-		table->frequencies = (unsigned int *) realloc (table->frequencies, table->nfreqslots * sizeof (unsigned int));
+		if (table->allocation == WORDTABLE_ALLOC_MALLOC) {
+			table->frequencies = (unsigned int *) realloc (table->frequencies, table->nfreqslots * sizeof (unsigned int));
+		} else {
+			table->frequencies = (unsigned int *) wordtable_reserve (table, table->frequencies, &table->nfreqsreserved, freqsize, sizeof (unsigned int));
+		}
 		if (!table->frequencies) return GT_OUT_OF_MEMORY_ERROR;
 	}
 	return 0;
@@ -231,6 +378,186 @@ wordtable_merge (wordtable *table, wordtable *other)
 	return 0;
 }
 
+/*
+ * Parallel merge
+ *
+ * Output is split into equal segments by co-ranking (merge path). Equal words are kept
+ * in the same segment. Table is grown in place, the table part of every segment is moved
+ * to the start of its output range and then each segment is merged backwards by its own thread.
+ */
+
+#define WORDTABLE_PARALLEL_MERGE_MIN 1000000
+#define WORDTABLE_MAX_MERGE_THREADS 256
+
+typedef struct _MergeSegment {
+	wordtable *table;
+	wordtable *other;
+	unsigned long long i0, i1, j0, j1;
+	unsigned long long pos, end, nequals;
+} MergeSegment;
+
+/* Find the number of table words among the first d words of merged sequence */
+static unsigned long long
+merge_corank (wordtable *table, wordtable *other, unsigned long long d)
+{
+	unsigned long long lo, hi, i;
+	lo = (d > other->nwords) ? d - other->nwords : 0;
+	hi = (d < table->nwords) ? d : table->nwords;
+	while (lo < hi) {
+		i = (lo + hi) / 2;
+		if (table->words[i] <= other->words[d - i - 1]) {
+			lo = i + 1;
+		} else {
+			hi = i;
+		}
+	}
+	return lo;
+}
+
+static void *
+merge_count_equals (void *data)
+{
+	MergeSegment *seg = (MergeSegment *) data;
+	unsigned long long i = seg->i0, j = seg->j0;
+	seg->nequals = 0;
+	while ((i < seg->i1) && (j < seg->j1)) {
+		if (seg->table->words[i] == seg->other->words[j]) {
+			seg->nequals += 1;
+			i += 1;
+			j += 1;
+		} else if (seg->table->words[i] < seg->other->words[j]) {
+			i += 1;
+		} else {
+			j += 1;
+		}
+	}
+	return NULL;
+}
+
+/* Table words of segment are at [pos, pos + i1 - i0), writing never overtakes reading */
+static void *
+merge_segment (void *data)
+{
+	MergeSegment *seg = (MergeSegment *) data;
+	unsigned long long *tw = seg->table->words + seg->pos - seg->i0;
+	unsigned int *tf = seg->table->frequencies + seg->pos - seg->i0;
+	unsigned long long *dw = seg->table->words;
+	unsigned int *df = seg->table->frequencies;
+	const unsigned long long *ow = seg->other->words;
+	const unsigned int *of = seg->other->frequencies;
+	unsigned long long i = seg->i1, j = seg->j1, k = seg->end;
+	while ((i > seg->i0) && (j > seg->j0)) {
+		if (tw[i - 1] == ow[j - 1]) {
+			k -= 1;
+			dw[k] = tw[i - 1];
+			df[k] = tf[i - 1] + of[j - 1];
+			i -= 1;
+			j -= 1;
+		} else if (tw[i - 1] > ow[j - 1]) {
+			k -= 1;
+			dw[k] = tw[i - 1];
+			df[k] = tf[i - 1];
+			i -= 1;
+		} else {
+			k -= 1;
+			dw[k] = ow[j - 1];
+			df[k] = of[j - 1];
+			j -= 1;
+		}
+	}
+	/* Remaining table words are already in place */
+	while (j > seg->j0) {
+		k -= 1;
+		dw[k] = ow[j - 1];
+		df[k] = of[j - 1];
+		j -= 1;
+	}
+	return NULL;
+}
+
+static void
+merge_run (MergeSegment *segs, unsigned int nsegs, void *(*func) (void *))
+{
+	pthread_t threads[WORDTABLE_MAX_MERGE_THREADS];
+	unsigned int t;
+	for (t = 1; t < nsegs; t++) {
+		if (pthread_create (&threads[t], NULL, func, &segs[t])) threads[t] = 0;
+	}
+	func (&segs[0]);
+	for (t = 1; t < nsegs; t++) {
+		/* Fall back to running in this thread */
+		if (threads[t]) {
+			pthread_join (threads[t], NULL);
+		} else {
+			func (&segs[t]);
+		}
+	}
+}
+
+int 
+wordtable_merge_parallel (wordtable *table, wordtable *other, unsigned int nthreads)
+{
+	MergeSegment segs[WORDTABLE_MAX_MERGE_THREADS];
+	unsigned long long total, nequals, size, step;
+	unsigned int t;
+	int v;
+
+	if (table->wordlength != other->wordlength) return GT_INCOMPATIBLE_WORDLENGTH_ERROR;
+	total = table->nwords + other->nwords;
+	if (nthreads > WORDTABLE_MAX_MERGE_THREADS) nthreads = WORDTABLE_MAX_MERGE_THREADS;
+	if (nthreads > total / WORDTABLE_PARALLEL_MERGE_MIN) nthreads = total / WORDTABLE_PARALLEL_MERGE_MIN;
+	if (nthreads < 2) return wordtable_merge (table, other);
+
+	/* Partition */
+	for (t = 0; t <= nthreads; t++) {
+		unsigned long long d = total * t / nthreads, i, j;
+		i = merge_corank (table, other, d);
+		j = d - i;
+		/* Move the other half of equal pair to the preceding segment */
+		if ((i > 0) && (j < other->nwords) && (table->words[i - 1] == other->words[j])) j += 1;
+		if (t < nthreads) {
+			segs[t].table = table;
+			segs[t].other = other;
+			segs[t].i0 = i;
+			segs[t].j0 = j;
+		}
+		if (t > 0) {
+			segs[t - 1].i1 = i;
+			segs[t - 1].j1 = j;
+		}
+	}
+	merge_run (segs, nthreads, merge_count_equals);
+	nequals = 0;
+	for (t = 0; t < nthreads; t++) {
+		segs[t].pos = segs[t].i0 + segs[t].j0 - nequals;
+		nequals += segs[t].nequals;
+		if (t > 0) segs[t - 1].end = segs[t].pos;
+	}
+	segs[nthreads - 1].end = total - nequals;
+
+	/* Grow in place with the same slack as wordtable_merge */
+	size = total - nequals;
+	if (size > table->nwordslots) {
+		step = (table->nwordslots + 7) >> 3;
+		if (size - table->nwords < step) size = table->nwords + step;
+	}
+	v = wordtable_ensure_size (table, size, size);
+	if (v > 0) return v;
+
+	/* Segments only move right, so the last one is moved first */
+	for (t = nthreads; t > 0; t--) {
+		MergeSegment *seg = &segs[t - 1];
+		if ((seg->pos > seg->i0) && (seg->i1 > seg->i0)) {
+			memmove (table->words + seg->pos, table->words + seg->i0, (seg->i1 - seg->i0) * sizeof (unsigned long long));
+			memmove (table->frequencies + seg->pos, table->frequencies + seg->i0, (seg->i1 - seg->i0) * sizeof (unsigned int));
+		}
+	}
+	merge_run (segs, nthreads, merge_segment);
+
+	table->nwords = total - nequals;
+	return 0;
+}
+
 void 
 wordtable_sort (wordtable *table, int sortfreqs)
 {
@@ -31,6 +31,14 @@
 extern unsigned int debug_tables;
 #endif
 
+/* Allocation strategies for words and frequencies */
+/* MALLOC - grow by realloc (default) */
+/* MMAP - reserve address space and let kernel commit pages on first touch, grow without copying */
+/* HUGE - as MMAP but ask for transparent hugepages */
+#define WORDTABLE_ALLOC_MALLOC 0
+#define WORDTABLE_ALLOC_MMAP 1
+#define WORDTABLE_ALLOC_HUGE 2
+
 typedef struct _wordtable {
 	unsigned int wordlength;	/* initial length of the considered words */
         char id[16];	/* Text ID for debugging */
@@ -39,12 +47,20 @@ typedef struct _wordtable {
 	unsigned long long nwords;		/* filled slots */
 	unsigned long long *words;
 	unsigned int *frequencies;
+	unsigned int allocation;	/* strategy used for words and frequencies */
+	unsigned long long nwordsreserved;	/* reserved slots (mmap strategies only) */
+	unsigned long long nfreqsreserved;
 } wordtable;
 
+/* Set allocation strategy for subsequently created tables */
+/* Reserve is the number of slots to reserve address space for (0 - default) */
+void wordtable_set_allocation (unsigned int allocation, unsigned long long reserve);
+
 wordtable *wordtable_new (unsigned int wordlength, unsigned long long size);
 
 void wordtable_delete (wordtable *table);
 
+/* Keeps allocated (and for mmap strategies already committed) memory for reuse */
 void wordtable_empty (wordtable *table);
 
 int wordtable_enlarge (wordtable *table);
@@ -56,6 +72,9 @@ int wordtable_add_word (wordtable *table, unsigned long long word, unsigned int
 int wordtable_add_word_nofreq (wordtable *table, unsigned long long word, unsigned int wordlength);
 
 int wordtable_merge (wordtable *table, wordtable *other);
+/* Merge in place using up to nthreads threads */
+/* Falls back to wordtable_merge for small tables */
+int wordtable_merge_parallel (wordtable *table, wordtable *other, unsigned int nthreads);
 
 void wordtable_sort (wordtable *table, int sortfreqs);
 